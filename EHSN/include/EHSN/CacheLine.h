@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstddef>
+
+namespace EHSN {
+	constexpr size_t CACHE_LINE_SIZE = 64; // Data written by different threads is kept this far apart to avoid false sharing.
+}
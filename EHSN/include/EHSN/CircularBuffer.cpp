@@ -1,89 +1,162 @@
 #include "CircularBuffer.h"
 
+#include <cstring>
+#include <thread>
+
 namespace EHSN
 {
+	constexpr uint32_t CIRCULAR_BUFFER_SPIN_COUNT = 64;
+
 	CircularBuffer::CircularBuffer(size_t size)
-		: m_buffer(size)
-	{}
+	{
+		size_t capacity = 1;
+		while (capacity < size)
+			capacity <<= 1;
+
+		m_buffer.resize(capacity);
+		m_mask = capacity - 1;
+	}
 
 	CircularBuffer::CircularBuffer(CircularBuffer&& other)
 	{
 		m_readOffset = other.m_readOffset.load();
 		m_writeOffset = other.m_writeOffset.load();
-		m_buffer = other.m_buffer;
+		m_writeReserved = other.m_writeReserved.load();
+		m_buffer = std::move(other.m_buffer);
+		m_mask = other.m_mask;
 	}
 
 	void CircularBuffer::read(void* pData, size_t size)
 	{
-		std::lock_guard<std::mutex> lock(m_mtxRead);
-		{
-			std::unique_lock<std::mutex> offLock(m_mtxOffset);
-			m_condNotify.wait(offLock, [&]() { return nReadable() >= size; });
-
-			size_t seqLength = m_buffer.size() - m_readOffset;
-			if (seqLength < size)
-			{
-				memcpy(pData, m_buffer.data() + m_readOffset, seqLength);
-				pData = (char*)pData + seqLength;
-				moveReadOffset(seqLength);
-				seqLength = size - seqLength;
-			}
-			else
-			{
-				seqLength = size;
-			}
-			memcpy(pData, m_buffer.data() + m_readOffset, seqLength);
-			moveReadOffset(seqLength);
-		}
-
-		m_condNotify.notify_all();
+		while (!tryRead(pData, size))
+			waitFor([this, size]() { return nReadable() >= size; });
 	}
 
 	void CircularBuffer::write(const void* pData, size_t size)
 	{
-		std::lock_guard<std::mutex> lock(m_mtxWrite);
+		while (!tryWrite(pData, size))
+			waitFor([this, size]() { return nWritable() >= size; });
+	}
+
+	bool CircularBuffer::tryRead(void* pData, size_t size)
+	{
+		size_t readOffset = m_readOffset.load(std::memory_order_relaxed);
+		if (m_writeOffset.load(std::memory_order_acquire) - readOffset < size)
+			return false;
+
+		Regions regions = regionsAt(readOffset, size);
+		memcpy(pData, regions.first.data, regions.first.size);
+		memcpy((char*)pData + regions.first.size, regions.second.data, regions.second.size);
+
+		moveReadOffset(size);
+		return true;
+	}
+
+	bool CircularBuffer::tryWrite(const void* pData, size_t size)
+	{
+		// Reserve the range first, so concurrent writers never touch the same bytes.
+		size_t start = m_writeReserved.load(std::memory_order_relaxed);
+		do
 		{
-			std::unique_lock<std::mutex> offLock(m_mtxOffset);
-			m_condNotify.wait(offLock, [&]() { return nWritable() >= size; });
-
-			size_t seqLength = m_buffer.size() - m_writeOffset;
-			if (seqLength < size)
-			{
-				memcpy(m_buffer.data() + m_writeOffset, pData, seqLength);
-				pData = (char*)pData + seqLength;
-				moveWriteOffset(seqLength);
-				seqLength = size - seqLength;
-			}
-			else
-			{
-				seqLength = size;
-			}
-			memcpy(m_buffer.data() + m_writeOffset, pData, seqLength);
-			moveWriteOffset(size);
-		}
+			if (capacity() - (start - m_readOffset.load(std::memory_order_acquire)) < size)
+				return false;
+		} while (!m_writeReserved.compare_exchange_weak(start, start + size, std::memory_order_acq_rel, std::memory_order_relaxed));
 
-		m_condNotify.notify_all();
+		Regions regions = regionsAt(start, size);
+		memcpy(regions.first.data, pData, regions.first.size);
+		memcpy(regions.second.data, (const char*)pData + regions.first.size, regions.second.size);
+
+		// Publish in reservation order, so the reader never sees a gap.
+		while (m_writeOffset.load(std::memory_order_acquire) != start)
+			std::this_thread::yield();
+		m_writeOffset.store(start + size, std::memory_order_release);
+
+		notifyWaiters();
+		return true;
 	}
 
 	size_t CircularBuffer::nReadable() const
 	{
-		if (m_readOffset <= m_writeOffset)
-			return m_writeOffset - m_readOffset;
-		return m_buffer.size() - (m_readOffset - m_writeOffset);
+		return m_writeOffset.load(std::memory_order_acquire) - m_readOffset.load(std::memory_order_acquire);
 	}
-	
+
 	size_t CircularBuffer::nWritable() const
 	{
-		return m_buffer.size() - nReadable();
+		return capacity() - (m_writeReserved.load(std::memory_order_acquire) - m_readOffset.load(std::memory_order_acquire));
+	}
+
+	size_t CircularBuffer::capacity() const
+	{
+		return m_mask + 1;
+	}
+
+	CircularBuffer::Regions CircularBuffer::peekRead()
+	{
+		size_t readOffset = m_readOffset.load(std::memory_order_relaxed);
+		return regionsAt(readOffset, m_writeOffset.load(std::memory_order_acquire) - readOffset);
+	}
+
+	CircularBuffer::Regions CircularBuffer::peekWrite()
+	{
+		size_t writeOffset = m_writeOffset.load(std::memory_order_relaxed);
+		return regionsAt(writeOffset, capacity() - (writeOffset - m_readOffset.load(std::memory_order_acquire)));
 	}
 
 	void CircularBuffer::moveReadOffset(size_t nAdd)
 	{
-		m_readOffset = (m_readOffset + nAdd) % m_buffer.size();
+		m_readOffset.store(m_readOffset.load(std::memory_order_relaxed) + nAdd, std::memory_order_release);
+		notifyWaiters();
 	}
 
 	void CircularBuffer::moveWriteOffset(size_t nAdd)
 	{
-		m_writeOffset = (m_writeOffset + nAdd) % m_buffer.size();
+		size_t newOffset = m_writeOffset.load(std::memory_order_relaxed) + nAdd;
+		m_writeReserved.store(newOffset, std::memory_order_relaxed);
+		m_writeOffset.store(newOffset, std::memory_order_release);
+		notifyWaiters();
+	}
+
+	CircularBuffer::Regions CircularBuffer::regionsAt(size_t offset, size_t size)
+	{
+		size_t pos = offset & m_mask;
+		size_t firstSize = std::min(size, capacity() - pos);
+
+		Regions regions;
+		regions.first.data = m_buffer.data() + pos;
+		regions.first.size = firstSize;
+		regions.second.data = m_buffer.data();
+		regions.second.size = size - firstSize;
+		return regions;
+	}
+
+	template <typename Pred>
+	void CircularBuffer::waitFor(Pred pred)
+	{
+		for (uint32_t i = 0; i < CIRCULAR_BUFFER_SPIN_COUNT; ++i)
+		{
+			if (pred())
+				return;
+			std::this_thread::yield();
+		}
+
+		++m_nWaiting;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		{
+			std::unique_lock<std::mutex> lock(m_mtxWait);
+			m_condNotify.wait(lock, pred);
+		}
+		--m_nWaiting;
+	}
+
+	void CircularBuffer::notifyWaiters()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_nWaiting.load(std::memory_order_relaxed) == 0)
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mtxWait);
+		}
+		m_condNotify.notify_all();
 	}
 }
\ No newline at end of file
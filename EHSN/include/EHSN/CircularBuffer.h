@@ -2,30 +2,165 @@
 
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+
+#include "CacheLine.h"
 
 namespace EHSN {
+
+	/*
+	* Byte ring buffer without a mutex on the data path.
+	*
+	* Any number of threads may write at the same time, but only one thread may read at a time.
+	* It is not lock-free: writers reserve their space with a CAS, but publish in reservation order,
+	* so a writer waits (yielding) until all earlier writers have finished copying.
+	* The zero-copy functions (peekRead/peekWrite + moveReadOffset/moveWriteOffset) must only be used by a single reader/writer.
+	*/
 	class CircularBuffer
 	{
+	public:
+		/*
+		* Contiguous part of the buffer.
+		*/
+		struct Region
+		{
+			char* data = nullptr;
+			size_t size = 0;
+		};
+		/*
+		* Up to two contiguous parts of the buffer (the second one is used when the data wraps around).
+		*/
+		struct Regions
+		{
+			Region first;
+			Region second;
+		public:
+			size_t size() const { return first.size + second.size; }
+		};
 	public:
 		CircularBuffer() = delete;
+		/*
+		* Constructor of CircularBuffer.
+		*
+		* @param size Minimum capacity of the buffer. Gets rounded up to the next power of two.
+		*/
 		CircularBuffer(size_t size);
-		CircularBuffer(const CircularBuffer&) = default;
+		CircularBuffer(const CircularBuffer&) = delete;
 		CircularBuffer(CircularBuffer&& other);
 	public:
+		/*
+		* Read data from the buffer.
+		*
+		* Blocks until size bytes are readable.
+		*
+		* @param pData Buffer to write the data to.
+		* @param size Number of bytes to read. Must not be greater than capacity().
+		*/
 		void read(void* pData, size_t size);
+		/*
+		* Write data to the buffer.
+		*
+		* Blocks until size bytes are writable.
+		*
+		* @param pData Buffer to read the data from.
+		* @param size Number of bytes to write. Must not be greater than capacity().
+		*/
 		void write(const void* pData, size_t size);
+		/*
+		* Read data from the buffer if enough data is available.
+		*
+		* @param pData Buffer to write the data to.
+		* @param size Number of bytes to read.
+		* @returns True if size bytes have been read. Otherwise false (nothing has been read).
+		*/
+		bool tryRead(void* pData, size_t size);
+		/*
+		* Write data to the buffer if enough space is available.
+		*
+		* @param pData Buffer to read the data from.
+		* @param size Number of bytes to write.
+		* @returns True if size bytes have been written. Otherwise false (nothing has been written).
+		*/
+		bool tryWrite(const void* pData, size_t size);
+		/*
+		* Get the number of bytes that can be read.
+		*
+		* @returns Number of readable bytes.
+		*/
 		size_t nReadable() const;
+		/*
+		* Get the number of bytes that can be written.
+		*
+		* @returns Number of writable bytes.
+		*/
 		size_t nWritable() const;
+		/*
+		* Get the capacity of the buffer.
+		*
+		* @returns Capacity of the buffer (always a power of two).
+		*/
+		size_t capacity() const;
 	public:
+		/*
+		* Get the readable part of the buffer without copying it.
+		*
+		* Call moveReadOffset to consume (parts of) the data afterwards.
+		*
+		* @returns The readable regions.
+		*/
+		Regions peekRead();
+		/*
+		* Get the writable part of the buffer without copying to it.
+		*
+		* Call moveWriteOffset to publish (parts of) the written data afterwards.
+		*
+		* @returns The writable regions.
+		*/
+		Regions peekWrite();
+		/*
+		* Consume data from the buffer.
+		*
+		* @param nAdd Number of bytes to consume. Must not be greater than nReadable().
+		*/
 		void moveReadOffset(size_t nAdd);
+		/*
+		* Publish data written to the buffer.
+		*
+		* @param nAdd Number of bytes to publish. Must not be greater than nWritable().
+		*/
 		void moveWriteOffset(size_t nAdd);
 	private:
-		std::mutex m_mtxRead;
-		std::mutex m_mtxWrite;
-		std::mutex m_mtxOffset;
-		std::atomic<size_t> m_readOffset = 0;
-		std::atomic<size_t> m_writeOffset = 0;
+		/*
+		* Get the regions starting at a position.
+		*
+		* @param offset Position (not wrapped) of the first byte.
+		* @param size Number of bytes.
+		* @returns The regions holding the bytes.
+		*/
+		Regions regionsAt(size_t offset, size_t size);
+		/*
+		* Block until pred returns true.
+		*
+		* Spins a few times before sleeping.
+		*
+		* @param pred Predicate to wait for.
+		*/
+		template <typename Pred>
+		void waitFor(Pred pred);
+		/*
+		* Wake all threads blocked in read/write.
+		*/
+		void notifyWaiters();
+	private:
+		alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_readOffset = 0;
+		alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_writeOffset = 0;
+		alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_writeReserved = 0;
+		alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> m_nWaiting = 0;
 		std::vector<char> m_buffer;
+		size_t m_mask;
+		std::mutex m_mtxWait;
 		std::condition_variable m_condNotify;
 	};
 } // namespace EHSN
\ No newline at end of file
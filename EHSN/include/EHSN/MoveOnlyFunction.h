@@ -0,0 +1,72 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+namespace EHSN {
+
+	template <typename Signature>
+	class MoveOnlyFunction;
+
+	/*
+	* Type-erased callable like std::function, which also accepts callables that cannot be copied
+	* (e.g. lambdas capturing a std::unique_ptr).
+	*/
+	template <typename R, typename... Args>
+	class MoveOnlyFunction<R(Args...)>
+	{
+		struct Callable
+		{
+			virtual ~Callable() = default;
+			virtual R call(Args... args) = 0;
+		};
+		template <typename F>
+		struct CallableImpl : Callable
+		{
+			template <typename G>
+			CallableImpl(G&& g) : func(std::forward<G>(g)) {}
+			R call(Args... args) override { return func(std::forward<Args>(args)...); }
+		public:
+			F func;
+		};
+	public:
+		MoveOnlyFunction() = default;
+		MoveOnlyFunction(std::nullptr_t) {}
+		/*
+		* Constructor of MoveOnlyFunction.
+		*
+		* @param func The callable to store. Null function pointers result in an empty MoveOnlyFunction.
+		*/
+		template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, MoveOnlyFunction>>>
+		MoveOnlyFunction(F&& func)
+		{
+			if constexpr (std::is_pointer_v<std::decay_t<F>>)
+			{
+				if (func == nullptr)
+					return;
+			}
+			m_callable = std::make_unique<CallableImpl<std::decay_t<F>>>(std::forward<F>(func));
+		}
+		MoveOnlyFunction(const MoveOnlyFunction&) = delete;
+		MoveOnlyFunction(MoveOnlyFunction&&) = default;
+		MoveOnlyFunction& operator=(const MoveOnlyFunction&) = delete;
+		MoveOnlyFunction& operator=(MoveOnlyFunction&&) = default;
+	public:
+		/*
+		* Call the stored callable.
+		*
+		* Must not be called on an empty MoveOnlyFunction.
+		*/
+		R operator()(Args... args) const { return m_callable->call(std::forward<Args>(args)...); }
+		/*
+		* Check if a callable is stored.
+		*
+		* @returns True if a callable is stored. Otherwise false.
+		*/
+		explicit operator bool() const { return m_callable != nullptr; }
+	private:
+		std::unique_ptr<Callable> m_callable;
+	};
+
+} // namespace EHSN
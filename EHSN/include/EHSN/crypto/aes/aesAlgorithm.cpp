@@ -2,7 +2,10 @@
 
 #include <cassert>
 #include <future>
+#include <mutex>
+#include <condition_variable>
 #include "EHSN/ThreadPool.h"
+#include "EHSN/CacheLine.h"
 
 namespace EHSN {
 	namespace crypto {
@@ -29,17 +32,22 @@ namespace EHSN {
 
 				uint64_t nBlocks = nBytes / AES_BLOCK_SIZE;
 				uint64_t nBlocksPerJob = nBlocks / nJobs;
+				nBlocksPerJob -= nBlocksPerJob % (CACHE_LINE_SIZE / AES_BLOCK_SIZE); // Jobs start on separate cache lines of (aligned) buffers, so threads never write to the same line.
 				uint64_t nBytesPerJob = nBlocksPerJob * AES_BLOCK_SIZE;
 				uint64_t nBytesLastJob = nBytes - nBytesPerJob * (nJobs - 1);
 
 				if (nBlocksPerJob == 0)
 					return crypt(cipherData, nBytes, clearData, key, false, func);
 
-				uint64_t lastJobNum = 0;
+				// Count down the own jobs, the pool's done-count includes jobs pushed by other threads.
+				std::mutex mtxDone;
+				std::condition_variable condDone;
+				uint64_t nRemaining = nJobs;
+
 				for (uint64_t i = 0; i < nJobs; ++i)
 				{
-					lastJobNum = threadPool->pushJob(
-						[func, cipherData, i, nJobs, nBytesLastJob, nBytesPerJob, clearData, key]()
+					threadPool->pushJob(
+						[&, func, cipherData, i, clearData]()
 						{
 							bool isLastJob = (i == nJobs - 1);
 							crypt(
@@ -50,13 +58,18 @@ namespace EHSN {
 								false,
 								func
 							);
+
+							std::unique_lock<std::mutex> lock(mtxDone);
+							if (--nRemaining == 0)
+								condDone.notify_one();
 						}
 					);
 					cipherData = (char*)cipherData + nBytesPerJob;
 					clearData = (char*)clearData + nBytesPerJob;
 				}
 
-				threadPool->wait(lastJobNum);
+				std::unique_lock<std::mutex> lock(mtxDone);
+				condDone.wait(lock, [&nRemaining]() { return nRemaining == 0; });
 
 				return nBytes;
 			}
@@ -1,8 +1,18 @@
 #pragma once
 
+#include "net/compression.h"
+#include "net/dataMetrics.h"
 #include "net/ioContext.h"
+#include "net/latencyHistogram.h"
 #include "net/packetBuffer.h"
+#include "net/packetChain.h"
+#include "net/packetReader.h"
+#include "net/packetWriter.h"
 #include "net/managedSocket.h"
+#include "net/messageView.h"
 #include "net/packets.h"
+#include "net/packetTypes.h"
+#include "net/packetTypeTable.h"
 #include "net/secAcceptor.h"
-#include "net/secSocket.h"
\ No newline at end of file
+#include "net/secSocket.h"
+#include "net/trace.h"
\ No newline at end of file
@@ -0,0 +1,298 @@
+#include "compression.h"
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+
+#ifdef EHSN_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef EHSN_WITH_LZ4
+#include <lz4.h>
+#endif
+
+namespace EHSN {
+	namespace net {
+		namespace compression {
+
+			#pragma pack(push, 1)
+			struct StreamHeader // Followed by nBlocks uint32_t block sizes and the compressed blocks.
+			{
+				Codec codec = CODEC_NONE;
+				uint8_t reserved[3] = {};
+				uint32_t nBlocks = 0;
+				uint64_t rawSize = 0;
+			};
+			#pragma pack(pop)
+
+			/*
+			* Get the maximum compressed size of a block.
+			*
+			* @param codec The codec to use.
+			* @param size Size of the raw block.
+			* @returns Maximum size of the compressed block. 0 if the codec is not available.
+			*/
+			static uint64_t blockBound(Codec codec, uint64_t size)
+			{
+				switch (codec)
+				{
+			#ifdef EHSN_WITH_ZLIB
+				case CODEC_ZLIB:
+					return compressBound((uLong)size);
+			#endif
+			#ifdef EHSN_WITH_LZ4
+				case CODEC_LZ4:
+					return LZ4_compressBound((int)size);
+			#endif
+				default:
+					return 0;
+				}
+			}
+
+			/*
+			* Compress a single block.
+			*
+			* @returns Size of the compressed block. 0 on failure.
+			*/
+			static uint64_t compressBlock(Codec codec, const void* src, uint64_t srcSize, void* dst, uint64_t dstCapacity)
+			{
+				switch (codec)
+				{
+			#ifdef EHSN_WITH_ZLIB
+				case CODEC_ZLIB:
+				{
+					uLongf dstSize = (uLongf)dstCapacity;
+					if (compress2((Bytef*)dst, &dstSize, (const Bytef*)src, (uLong)srcSize, Z_BEST_SPEED) != Z_OK)
+						return 0;
+					return dstSize;
+				}
+			#endif
+			#ifdef EHSN_WITH_LZ4
+				case CODEC_LZ4:
+				{
+					int dstSize = LZ4_compress_default((const char*)src, (char*)dst, (int)srcSize, (int)dstCapacity);
+					return dstSize > 0 ? dstSize : 0;
+				}
+			#endif
+				default:
+					return 0;
+				}
+			}
+
+			/*
+			* Decompress a single block.
+			*
+			* @returns True if exactly dstSize bytes have been decompressed. Otherwise false.
+			*/
+			static bool decompressBlock(Codec codec, const void* src, uint64_t srcSize, void* dst, uint64_t dstSize)
+			{
+				switch (codec)
+				{
+			#ifdef EHSN_WITH_ZLIB
+				case CODEC_ZLIB:
+				{
+					uLongf nWritten = (uLongf)dstSize;
+					return uncompress((Bytef*)dst, &nWritten, (const Bytef*)src, (uLong)srcSize) == Z_OK && nWritten == dstSize;
+				}
+			#endif
+			#ifdef EHSN_WITH_LZ4
+				case CODEC_LZ4:
+					return LZ4_decompress_safe((const char*)src, (char*)dst, (int)srcSize, (int)dstSize) == (int)dstSize;
+			#endif
+				default:
+					return false;
+				}
+			}
+
+			/*
+			* Call func for every block index and wait until all calls returned.
+			*
+			* threadPool must not be the pool of the calling thread.
+			*/
+			template <typename Func>
+			void forEachBlock(uint64_t nBlocks, Func func, ThreadPoolRef threadPool)
+			{
+				if (!threadPool || nBlocks == 1)
+				{
+					for (uint64_t i = 0; i < nBlocks; ++i)
+						func(i);
+					return;
+				}
+
+				std::mutex mtx;
+				std::condition_variable cond;
+				uint64_t nDone = 0;
+
+				for (uint64_t i = 0; i < nBlocks; ++i)
+				{
+					threadPool->pushJob(
+						[&, i]()
+						{
+							func(i);
+
+							std::unique_lock<std::mutex> lock(mtx);
+							++nDone;
+							cond.notify_one();
+						}
+					);
+				}
+
+				std::unique_lock<std::mutex> lock(mtx);
+				cond.wait(lock, [&]() { return nDone == nBlocks; });
+			}
+
+			bool isAvailable(Codec codec)
+			{
+				return codec != CODEC_NONE && blockBound(codec, 1) > 0;
+			}
+
+			Codec fastestCodec()
+			{
+				if (isAvailable(CODEC_LZ4))
+					return CODEC_LZ4;
+				if (isAvailable(CODEC_ZLIB))
+					return CODEC_ZLIB;
+				return CODEC_NONE;
+			}
+
+			float sampleRatio(Codec codec, const void* data, uint64_t size)
+			{
+				if (!isAvailable(codec) || size == 0)
+					return 1.0f;
+
+				uint64_t sampleSize = std::min(SAMPLE_SIZE, size);
+				uint32_t nSamples = (uint32_t)std::min<uint64_t>(N_SAMPLES, size / sampleSize);
+				uint64_t stride = (nSamples > 1) ? (size - sampleSize) / (nSamples - 1) : 0;
+
+				std::vector<char> dst(blockBound(codec, sampleSize));
+
+				uint64_t nRaw = 0;
+				uint64_t nCompressed = 0;
+				for (uint32_t i = 0; i < nSamples; ++i)
+				{
+					uint64_t nOut = compressBlock(codec, (const char*)data + i * stride, sampleSize, dst.data(), dst.size());
+					nRaw += sampleSize;
+					nCompressed += nOut ? nOut : sampleSize;
+				}
+
+				return (float)nCompressed / (float)nRaw;
+			}
+
+			PacketBufferRef compress(Codec codec, const void* data, uint64_t size, ThreadPoolRef threadPool)
+			{
+				if (!isAvailable(codec) || size == 0 || size > MAX_RAW_SIZE)
+					return nullptr;
+
+				uint64_t nBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+				std::vector<std::vector<char>> blocks(nBlocks);
+				std::atomic_bool failed = false;
+
+				forEachBlock(
+					nBlocks,
+					[&](uint64_t i)
+					{
+						uint64_t offset = i * BLOCK_SIZE;
+						uint64_t blockSize = std::min(BLOCK_SIZE, size - offset);
+
+						auto& block = blocks[i];
+						block.resize(blockBound(codec, blockSize));
+						uint64_t nOut = compressBlock(codec, (const char*)data + offset, blockSize, block.data(), block.size());
+						if (nOut == 0)
+							failed = true;
+						block.resize(nOut);
+					},
+					threadPool
+				);
+
+				if (failed)
+					return nullptr;
+
+				uint64_t compressedSize = sizeof(StreamHeader) + nBlocks * sizeof(uint32_t);
+				for (auto& block : blocks)
+					compressedSize += block.size();
+				if (compressedSize >= size || size / MAX_RATIO > compressedSize)
+					return nullptr;
+
+				StreamHeader header;
+				header.codec = codec;
+				header.nBlocks = (uint32_t)nBlocks;
+				header.rawSize = size;
+
+				auto buffer = std::make_shared<PacketBuffer>(compressedSize);
+				char* out = (char*)buffer->data();
+
+				memcpy(out, &header, sizeof(StreamHeader));
+				out += sizeof(StreamHeader);
+				for (auto& block : blocks)
+				{
+					uint32_t blockSize = (uint32_t)block.size();
+					memcpy(out, &blockSize, sizeof(uint32_t));
+					out += sizeof(uint32_t);
+				}
+				for (auto& block : blocks)
+				{
+					memcpy(out, block.data(), block.size());
+					out += block.size();
+				}
+
+				return buffer;
+			}
+
+			PacketBufferRef decompress(const void* data, uint64_t size, uint64_t maxSize, ThreadPoolRef threadPool)
+			{
+				if (size < sizeof(StreamHeader))
+					return nullptr;
+
+				StreamHeader header;
+				memcpy(&header, data, sizeof(StreamHeader));
+
+				if (!isAvailable(header.codec) || header.rawSize == 0 || header.rawSize > maxSize)
+					return nullptr;
+				if (header.rawSize > MAX_RAW_SIZE || header.rawSize / MAX_RATIO > size)
+					return nullptr;
+				if (header.nBlocks != (header.rawSize + BLOCK_SIZE - 1) / BLOCK_SIZE)
+					return nullptr;
+
+				uint64_t tableSize = (uint64_t)header.nBlocks * sizeof(uint32_t);
+				if (size - sizeof(StreamHeader) < tableSize)
+					return nullptr;
+
+				const char* table = (const char*)data + sizeof(StreamHeader);
+				std::vector<uint64_t> offsets(header.nBlocks + 1);
+				offsets[0] = sizeof(StreamHeader) + tableSize;
+				for (uint32_t i = 0; i < header.nBlocks; ++i)
+				{
+					uint32_t blockSize;
+					memcpy(&blockSize, table + i * sizeof(uint32_t), sizeof(uint32_t));
+					offsets[i + 1] = offsets[i] + blockSize;
+				}
+				if (offsets.back() != size)
+					return nullptr;
+
+				auto buffer = std::make_shared<PacketBuffer>(header.rawSize);
+				std::atomic_bool failed = false;
+
+				forEachBlock(
+					header.nBlocks,
+					[&](uint64_t i)
+					{
+						uint64_t offset = i * BLOCK_SIZE;
+						uint64_t blockSize = std::min(BLOCK_SIZE, header.rawSize - offset);
+
+						if (!decompressBlock(header.codec, (const char*)data + offsets[i], offsets[i + 1] - offsets[i], (char*)buffer->data() + offset, blockSize))
+							failed = true;
+					},
+					threadPool
+				);
+
+				if (failed)
+					return nullptr;
+				return buffer;
+			}
+
+		} // namespace compression
+	} // namespace net
+} // namespace EHSN
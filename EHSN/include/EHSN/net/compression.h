@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+
+#include "packetBuffer.h"
+#include "EHSN/ThreadPool.h"
+
+namespace EHSN {
+	namespace net {
+		namespace compression {
+
+			// zstd is not supported (yet), zlib and LZ4 are the codecs found in the build environments of EHSN.
+			enum Codec : uint8_t
+			{
+				CODEC_NONE = 0,
+				CODEC_ZLIB, // Available when EHSN was built with zlib.
+				CODEC_LZ4, // Available when EHSN was built with LZ4.
+			};
+
+			constexpr uint64_t BLOCK_SIZE = 1 << 18; // Compressed data is split into independent blocks of this size, so they can be (de-)compressed in parallel.
+			constexpr uint64_t SAMPLE_SIZE = 4096; // Size of a single sample taken by sampleRatio.
+			constexpr uint32_t N_SAMPLES = 4; // Number of samples taken by sampleRatio.
+			constexpr uint64_t MAX_RATIO = 1032; // Maximum raw size divided by the compressed size accepted by decompress (zlib's maximum ratio, LZ4 stays below it).
+			constexpr uint64_t MAX_RAW_SIZE = 1ull << 30; // Maximum raw size accepted by compress and decompress.
+
+			/*
+			* Check if a codec has been compiled in.
+			*
+			* @param codec The codec to check.
+			* @returns True if the codec can be used. Otherwise false.
+			*/
+			bool isAvailable(Codec codec);
+			/*
+			* Get the fastest codec that has been compiled in.
+			*
+			* @returns The fastest available codec. CODEC_NONE if no codec is available.
+			*/
+			Codec fastestCodec();
+			/*
+			* Estimate how well data compresses.
+			*
+			* Compresses N_SAMPLES samples of SAMPLE_SIZE bytes spread over the data instead of the whole data.
+			*
+			* @param codec The codec to use.
+			* @param data Pointer to the data.
+			* @param size Size of the data.
+			* @returns Estimated compressed size divided by the raw size. 1.0 if the codec is not available.
+			*/
+			float sampleRatio(Codec codec, const void* data, uint64_t size);
+			/*
+			* Compress data.
+			*
+			* @param codec The codec to use.
+			* @param data Pointer to the data to compress.
+			* @param size Size of the data.
+			* @param threadPool Thread pool to compress the blocks on. If null, the blocks are compressed by the calling thread.
+			* @returns Buffer holding the compressed data. Null if compression failed, the data did not get smaller or is bigger than MAX_RAW_SIZE.
+			*/
+			PacketBufferRef compress(Codec codec, const void* data, uint64_t size, ThreadPoolRef threadPool);
+			/*
+			* Decompress data created by compress.
+			*
+			* Data claiming a raw size above MAX_RAW_SIZE or above size * MAX_RATIO is rejected before anything is allocated.
+			*
+			* @param data Pointer to the compressed data.
+			* @param size Size of the compressed data.
+			* @param maxSize Maximum size of the decompressed data. Bigger data is treated as invalid.
+			* @param threadPool Thread pool to decompress the blocks on. If null, the blocks are decompressed by the calling thread.
+			* @returns Buffer holding the decompressed data. Null if the data is invalid or uses an unavailable codec.
+			*/
+			PacketBufferRef decompress(const void* data, uint64_t size, uint64_t maxSize, ThreadPoolRef threadPool);
+
+		} // namespace compression
+
+		struct CompressionMetrics
+		{
+			uint64_t nPacketsCompressed = 0; // Packets sent compressed.
+			uint64_t nPacketsSkipped = 0; // Packets big enough for compression, but sent uncompressed because they did not compress well.
+			uint64_t nBytesRaw = 0; // Size of the compressed packets before compression.
+			uint64_t nBytesCompressed = 0; // Size of the compressed packets after compression.
+		public:
+			float ratio() const { return nBytesRaw ? (float)nBytesCompressed / (float)nBytesRaw : 1.0f; }
+		};
+
+	} // namespace net
+} // namespace EHSN
@@ -0,0 +1,228 @@
+#include "dataMetrics.h"
+
+#include <sstream>
+#include <algorithm>
+
+#include "secSocket.h"
+
+namespace EHSN {
+	namespace net {
+
+		void DataMetrics::reset()
+		{
+			for (auto& s : m_slots)
+			{
+				s.nRead = 0;
+				s.nReadOps = 0;
+				s.nWritten = 0;
+				s.nWriteOps = 0;
+			}
+			m_readLatency.reset();
+			m_writeLatency.reset();
+
+			std::unique_lock<std::mutex> lock(m_mtxSpeeds);
+			m_nSpeedPoints = 0;
+			m_lastSampleTime = 0;
+			m_lastSampleRead = 0;
+			m_lastSampleWritten = 0;
+		}
+
+		void DataMetrics::addReadOp(uint64_t size)
+		{
+			auto& s = slot();
+			s.nRead.fetch_add(size, std::memory_order_relaxed);
+			s.nReadOps.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void DataMetrics::addWriteOp(uint64_t size)
+		{
+			auto& s = slot();
+			s.nWritten.fetch_add(size, std::memory_order_relaxed);
+			s.nWriteOps.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		uint64_t DataMetrics::nRead() const
+		{
+			return sum(&Counters::nRead);
+		}
+
+		uint64_t DataMetrics::nReadOps() const
+		{
+			return sum(&Counters::nReadOps);
+		}
+
+		uint64_t DataMetrics::nWritten() const
+		{
+			return sum(&Counters::nWritten);
+		}
+
+		uint64_t DataMetrics::nWriteOps() const
+		{
+			return sum(&Counters::nWriteOps);
+		}
+
+		void DataMetrics::sample() const
+		{
+			uint64_t now = CURR_TIME_NS();
+			uint64_t nRead = this->nRead();
+			uint64_t nWritten = this->nWritten();
+
+			std::unique_lock<std::mutex> lock(m_mtxSpeeds);
+
+			if (m_lastSampleTime == 0)
+			{
+				m_lastSampleTime = now;
+				m_lastSampleRead = nRead;
+				m_lastSampleWritten = nWritten;
+				return;
+			}
+
+			if (now - m_lastSampleTime < SPEED_SAMPLE_INTERVAL)
+				return;
+
+			float seconds = (float)(now - m_lastSampleTime) / 1e9f;
+			// Counters of other slots may have been reset concurrently, so never go negative.
+			float readSpeed = nRead >= m_lastSampleRead ? (float)(nRead - m_lastSampleRead) / seconds : 0.0f;
+			float writeSpeed = nWritten >= m_lastSampleWritten ? (float)(nWritten - m_lastSampleWritten) / seconds : 0.0f;
+
+			uint64_t index = m_nSpeedPoints % SPEED_HISTORY_SIZE;
+			m_readSpeeds[index] = SpeedPoint(readSpeed, m_lastSampleTime);
+			m_writeSpeeds[index] = SpeedPoint(writeSpeed, m_lastSampleTime);
+			++m_nSpeedPoints;
+
+			m_lastSampleTime = now;
+			m_lastSampleRead = nRead;
+			m_lastSampleWritten = nWritten;
+		}
+
+		std::vector<DataMetrics::SpeedPoint> DataMetrics::readSpeeds() const
+		{
+			sample();
+
+			std::unique_lock<std::mutex> lock(m_mtxSpeeds);
+			return speedsLocked(m_readSpeeds);
+		}
+
+		std::vector<DataMetrics::SpeedPoint> DataMetrics::writeSpeeds() const
+		{
+			sample();
+
+			std::unique_lock<std::mutex> lock(m_mtxSpeeds);
+			return speedsLocked(m_writeSpeeds);
+		}
+
+		std::string DataMetrics::toPrometheus(const std::string& labels) const
+		{
+			auto reads = readSpeeds();
+			auto writes = writeSpeeds();
+
+			std::string lbl = labels.empty() ? "" : "{" + labels + "}";
+			std::ostringstream ss;
+
+			auto metric = [&](const char* name, const char* type, const char* help, auto value)
+			{
+				ss << "# HELP " << name << " " << help << "\n";
+				ss << "# TYPE " << name << " " << type << "\n";
+				ss << name << lbl << " " << value << "\n";
+			};
+
+			metric("ehsn_read_bytes_total", "counter", "Bytes read from the socket.", nRead());
+			metric("ehsn_read_ops_total", "counter", "Read operations on the socket.", nReadOps());
+			metric("ehsn_written_bytes_total", "counter", "Bytes written to the socket.", nWritten());
+			metric("ehsn_write_ops_total", "counter", "Write operations on the socket.", nWriteOps());
+			metric("ehsn_read_bytes_per_second", "gauge", "Read throughput of the last sample.", reads.empty() ? 0.0f : reads.back().bytesPerSec);
+			metric("ehsn_write_bytes_per_second", "gauge", "Write throughput of the last sample.", writes.empty() ? 0.0f : writes.back().bytesPerSec);
+			metric("ehsn_avg_read_bytes_per_second", "gauge", "Smoothed read throughput.", avgReadSpeed());
+
+			auto latency = [&](const char* name, const char* help, const LatencyHistogram& hist)
+			{
+				auto s = hist.summary();
+				std::string sep = labels.empty() ? "" : ",";
+				ss << "# HELP " << name << " " << help << "\n";
+				ss << "# TYPE " << name << " summary\n";
+				ss << name << "{" << labels << sep << "quantile=\"0.5\"} " << s.p50 / 1e9 << "\n";
+				ss << name << "{" << labels << sep << "quantile=\"0.99\"} " << s.p99 / 1e9 << "\n";
+				ss << name << "{" << labels << sep << "quantile=\"0.999\"} " << s.p999 / 1e9 << "\n";
+				ss << name << "{" << labels << sep << "quantile=\"1\"} " << s.max / 1e9 << "\n";
+				ss << name << "_count" << lbl << " " << s.count << "\n";
+			};
+
+			latency("ehsn_read_latency_seconds", "Duration of measured raw reads.", m_readLatency);
+			latency("ehsn_write_latency_seconds", "Duration of measured raw writes.", m_writeLatency);
+
+			return ss.str();
+		}
+
+		std::string DataMetrics::toJSON() const
+		{
+			auto reads = readSpeeds();
+			auto writes = writeSpeeds();
+
+			std::ostringstream ss;
+
+			auto speeds = [&](const std::vector<SpeedPoint>& points)
+			{
+				ss << "[";
+				for (uint64_t i = 0; i < points.size(); ++i)
+				{
+					if (i > 0)
+						ss << ",";
+					ss << "{\"tStart\":" << points[i].tStart << ",\"bytesPerSec\":" << points[i].bytesPerSec << "}";
+				}
+				ss << "]";
+			};
+
+			auto latency = [&](const LatencyHistogram& hist)
+			{
+				auto s = hist.summary();
+				ss << "{\"count\":" << s.count << ",\"p50\":" << s.p50 << ",\"p99\":" << s.p99 << ",\"p999\":" << s.p999 << ",\"max\":" << s.max << "}";
+			};
+
+			ss << "{";
+			ss << "\"nRead\":" << nRead() << ",";
+			ss << "\"nReadOps\":" << nReadOps() << ",";
+			ss << "\"nWritten\":" << nWritten() << ",";
+			ss << "\"nWriteOps\":" << nWriteOps() << ",";
+			ss << "\"avgReadSpeed\":" << avgReadSpeed() << ",";
+			ss << "\"readSpeeds\":";
+			speeds(reads);
+			ss << ",\"writeSpeeds\":";
+			speeds(writes);
+			ss << ",\"readLatency\":";
+			latency(m_readLatency);
+			ss << ",\"writeLatency\":";
+			latency(m_writeLatency);
+			ss << "}";
+
+			return ss.str();
+		}
+
+		DataMetrics::Counters& DataMetrics::slot()
+		{
+			static std::atomic<uint32_t> s_nextSlot = 0;
+			thread_local uint32_t t_slot = s_nextSlot++ % N_METRICS_SLOTS;
+			return m_slots[t_slot];
+		}
+
+		uint64_t DataMetrics::sum(std::atomic<uint64_t> Counters::* counter) const
+		{
+			uint64_t total = 0;
+			for (auto& s : m_slots)
+				total += (s.*counter).load(std::memory_order_relaxed);
+			return total;
+		}
+
+		std::vector<DataMetrics::SpeedPoint> DataMetrics::speedsLocked(const std::array<SpeedPoint, SPEED_HISTORY_SIZE>& ring) const
+		{
+			uint64_t nPoints = std::min<uint64_t>(m_nSpeedPoints, SPEED_HISTORY_SIZE);
+			uint64_t first = m_nSpeedPoints - nPoints;
+
+			std::vector<SpeedPoint> points;
+			points.reserve(nPoints);
+			for (uint64_t i = first; i < m_nSpeedPoints; ++i)
+				points.push_back(ring[i % SPEED_HISTORY_SIZE]);
+			return points;
+		}
+
+	} // namespace net
+} // namespace EHSN
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+#include "EHSN/CacheLine.h"
+
+#include "latencyHistogram.h"
+
+namespace EHSN {
+	namespace net {
+
+		constexpr uint32_t N_METRICS_SLOTS = 8; // Number of counter slots threads are spread over.
+		constexpr uint32_t SPEED_HISTORY_SIZE = 60; // Number of throughput samples kept per direction.
+		constexpr uint64_t SPEED_SAMPLE_INTERVAL = 1'000'000'000; // Minimum time covered by a throughput sample (ns).
+
+		/*
+		* Traffic counters of a socket.
+		*
+		* Counters are updated lock-free: every thread adds to one of N_METRICS_SLOTS cache line sized slots
+		* and the slots get summed up when read.
+		*/
+		class DataMetrics
+		{
+		public:
+			struct SpeedPoint
+			{
+				SpeedPoint(float bps = 0.0f, uint64_t ts = 0)
+					: bytesPerSec(bps), tStart(ts)
+				{}
+			public:
+				float bytesPerSec = 0;
+				uint64_t tStart = 0;
+			};
+		public:
+			DataMetrics() = default;
+			DataMetrics(const DataMetrics&) = delete;
+			DataMetrics& operator=(const DataMetrics&) = delete;
+		public:
+			/*
+			* Reset all counters and the throughput history.
+			*/
+			void reset();
+			void addReadOp(uint64_t size);
+			void addWriteOp(uint64_t size);
+			uint64_t nRead() const;
+			uint64_t nReadOps() const;
+			uint64_t nWritten() const;
+			uint64_t nWriteOps() const;
+			void setAvgReadSpeed(float speed) { m_avgReadSpeed = speed; }
+			float avgReadSpeed() const { return m_avgReadSpeed; }
+			void addReadLatency(uint64_t ns) { m_readLatency.record(ns); }
+			void addWriteLatency(uint64_t ns) { m_writeLatency.record(ns); }
+			/*
+			* Get the durations of the measured raw reads.
+			*
+			* @returns Histogram of the read durations.
+			*/
+			const LatencyHistogram& readLatency() const { return m_readLatency; }
+			/*
+			* Get the durations of the measured raw writes.
+			*
+			* High values mean the kernel send buffer is full and the writer has to wait for the network.
+			*
+			* @returns Histogram of the write durations.
+			*/
+			const LatencyHistogram& writeLatency() const { return m_writeLatency; }
+		public:
+			/*
+			* Take a throughput sample.
+			*
+			* A sample is only recorded if at least SPEED_SAMPLE_INTERVAL passed since the last one,
+			* so this can be called as often as desired. Longer gaps result in a single averaged sample.
+			*/
+			void sample() const;
+			/*
+			* Get the read throughput history.
+			*
+			* @returns Up to SPEED_HISTORY_SIZE samples, oldest first.
+			*/
+			std::vector<SpeedPoint> readSpeeds() const;
+			/*
+			* Get the write throughput history.
+			*
+			* @returns Up to SPEED_HISTORY_SIZE samples, oldest first.
+			*/
+			std::vector<SpeedPoint> writeSpeeds() const;
+			/*
+			* Export the metrics in the Prometheus text format.
+			*
+			* @param labels Labels added to every metric without braces (e.g. 'session="1"'). May be empty.
+			* @returns The metrics.
+			*/
+			std::string toPrometheus(const std::string& labels = "") const;
+			/*
+			* Export the metrics including the throughput history as JSON.
+			*
+			* @returns The metrics.
+			*/
+			std::string toJSON() const;
+		private:
+			struct alignas(CACHE_LINE_SIZE) Counters
+			{
+				std::atomic<uint64_t> nRead = 0;
+				std::atomic<uint64_t> nReadOps = 0;
+				std::atomic<uint64_t> nWritten = 0;
+				std::atomic<uint64_t> nWriteOps = 0;
+			};
+			/*
+			* Get the counter slot of the calling thread.
+			*/
+			Counters& slot();
+			/*
+			* Sum up a counter over all slots.
+			*/
+			uint64_t sum(std::atomic<uint64_t> Counters::* counter) const;
+			/*
+			* Copy a ring of speed points. m_mtxSpeeds must be locked.
+			*/
+			std::vector<SpeedPoint> speedsLocked(const std::array<SpeedPoint, SPEED_HISTORY_SIZE>& ring) const;
+		private:
+			Counters m_slots[N_METRICS_SLOTS];
+			std::atomic<float> m_avgReadSpeed = 128.0f;
+			LatencyHistogram m_readLatency;
+			LatencyHistogram m_writeLatency;
+
+			mutable std::mutex m_mtxSpeeds;
+			mutable std::array<SpeedPoint, SPEED_HISTORY_SIZE> m_readSpeeds;
+			mutable std::array<SpeedPoint, SPEED_HISTORY_SIZE> m_writeSpeeds;
+			mutable uint64_t m_nSpeedPoints = 0;
+			mutable uint64_t m_lastSampleTime = 0;
+			mutable uint64_t m_lastSampleRead = 0;
+			mutable uint64_t m_lastSampleWritten = 0;
+		};
+
+	} // namespace net
+} // namespace EHSN
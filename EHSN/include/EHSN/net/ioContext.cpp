@@ -1,9 +1,170 @@
 #include "ioContext.h"
 
+#include <iostream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 namespace EHSN {
 	namespace net {
 
 		IOContext IOContext::s_singleton;
 
+		IOContextPool::IOContextPool(uint32_t nContexts, bool pinThreads, IOAssignment assignment, uint32_t firstCore)
+			: m_assignment(assignment), m_firstCore(firstCore)
+		{
+			if (nContexts == 0)
+				nContexts = std::max(1u, std::thread::hardware_concurrency());
+
+			m_contexts.resize(nContexts);
+			for (auto& c : m_contexts)
+				c = std::make_shared<Context>();
+
+			for (uint32_t i = 0; i < nContexts; ++i)
+				m_contexts[i]->thread = std::thread(&IOContextPool::threadFunc, this, i, pinThreads);
+		}
+
+		IOContextPool::~IOContextPool()
+		{
+			for (auto& c : m_contexts)
+			{
+				c->workGuard.reset();
+				c->ioContext.stop();
+			}
+
+			for (auto& c : m_contexts)
+			{
+				// The last reference may be dropped by a handler on one of the run threads, which can't join itself.
+				if (c->thread.get_id() == std::this_thread::get_id())
+				{
+					c->isDetached = true;
+					c->thread.detach();
+				}
+				else
+				{
+					c->thread.join();
+				}
+			}
+		}
+
+		asio::io_context& IOContextPool::acquire()
+		{
+			uint32_t index = 0;
+
+			if (m_assignment == IO_ASSIGN_LEAST_LOADED)
+			{
+				// Start at the round-robin position so equally loaded contexts still get rotated.
+				uint32_t start = m_nextContext++;
+				uint32_t minLoad = UINT32_MAX;
+				for (uint32_t i = 0; i < size(); ++i)
+				{
+					uint32_t curr = (start + i) % size();
+					uint32_t currLoad = m_contexts[curr]->load;
+					if (currLoad < minLoad)
+					{
+						minLoad = currLoad;
+						index = curr;
+					}
+				}
+			}
+			else
+			{
+				index = m_nextContext++ % size();
+			}
+
+			++m_contexts[index]->load;
+			return m_contexts[index]->ioContext;
+		}
+
+		void IOContextPool::release(asio::io_context& ioContext)
+		{
+			for (auto& c : m_contexts)
+			{
+				if (&c->ioContext == &ioContext)
+				{
+					--c->load;
+					return;
+				}
+			}
+		}
+
+		asio::io_context& IOContextPool::get(uint32_t index)
+		{
+			return m_contexts[index % size()]->ioContext;
+		}
+
+		uint32_t IOContextPool::size() const
+		{
+			return (uint32_t)m_contexts.size();
+		}
+
+		uint32_t IOContextPool::load(uint32_t index) const
+		{
+			return m_contexts[index % size()]->load;
+		}
+
+		void IOContextPool::setErrorCallback(ErrorCallback ecb, void* pParam)
+		{
+			std::unique_lock<std::mutex> lock(m_mtxErrorCallback);
+			m_ecb = ecb;
+			m_pErrorParam = pParam;
+		}
+
+		void IOContextPool::threadFunc(uint32_t index, bool pin)
+		{
+			if (pin)
+			{
+				uint32_t nCores = std::max(1u, std::thread::hardware_concurrency());
+				uint32_t core = (m_firstCore + index) % nCores;
+			#ifdef _WIN32
+				SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (core % (sizeof(DWORD_PTR) * 8)));
+			#else
+				cpu_set_t cpuSet;
+				CPU_ZERO(&cpuSet);
+				CPU_SET(core, &cpuSet);
+				pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+			#endif
+			}
+
+			Ref<Context> context = m_contexts[index];
+
+			// The pool (and with it the error callback) is gone once this thread has been detached.
+			const auto report = [&](std::exception& e)
+			{
+				if (context->isDetached)
+					std::cerr << "IOContextPool: Handler on io_context " << index << " threw after the pool was destroyed: " << e.what() << std::endl;
+				else
+					reportError(e, index);
+			};
+
+			while (!context->ioContext.stopped())
+			{
+				try
+				{
+					context->ioContext.run();
+				}
+				catch (std::exception& e)
+				{
+					report(e);
+				}
+				catch (...)
+				{
+					std::runtime_error e("Unknown exception");
+					report(e);
+				}
+			}
+		}
+
+		void IOContextPool::reportError(std::exception& e, uint32_t index)
+		{
+			std::unique_lock<std::mutex> lock(m_mtxErrorCallback);
+			if (m_ecb)
+				m_ecb(e, index, m_pErrorParam);
+			else
+				std::cerr << "IOContextPool: Handler on io_context " << index << " threw: " << e.what() << std::endl;
+		}
+
 	} // namespace net
 } // namespace EHSN
\ No newline at end of file
@@ -2,6 +2,13 @@
 
 #include <asio.hpp>
 
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "EHSN/Reference.h"
+
 namespace EHSN {
 	namespace net {
 
@@ -24,5 +31,127 @@ namespace EHSN {
 			static IOContext s_singleton;
 		};
 
+		enum IOAssignment
+		{
+			IO_ASSIGN_ROUND_ROBIN = 0, // Contexts are handed out one after another.
+			IO_ASSIGN_LEAST_LOADED, // The context with the fewest sockets currently assigned is handed out.
+		};
+
+		/*
+		* Shared ownership of several io_contexts, each run by its own thread.
+		*
+		* Sockets and acceptors created with a pool are bound to one of its io_contexts. Only asynchronous operations
+		* (e.g. the accepts of SecAcceptor shards) run on the pool threads, socket reads and writes stay blocking on the calling thread.
+		*/
+		class IOContextPool
+		{
+		public:
+			typedef void(*ErrorCallback)(std::exception& e, uint32_t index, void* pParam);
+		public:
+			IOContextPool() = delete;
+			/*
+			* Constructor of IOContextPool.
+			*
+			* Creates the io_contexts and starts one run thread per io_context.
+			*
+			* @param nContexts Number of io_contexts to create. If 0, one io_context per hardware thread is created.
+			* @param pinThreads If set to true, the run thread of the n-th io_context gets pinned to core firstCore + n.
+			* @param assignment Strategy used by acquire() to choose an io_context.
+			* @param firstCore Core the run thread of the first io_context gets pinned to (only used with pinThreads). Lets several pools use distinct cores.
+			*/
+			IOContextPool(uint32_t nContexts = 0, bool pinThreads = false, IOAssignment assignment = IO_ASSIGN_ROUND_ROBIN, uint32_t firstCore = 0);
+			/*
+			* Destructor of IOContextPool.
+			*
+			* Stops all io_contexts and joins their run threads.
+			* When the last reference is dropped by a handler on a run thread, that thread gets detached instead and exits once the handler returns.
+			*/
+			~IOContextPool();
+		public:
+			/*
+			* Acquire an io_context for a new socket/acceptor.
+			*
+			* Every call must be paired with a call to release() once the socket/acceptor is destroyed.
+			*
+			* @returns The io_context chosen by the assignment strategy.
+			*/
+			asio::io_context& acquire();
+			/*
+			* Release an io_context previously returned by acquire().
+			*
+			* @param ioContext The io_context to release.
+			*/
+			void release(asio::io_context& ioContext);
+			/*
+			* Get a specific io_context.
+			*
+			* Does not change the load of the io_context.
+			*
+			* @param index Index of the io_context. Gets wrapped around size().
+			* @returns The io_context at the specified index.
+			*/
+			asio::io_context& get(uint32_t index);
+			/*
+			* Get the number of io_contexts in the pool.
+			*
+			* @returns Number of io_contexts in the pool.
+			*/
+			uint32_t size() const;
+			/*
+			* Get the number of sockets/acceptors currently assigned to an io_context.
+			*
+			* @param index Index of the io_context. Gets wrapped around size().
+			* @returns Number of sockets/acceptors assigned to the io_context.
+			*/
+			uint32_t load(uint32_t index) const;
+			/*
+			* Set the function called when a handler run by the pool throws.
+			*
+			* The run thread keeps running the io_context afterwards. Without a callback the exception is written to stderr.
+			*
+			* @param ecb Function to call with the exception and the index of the io_context.
+			* @param pParam Pointer passed to the callback.
+			*/
+			void setErrorCallback(ErrorCallback ecb, void* pParam = nullptr);
+		private:
+			/*
+			* Main function for the run threads.
+			*
+			* Keeps a reference to its Context, as a detached thread outlives the pool.
+			*
+			* @param index Index of the io_context to run.
+			* @param pin If set to true, the calling thread gets pinned to core m_firstCore + index.
+			*/
+			void threadFunc(uint32_t index, bool pin);
+			/*
+			* Report an exception thrown by a handler.
+			*
+			* @param e The exception.
+			* @param index Index of the io_context running the handler.
+			*/
+			void reportError(std::exception& e, uint32_t index);
+		private:
+			struct Context
+			{
+				Context() : workGuard(asio::make_work_guard(ioContext)) {}
+			public:
+				asio::io_context ioContext;
+				asio::executor_work_guard<asio::io_context::executor_type> workGuard;
+				std::atomic_uint32_t load = 0;
+				std::thread thread;
+				bool isDetached = false; // Set by the destructor when run on this context's thread. Only accessed by that thread.
+			};
+		private:
+			std::vector<Ref<Context>> m_contexts;
+			IOAssignment m_assignment;
+			uint32_t m_firstCore;
+			std::atomic_uint32_t m_nextContext = 0;
+			std::mutex m_mtxErrorCallback;
+			ErrorCallback m_ecb = nullptr;
+			void* m_pErrorParam = nullptr;
+		};
+
+		typedef Ref<IOContextPool> IOContextPoolRef;
+
 	} // namespace net
 } // namespace EHSN
\ No newline at end of file
@@ -0,0 +1,110 @@
+#include "latencyHistogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace EHSN {
+	namespace net {
+
+		/*
+		* Get the index of the most significant set bit.
+		*
+		* value must not be 0.
+		*/
+		static uint32_t msbIndex(uint64_t value)
+		{
+		#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanReverse64(&index, value);
+			return index;
+		#else
+			return 63 - __builtin_clzll(value);
+		#endif
+		}
+
+		void LatencyHistogram::record(uint64_t ns)
+		{
+			m_buckets[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+			m_count.fetch_add(1, std::memory_order_relaxed);
+
+			uint64_t currMax = m_max.load(std::memory_order_relaxed);
+			while (ns > currMax && !m_max.compare_exchange_weak(currMax, ns, std::memory_order_relaxed))
+				;
+		}
+
+		void LatencyHistogram::reset()
+		{
+			for (auto& bucket : m_buckets)
+				bucket.store(0, std::memory_order_relaxed);
+			m_count = 0;
+			m_max = 0;
+		}
+
+		uint64_t LatencyHistogram::count() const
+		{
+			return m_count.load(std::memory_order_relaxed);
+		}
+
+		uint64_t LatencyHistogram::max() const
+		{
+			return m_max.load(std::memory_order_relaxed);
+		}
+
+		uint64_t LatencyHistogram::percentile(double p) const
+		{
+			uint64_t total = 0;
+			for (auto& bucket : m_buckets)
+				total += bucket.load(std::memory_order_relaxed);
+			if (total == 0)
+				return 0;
+
+			uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(std::clamp(p, 0.0, 1.0) * (double)total));
+
+			uint64_t nSeen = 0;
+			for (uint32_t i = 0; i < N_BUCKETS; ++i)
+			{
+				nSeen += m_buckets[i].load(std::memory_order_relaxed);
+				if (nSeen >= rank)
+					return std::min(bucketUpperBound(i), max());
+			}
+
+			return max();
+		}
+
+		LatencyHistogram::Summary LatencyHistogram::summary() const
+		{
+			Summary s;
+			s.count = count();
+			s.p50 = percentile(0.5);
+			s.p99 = percentile(0.99);
+			s.p999 = percentile(0.999);
+			s.max = max();
+			return s;
+		}
+
+		uint32_t LatencyHistogram::bucketIndex(uint64_t value)
+		{
+			if (value < N_SUB_BUCKETS)
+				return (uint32_t)value;
+
+			uint32_t shift = msbIndex(value) - LATENCY_SUB_BUCKET_BITS;
+			uint32_t subBucket = (uint32_t)(value >> shift) - N_SUB_BUCKETS;
+			return (shift + 1) * N_SUB_BUCKETS + subBucket;
+		}
+
+		uint64_t LatencyHistogram::bucketUpperBound(uint32_t index)
+		{
+			if (index < N_SUB_BUCKETS)
+				return index;
+
+			uint32_t shift = index / N_SUB_BUCKETS - 1;
+			uint64_t lowerBound = (uint64_t)(index % N_SUB_BUCKETS + N_SUB_BUCKETS) << shift;
+			return lowerBound + (((uint64_t)1 << shift) - 1);
+		}
+
+	} // namespace net
+} // namespace EHSN
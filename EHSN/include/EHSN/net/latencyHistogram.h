@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace EHSN {
+	namespace net {
+
+		constexpr uint32_t LATENCY_SUB_BUCKET_BITS = 4; // Every power of two gets split into 2^LATENCY_SUB_BUCKET_BITS buckets (~6% relative error).
+
+		/*
+		* Lock-free HDR-style latency histogram.
+		*
+		* Values are sorted into log-linear buckets covering the whole uint64_t range,
+		* so recording is a few relaxed atomic operations and never allocates.
+		*/
+		class LatencyHistogram
+		{
+		public:
+			struct Summary
+			{
+				uint64_t count = 0; // Number of recorded values.
+				uint64_t p50 = 0; // Median (ns).
+				uint64_t p99 = 0; // 99th percentile (ns).
+				uint64_t p999 = 0; // 99.9th percentile (ns).
+				uint64_t max = 0; // Highest recorded value (ns).
+			};
+		public:
+			static constexpr uint32_t N_SUB_BUCKETS = 1 << LATENCY_SUB_BUCKET_BITS;
+			static constexpr uint32_t N_BUCKETS = (64 - LATENCY_SUB_BUCKET_BITS + 1) * N_SUB_BUCKETS;
+		public:
+			LatencyHistogram() = default;
+			LatencyHistogram(const LatencyHistogram&) = delete;
+			LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+		public:
+			/*
+			* Record a value.
+			*
+			* @param ns The value to record in nanoseconds.
+			*/
+			void record(uint64_t ns);
+			/*
+			* Remove all recorded values.
+			*/
+			void reset();
+			/*
+			* Get the number of recorded values.
+			*
+			* @returns Number of recorded values.
+			*/
+			uint64_t count() const;
+			/*
+			* Get the highest recorded value.
+			*
+			* @returns Highest recorded value (ns).
+			*/
+			uint64_t max() const;
+			/*
+			* Get a percentile of the recorded values.
+			*
+			* @param p The percentile in the range [0, 1] (e.g. 0.99).
+			* @returns Upper bound of the bucket holding the percentile (ns). 0 if nothing has been recorded.
+			*/
+			uint64_t percentile(double p) const;
+			/*
+			* Get the most common percentiles.
+			*
+			* @returns Count, p50, p99, p999 and max.
+			*/
+			Summary summary() const;
+		private:
+			static uint32_t bucketIndex(uint64_t value);
+			static uint64_t bucketUpperBound(uint32_t index);
+		private:
+			std::atomic<uint64_t> m_buckets[N_BUCKETS] = {};
+			std::atomic<uint64_t> m_count = 0;
+			std::atomic<uint64_t> m_max = 0;
+		};
+
+	} // namespace net
+} // namespace EHSN
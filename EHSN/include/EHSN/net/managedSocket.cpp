@@ -1,16 +1,208 @@
 #include "managedSocket.h"
 
+#include "trace.h"
+
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <exception>
 
 namespace EHSN {
 	namespace net {
 
+		std::mutex ManagedSocket::s_mtxGlobalRecv;
+		std::condition_variable ManagedSocket::s_globalRecvSpace;
+		uint64_t ManagedSocket::s_nGlobalRecvBytesReserved = 0;
+		uint64_t ManagedSocket::s_maxGlobalRecvPacketSize = 0;
+		uint64_t ManagedSocket::s_maxGlobalRecvBytes = 0;
+		std::mutex ManagedSocket::s_mtxBroadcast;
+		ThreadPoolRef ManagedSocket::s_broadcastPool;
+		PacketBufferPool ManagedSocket::s_broadcastBuffers = PacketBufferPool(1024, BROADCAST_POOLED_BYTES);
+		std::mutex ManagedSocket::s_mtxDispatchPools;
+		ThreadPoolRef ManagedSocket::s_parallelPool;
+		std::vector<ThreadPoolRef> ManagedSocket::s_keyPools;
+
 		bool operator<(const PacketHeader& left, const PacketHeader& right)
 		{
 			return left.packetID < right.packetID;
 		}
 
-		ManagedSocket::ManagedSocket(SecSocketRef sock, uint32_t nThreads)
+		/*
+		* Gets notified by every packet a waitAny call waits for.
+		*/
+		struct AnyWaiter
+		{
+			std::mutex mtx;
+			std::condition_variable cond;
+			bool signaled = false;
+		};
+
+		struct SendHandle::State
+		{
+			PacketID packetID = 0;
+			mutable std::mutex mtx;
+			mutable std::condition_variable cond;
+			SendStatus status = SEND_PENDING;
+			uint64_t nBytesSent = 0;
+			std::vector<Ref<AnyWaiter>> anyWaiters;
+		};
+
+		PacketID SendHandle::packetID() const
+		{
+			return m_state ? m_state->packetID : 0;
+		}
+
+		SendStatus SendHandle::status() const
+		{
+			if (!m_state)
+				return SEND_DROPPED;
+
+			std::unique_lock<std::mutex> lock(m_state->mtx);
+			return m_state->status;
+		}
+
+		uint64_t SendHandle::nBytesSent() const
+		{
+			if (!m_state)
+				return 0;
+
+			std::unique_lock<std::mutex> lock(m_state->mtx);
+			return m_state->nBytesSent;
+		}
+
+		bool SendHandle::isDone() const
+		{
+			return status() != SEND_PENDING;
+		}
+
+		void SendHandle::wait() const
+		{
+			if (!m_state)
+				return;
+
+			std::unique_lock<std::mutex> lock(m_state->mtx);
+			m_state->cond.wait(lock, [this]() { return m_state->status != SEND_PENDING; });
+		}
+
+		bool SendHandle::waitFor(uint64_t timeoutMS) const
+		{
+			if (!m_state)
+				return true;
+			if (timeoutMS == UINT64_MAX)
+			{
+				wait();
+				return true;
+			}
+
+			std::unique_lock<std::mutex> lock(m_state->mtx);
+			return m_state->cond.wait_for(lock, std::chrono::milliseconds(timeoutMS), [this]() { return m_state->status != SEND_PENDING; });
+		}
+
+		bool SendHandle::waitAll(const std::vector<SendHandle>& handles, uint64_t timeoutMS)
+		{
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::min<uint64_t>(timeoutMS, INT32_MAX));
+
+			for (auto& handle : handles)
+			{
+				if (timeoutMS == UINT64_MAX)
+				{
+					handle.wait();
+					continue;
+				}
+
+				auto now = std::chrono::steady_clock::now();
+				uint64_t remaining = (now < deadline) ? std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() : 0;
+				if (!handle.waitFor(remaining))
+					return false;
+			}
+
+			return true;
+		}
+
+		int64_t SendHandle::waitAny(const std::vector<SendHandle>& handles, uint64_t timeoutMS)
+		{
+			const auto firstDone = [&handles]() -> int64_t
+			{
+				for (uint64_t i = 0; i < handles.size(); ++i)
+				{
+					if (handles[i].isDone())
+						return i;
+				}
+				return -1;
+			};
+
+			// Register with every pending packet, so only their completion wakes this thread.
+			auto waiter = std::make_shared<AnyWaiter>();
+			bool anyDone = false;
+			for (auto& handle : handles)
+			{
+				if (!handle.m_state)
+				{
+					anyDone = true;
+					break;
+				}
+
+				std::unique_lock<std::mutex> lock(handle.m_state->mtx);
+				if (handle.m_state->status != SEND_PENDING)
+				{
+					anyDone = true;
+					break;
+				}
+				handle.m_state->anyWaiters.push_back(waiter);
+			}
+
+			if (!anyDone && !handles.empty())
+			{
+				std::unique_lock<std::mutex> lock(waiter->mtx);
+				if (timeoutMS == UINT64_MAX)
+					waiter->cond.wait(lock, [&waiter]() { return waiter->signaled; });
+				else
+					waiter->cond.wait_for(lock, std::chrono::milliseconds(timeoutMS), [&waiter]() { return waiter->signaled; });
+			}
+
+			// Don't keep the waiter registered with the packets that are still pending.
+			for (auto& handle : handles)
+			{
+				if (!handle.m_state)
+					continue;
+
+				std::unique_lock<std::mutex> lock(handle.m_state->mtx);
+				auto& anyWaiters = handle.m_state->anyWaiters;
+				anyWaiters.erase(std::remove(anyWaiters.begin(), anyWaiters.end(), waiter), anyWaiters.end());
+			}
+
+			return firstDone();
+		}
+
+		Ref<SendHandle::State> SendHandle::makeState(PacketID pID)
+		{
+			auto state = std::make_shared<State>();
+			state->packetID = pID;
+			return state;
+		}
+
+		void SendHandle::complete(const Ref<State>& state, SendStatus status, uint64_t nBytesSent)
+		{
+			std::vector<Ref<AnyWaiter>> anyWaiters;
+			{
+				std::unique_lock<std::mutex> lock(state->mtx);
+				state->status = status;
+				state->nBytesSent = nBytesSent;
+				anyWaiters.swap(state->anyWaiters);
+			}
+			state->cond.notify_all();
+
+			for (auto& waiter : anyWaiters)
+			{
+				{
+					std::unique_lock<std::mutex> lock(waiter->mtx);
+					waiter->signaled = true;
+				}
+				waiter->cond.notify_one();
+			}
+		}
+
+		ManagedSocket::ManagedSocket(SecSocketRef sock, uint32_t nThreads, uint32_t nDispatchThreads)
 			: m_sock(sock), m_remoteWriteSpeed(128.0f)
 		{
 			m_sendPool = std::make_shared<ThreadPool>(1);
@@ -23,18 +215,61 @@ namespace EHSN {
 				m_cryptThreadPool = std::make_shared<ThreadPool>(nThreads);
 			}
 
-			setRecvCallback(
+			m_nDispatchThreads = nDispatchThreads ? nDispatchThreads : std::max(1u, std::thread::hardware_concurrency());
+
+			setRecvHandler(
 				SPT_KEEP_ALIVE_REQUEST,
-				[](Packet pack, uint64_t nBytesReceived, void* pParam)
+				[this](Packet pack, uint64_t nBytesReceived)
 				{
 					if (nBytesReceived < pack.header.packetSize)
 						return;
 
-					auto& manSock = *(ManagedSocket*)pParam;
-					manSock.push(SPT_KEEP_ALIVE_REPLY, FLAG_PH_NONE, nullptr);
-				},
-				this
-					);
+					push(SPT_KEEP_ALIVE_REPLY, FLAG_PH_NONE, nullptr, PRIO_CONTROL);
+				}
+			);
+			setDispatchPolicy(SPT_KEEP_ALIVE_REQUEST, DISPATCH_INLINE);
+
+			setRecvHandler(
+				SPT_RTT_PROBE,
+				[this](Packet pack, uint64_t nBytesReceived)
+				{
+					uint64_t tRemote = CURR_TIME_NS();
+					if (nBytesReceived < pack.header.packetSize || !pack.buffer || pack.buffer->size() < sizeof(packets::RTTProbe))
+						return;
+
+					packets::RTTProbe probe;
+					pack.buffer->read(probe);
+
+					packets::RTTProbeReply reply;
+					reply.tSent = probe.tSent;
+					reply.tRemote = tRemote;
+					{
+						std::unique_lock<std::mutex> lock(m_mtxLinkStats);
+						reply.remoteReadSpeed = m_linkStats.readSpeed;
+						reply.remoteWriteSpeed = m_linkStats.writeSpeed;
+					}
+
+					auto buffer = std::make_shared<PacketBuffer>(sizeof(reply));
+					buffer->write(reply);
+					push(SPT_RTT_PROBE_REPLY, FLAG_PH_SEND_IMMEDIATE, buffer, PRIO_CONTROL);
+				}
+			);
+			setDispatchPolicy(SPT_RTT_PROBE, DISPATCH_INLINE);
+
+			setRecvHandler(
+				SPT_RTT_PROBE_REPLY,
+				[this](Packet pack, uint64_t nBytesReceived)
+				{
+					uint64_t tRecv = CURR_TIME_NS();
+					if (nBytesReceived < pack.header.packetSize || !pack.buffer || pack.buffer->size() < sizeof(packets::RTTProbeReply))
+						return;
+
+					packets::RTTProbeReply reply;
+					pack.buffer->read(reply);
+					addRTTSample(reply, tRecv);
+				}
+			);
+			setDispatchPolicy(SPT_RTT_PROBE_REPLY, DISPATCH_INLINE);
 
 			if (m_sock->isConnected())
 				pushRecvJob();
@@ -42,13 +277,20 @@ namespace EHSN {
 
 		ManagedSocket::~ManagedSocket()
 		{
+			stopProbing();
 			disconnect();
 
-			m_sendPool.reset();
+			// Jobs push follow-up jobs onto the next stage (recv -> crypt -> send -> callback), so the stages are stopped in that order.
+			// Express jobs on m_cryptThreadPool push send jobs as well.
 			m_recvPool.reset();
 			m_cryptPool.reset();
 			m_cryptThreadPool.reset();
+			m_sendPool.reset();
 			m_callbackPool.reset();
+
+			// The dispatch pools outlive this socket, so wait for the handlers still referring to it.
+			std::unique_lock<std::mutex> lock(m_mtxDispatchPending);
+			m_condDispatchDone.wait(lock, [this]() { return m_nDispatchPending == 0; });
 		}
 
 		SecSocketRef ManagedSocket::getSock()
@@ -60,7 +302,11 @@ namespace EHSN {
 		{
 			disconnect();
 
+			// Keep the probe thread from sending while the handshake is in progress.
+			std::unique_lock<std::mutex> probeLock(m_mtxProbe);
 			bool ret = m_sock->connect(host, port, noDelay);
+			probeLock.unlock();
+
 			if (m_sock->isConnected())
 				pushRecvJob();
 
@@ -71,6 +317,7 @@ namespace EHSN {
 		{
 			m_sock->disconnect();
 			m_recvPool->clear();
+			wakeWaiters();
 		}
 
 		bool ManagedSocket::isConnected() const
@@ -78,69 +325,280 @@ namespace EHSN {
 			return m_sock->isConnected();
 		}
 
-		PacketID ManagedSocket::push(PacketType packetType, PacketFlags flags, PacketBufferRef buffer)
+		PacketID ManagedSocket::push(PacketType packetType, PacketFlags flags, PacketBufferRef buffer, PacketPriority priority)
 		{
 			Packet pack;
 			pack.header.packetType = packetType;
 			pack.header.flags = flags;
 			pack.buffer = buffer;
 
-			return push(pack);
+			return push(pack, priority);
 		}
 
-		PacketID ManagedSocket::push(Packet pack)
+		PacketID ManagedSocket::push(Packet pack, PacketPriority priority)
 		{
-			pack.header.packetID = m_nextPacketID++;
-			if (pack.buffer)
-				pack.header.packetSize = pack.buffer->size();
-			else
-				pack.header.packetSize = 0;
+			return pushSendQueue(pack, priority, true);
+		}
 
-			if (m_cryptThreadPool)
-				m_cryptPool->pushJob(std::bind(&ManagedSocket::makeSendableJob, this, pack));
-			else
-				m_sendPool->pushJob(std::bind(&ManagedSocket::sendJobEncrypt, this, pack));
+		PacketID ManagedSocket::tryPush(PacketType packetType, PacketFlags flags, PacketBufferRef buffer, PacketPriority priority)
+		{
+			Packet pack;
+			pack.header.packetType = packetType;
+			pack.header.flags = flags;
+			pack.buffer = buffer;
 
-			return pack.header.packetID;
+			return tryPush(pack, priority);
 		}
 
-		Packet ManagedSocket::pull(PacketType packType)
+		PacketID ManagedSocket::tryPush(Packet pack, PacketPriority priority)
 		{
-			Packet pack;
-			bool gotPack = false;
-			while (m_sock->isConnected())
+			return pushSendQueue(pack, priority, false);
+		}
+
+		SendHandle ManagedSocket::pushTracked(Packet pack, PacketPriority priority)
+		{
+			SendHandle handle;
+			pushSendQueue(pack, priority, true, &handle);
+			return handle;
+		}
+
+		SendHandle ManagedSocket::tryPushTracked(Packet pack, PacketPriority priority)
+		{
+			SendHandle handle;
+			pushSendQueue(pack, priority, false, &handle);
+			return handle;
+		}
+
+		std::vector<SendHandle> ManagedSocket::broadcast(const std::vector<ManagedSocket*>& sockets, PacketType packetType, PacketFlags flags, PacketBufferRef buffer, PacketPriority priority)
+		{
+			std::vector<SendHandle> handles(sockets.size());
+			if (sockets.empty())
+				return handles;
+
+			ThreadPoolRef pool;
 			{
-				std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+				std::unique_lock<std::mutex> lock(s_mtxBroadcast);
+				if (!s_broadcastPool)
+					s_broadcastPool = std::make_shared<ThreadPool>(std::max(1u, std::thread::hardware_concurrency()));
+				pool = s_broadcastPool;
+			}
 
-				if (packType == SPT_UNDEFINED)
-				{
-					for (auto& it : m_recvQueue)
+			// Counted down by the jobs, as the pool may be shared with other broadcasts.
+			std::mutex mtxDone;
+			std::condition_variable condDone;
+			uint64_t nRemaining = sockets.size();
+			std::exception_ptr error; // First exception thrown by a job, rethrown once every job is done.
+
+			uint64_t packetSize = buffer ? buffer->size() : 0;
+			for (uint64_t i = 0; i < sockets.size(); ++i)
+			{
+				pool->pushJob(
+					[&, i]()
 					{
-						if (!it.second.empty())
+						std::exception_ptr jobError;
+						try
+						{
+							ManagedSocket* sock = sockets[i];
+
+							Packet pack;
+							pack.header.packetType = packetType;
+							pack.header.flags = flags & ~FLAG_PH_COMPRESSED;
+							pack.header.packetSize = packetSize;
+							if (packetSize > 0)
+							{
+								// Reads the source up to the next block boundary, which lies within its reserved size.
+								uint64_t tStart = CURR_TIME_NS();
+								pack.buffer = s_broadcastBuffers.acquire(packetSize);
+								crypto::aes::encrypt(buffer->data(), packetSize, pack.buffer->data(), sock->m_sock->getAESKey(), true);
+								sock->m_typeStats[packetType].encryptTime.fetch_add(CURR_TIME_NS() - tStart, std::memory_order_relaxed);
+							}
+
+							// Never block, a slow peer must not hold a broadcast thread (and with it the other sockets).
+							sock->pushSendQueue(pack, priority, false, &handles[i], true);
+						}
+						catch (...)
 						{
-							pack = it.second.front();
-							it.second.pop();
-							gotPack = true;
+							jobError = std::current_exception();
 						}
+
+						// Always counted down, the caller would wait forever otherwise.
+						{
+							std::unique_lock<std::mutex> lock(mtxDone);
+							if (jobError && !error)
+								error = jobError;
+							--nRemaining;
+						}
+						condDone.notify_one();
 					}
-				}
+				);
+			}
+
+			std::unique_lock<std::mutex> lock(mtxDone);
+			condDone.wait(lock, [&nRemaining]() { return nRemaining == 0; });
+
+			if (error)
+				std::rethrow_exception(error);
+
+			return handles;
+		}
+
+		PacketID ManagedSocket::pushSendQueue(Packet& pack, PacketPriority priority, bool block, SendHandle* pHandle, bool isEncrypted)
+		{
+			EHSN_TRACE_SPAN(span, "push", 0);
+
+			bool isExpress = pack.header.flags & FLAG_PH_SEND_IMMEDIATE;
+			bool needsCompression = false;
+			if (!isEncrypted)
+			{
+				pack.header.flags &= ~FLAG_PH_COMPRESSED;
+
+				if (pack.buffer)
+					pack.header.packetSize = pack.buffer->size();
 				else
+					pack.header.packetSize = 0;
+
+				// Compression is left to the crypt/send job, express packets are never compressed.
+				if (!isExpress && pack.header.packetSize > 0)
+				{
+					std::unique_lock<std::mutex> lock(m_mtxCompression);
+					needsCompression = m_compressionCodec != compression::CODEC_NONE && pack.header.packetSize >= m_compressionMinSize;
+				}
+			}
+
+			priority = std::min(priority, (PacketPriority)(PRIO_COUNT - 1));
+
+			auto entry = std::make_shared<SendEntry>();
+			entry->priority = priority;
+			entry->tQueued = CURR_TIME_NS();
+			entry->nFrames = std::max<uint64_t>(1, (pack.header.packetSize + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE);
+			entry->needsCompression = needsCompression;
+
+			entry->isEncrypted = isEncrypted;
+			if (isExpress)
+			{
+				entry->priority = priority = PRIO_CONTROL;
+				if (isEncrypted)
+					entry->nFramesEncrypted = entry->nFrames;
+			}
+
+			std::vector<SendEntryRef> stale;
+			uint64_t nExpressJobs = 0;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+
+				// Packets replaced by this one don't count against the limits anymore.
+				uint64_t nStaleBytes = 0;
+				if (pack.header.flags & FLAG_PH_REMOVE_PREVIOUS)
+					findStaleSendEntries(pack.header.packetType, stale);
+				for (auto& e : stale)
+					nStaleBytes += e->packet.header.packetSize;
+				m_nSendBytesQueued -= nStaleBytes;
+				m_nSendPacketsQueued -= stale.size();
+
+				// Control packets are never held back, so keep-alives and pings can't get stuck behind bulk data.
+				auto canPush = [this, &pack, priority]() { return priority == PRIO_CONTROL || sendQueueFits(pack.header.packetSize) || !m_sock->isConnected(); };
+				if (!block && !canPush())
+				{
+					m_nSendBytesQueued += nStaleBytes;
+					m_nSendPacketsQueued += stale.size();
+					return 0;
+				}
+
+				for (auto& e : stale)
+					m_pendingSends.erase(e->packet.header.packetID);
+
+				for (auto& lanes : { &m_sendQueue, &m_cryptQueue })
 				{
-					auto typeIterator = m_recvQueue.find(packType);
-					if (typeIterator != m_recvQueue.end() &&
-						!typeIterator->second.empty())
+					for (auto& lane : *lanes)
 					{
-						pack = typeIterator->second.front();
-						typeIterator->second.pop();
-						gotPack = true;
+						lane.erase(
+							std::remove_if(lane.begin(), lane.end(), [&stale](const SendEntryRef& e) { return std::find(stale.begin(), stale.end(), e) != stale.end(); }),
+							lane.end()
+						);
 					}
 				}
 
-				if (gotPack)
+				m_sendSpace.wait(lock, canPush);
+
+				m_nSendBytesQueued += pack.header.packetSize;
+				++m_nSendPacketsQueued;
+
+				// Assigned while holding the lock, so IDs are increasing in queue order.
+				pack.header.packetID = m_nextPacketID++;
+				EHSN_TRACE_SET_ID(span, pack.header.packetID);
+				entry->packet = pack;
+
+				if (pHandle)
+				{
+					entry->completion = SendHandle::makeState(pack.header.packetID);
+					*pHandle = SendHandle(entry->completion);
+				}
+				m_pendingSends.emplace(pack.header.packetID, entry);
+
+				if (isExpress)
+				{
+					m_expressQueue.push_back(entry);
+					if (m_cryptThreadPool && isEncrypted)
+						nExpressJobs = scheduleExpressLocked();
+				}
+				else
+				{
+					m_sendQueue[priority].push_back(entry);
+					if (m_cryptThreadPool)
+						m_cryptQueue[priority].push_back(entry);
+				}
+			}
+
+			// The jobs pushed for the stale packets will pick up other frames or do nothing.
+			for (auto& e : stale)
+			{
+				if (e->completion)
+					SendHandle::complete(e->completion, SEND_DROPPED, 0);
+				callSentCallback(e->packet, 0);
+			}
+
+			// Express packets are encrypted by their own job instead of waiting behind the jobs queued on m_cryptPool.
+			if (isExpress && m_cryptThreadPool)
+			{
+				if (!isEncrypted)
+					m_cryptThreadPool->pushJob(std::bind(&ManagedSocket::expressJob, this, entry));
+				for (uint64_t i = 0; i < nExpressJobs; ++i)
+					m_sendPool->pushJob(std::bind(&ManagedSocket::sendJobNoEncrypt, this));
+				return pack.header.packetID;
+			}
+
+			// One job per frame. Each job handles the most urgent frame at the time it runs.
+			// Compression can only reduce the number of frames, the surplus jobs do nothing.
+			for (uint64_t i = 0; i < entry->nFrames; ++i)
+			{
+				if (m_cryptThreadPool)
+					m_cryptPool->pushJob(std::bind(&ManagedSocket::cryptJob, this));
+				else
+					m_sendPool->pushJob(std::bind(&ManagedSocket::sendJobEncrypt, this));
+			}
+
+			return pack.header.packetID;
+		}
+
+		Packet ManagedSocket::pull(PacketType packType)
+		{
+			Packet pack;
+			RecvWaiter waiter;
+
+			std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+			while (m_sock->isConnected())
+			{
+				if (popRecvQueue(packType, pack))
 					break;
 
-				m_recvNotify.wait(lock, [this] { return m_recvAvail || !m_sock->isConnected(); });
-				m_recvAvail = false;
+				auto& waiters = (packType == SPT_UNDEFINED) ? m_recvAnyWaiters : m_recvTypeQueues[packType].waiters;
+
+				waiter.signaled = false;
+				waiters.push_back(&waiter);
+				waiter.cond.wait(lock, [this, &waiter] { return waiter.signaled || !m_sock->isConnected(); });
+
+				if (!waiter.signaled)
+					waiters.erase(std::find(waiters.begin(), waiters.end(), &waiter));
 			}
 
 			return pack;
@@ -151,17 +609,12 @@ namespace EHSN {
 			std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
 			
 			if (packType == SPT_UNDEFINED)
-			{
-				uint64_t nAvail = 0;
-				for (auto& it : m_recvQueue)
-					nAvail += it.second.size();
-				return nAvail;
-			}
+				return m_recvQueue.size();
 			
-			auto typeIterator = m_recvQueue.find(packType);
-			if (typeIterator == m_recvQueue.end())
+			auto typeQueue = m_recvTypeQueues.find(packType);
+			if (!typeQueue)
 				return 0;
-			return typeIterator->second.size();
+			return typeQueue->packets.size();
 		}
 
 		std::vector<PacketType> ManagedSocket::typesPullable()
@@ -169,284 +622,1553 @@ namespace EHSN {
 			std::vector<PacketType> pTypes;
 			std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
 			
-			for (auto& it : m_recvQueue)
-			{
-				if (it.second.size() > 0)
-					pTypes.push_back(it.first);
-			}
+			m_recvTypeQueues.forEach(
+				[&pTypes](PacketType packType, RecvTypeQueue& typeQueue)
+				{
+					if (!typeQueue.packets.empty())
+						pTypes.push_back(packType);
+				}
+			);
 
 			return pTypes;
 		}
 
 		void ManagedSocket::wait(PacketID packetID)
 		{
-			std::unique_lock<std::mutex> lock(m_mtxPacketIDBeingSent);
+			SendHandle handle;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+
+				auto it = m_pendingSends.find(packetID);
+				if (it == m_pendingSends.end())
+					return;
+
+				auto& entry = it->second;
+				if (!entry->completion)
+					entry->completion = SendHandle::makeState(packetID);
+				handle = SendHandle(entry->completion);
+			}
 
-			m_sentNotify.wait(lock, [this, packetID](){ return packetID < m_currPacketIDBeingSent; });
+			handle.wait();
 		}
 
 		void ManagedSocket::clear()
 		{
 			m_sendPool->clear();
+			if (m_cryptPool)
+				m_cryptPool->clear();
 
+			std::vector<PacketHeader> dropped;
 			{
-				std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
-				while (!m_recvQueue.empty())
+				std::unique_lock<std::mutex> lock(m_mtxDecryptQueue);
+
+				// The remaining fragments of partly dropped packets are still received, but must not be delivered.
+				std::unordered_set<PacketID> partial;
+				for (auto& lane : m_decryptQueue)
+				{
+					for (auto& de : lane)
+					{
+						if (de.isComplete)
+							dropped.push_back(de.packet.header);
+						else
+							partial.insert(de.packet.header.packetID);
+					}
+					lane.clear();
+				}
+				for (auto& header : dropped)
+					partial.erase(header.packetID);
+				m_droppedFragments.insert(partial.begin(), partial.end());
+			}
+
+			std::vector<Ref<SendHandle::State>> droppedSends;
+			uint64_t nCryptJobs = 0;
+			uint64_t nSendJobs = 0;
+			uint64_t nExpressJobs = 0;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+
+				// Packets with frames still in flight are not in any lane anymore, they complete normally.
+				// Packets that have started sending are kept as well, the peer would never complete (and free) their fragments otherwise.
+				uint64_t nDroppedBytes = 0;
+				uint64_t nDroppedPackets = 0;
+				const auto drop = [&](std::deque<SendEntryRef>& lane)
+				{
+					std::deque<SendEntryRef> kept;
+					for (auto& entry : lane)
+					{
+						if (entry->nFramesSent > 0 || entry->nFramesCryptTaken > 0)
+						{
+							kept.push_back(entry);
+							continue;
+						}
+
+						if (m_pendingSends.erase(entry->packet.header.packetID))
+						{
+							nDroppedBytes += entry->packet.header.packetSize;
+							++nDroppedPackets;
+							if (entry->completion)
+								droppedSends.push_back(entry->completion);
+						}
+					}
+					lane = std::move(kept);
+				};
+
+				for (uint32_t i = 0; i < PRIO_COUNT; ++i)
+				{
+					drop(m_sendQueue[i]);
+					drop(m_cryptQueue[i]);
+				}
+				drop(m_expressQueue);
+				m_nSendBytesQueued -= std::min(m_nSendBytesQueued, nDroppedBytes);
+				m_nSendPacketsQueued -= std::min(m_nSendPacketsQueued, nDroppedPackets);
+
+				// The jobs of the kept packets have been cleared above. Too many jobs are fine, they pick up other frames or do nothing.
+				for (auto& lane : m_sendQueue)
 				{
-					auto i = m_recvQueue.begin();
-					while (!i->second.empty())
-						i->second.pop();
-					m_recvQueue.erase(i);
+					for (auto& entry : lane)
+					{
+						if (m_cryptThreadPool)
+						{
+							nCryptJobs += entry->nFrames - entry->nFramesCryptTaken;
+							nSendJobs += entry->nFramesEncrypted - std::min(entry->nFramesEncrypted, entry->nFramesSent);
+						}
+						else
+						{
+							nSendJobs += entry->nFrames - entry->nFramesSent;
+						}
+					}
 				}
+				for (auto& entry : m_expressQueue)
+					nExpressJobs += entry->nFrames - entry->nFramesSent;
+			}
+			m_sendSpace.notify_all();
+
+			for (uint64_t i = 0; i < nExpressJobs; ++i)
+				m_sendPool->pushJob(std::bind(m_cryptThreadPool ? &ManagedSocket::sendJobNoEncrypt : &ManagedSocket::sendJobEncrypt, this));
+			for (uint64_t i = 0; i < nCryptJobs; ++i)
+				m_cryptPool->pushJob(std::bind(&ManagedSocket::cryptJob, this));
+			for (uint64_t i = 0; i < nSendJobs; ++i)
+				m_sendPool->pushJob(std::bind(m_cryptThreadPool ? &ManagedSocket::sendJobNoEncrypt : &ManagedSocket::sendJobEncrypt, this));
+
+			for (auto& completion : droppedSends)
+				SendHandle::complete(completion, SEND_DROPPED, 0);
+
+			{
+				std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+				for (auto& header : dropped)
+					releaseRecvLocked(header);
+				for (auto& re : m_recvQueue)
+					releaseRecvLocked(re.packet.header);
+				m_recvTypeQueues.forEach([](PacketType, RecvTypeQueue& typeQueue) { typeQueue.packets.clear(); });
+				m_recvQueue.clear();
 			}
 		}
 
 		void ManagedSocket::setSentCallback(PacketType pType, PacketSentCallback cb, void* pParam)
 		{
-			std::unique_lock<std::mutex> lock(m_mtxSentCallbacks);
-
-			CallbackData<PacketSentCallback> cd;
-			cd.callback = cb;
-			cd.pParam = pParam;
-
 			if (cb)
-				m_sentCallbacks.emplace(pType, cd);
+				setSentHandler(pType, [cb, pParam](PacketID pID, uint64_t nBytesSent) { cb(pID, nBytesSent, pParam); });
 			else
-				m_sentCallbacks.erase(pType);
+				setSentHandler(pType, nullptr);
 		}
 
 		void ManagedSocket::setRecvCallback(PacketType pType, PacketRecvCallback cb, void* pParam)
 		{
-			std::unique_lock<std::mutex> lock(m_mtxSentCallbacks);
-
-			CallbackData<PacketRecvCallback> cd;
-			cd.callback = cb;
-			cd.pParam = pParam;
-
 			if (cb)
-				m_recvCallbacks.emplace(pType, cd);
+				setRecvHandler(pType, [cb, pParam](Packet pack, uint64_t nBytesReceived) { cb(pack, nBytesReceived, pParam); });
 			else
-				m_recvCallbacks.erase(pType);
+				setRecvHandler(pType, nullptr);
 		}
 
-		bool ManagedSocket::callSentCallback(const Packet& pack, uint64_t nBytesSent)
+		void ManagedSocket::setSentHandler(PacketType pType, PacketSentHandler handler)
 		{
-			setCurrentPacketBeingSent(m_currPacketIDBeingSent + 1);
-
 			std::unique_lock<std::mutex> lock(m_mtxSentCallbacks);
 
-			auto iterator = m_sentCallbacks.find(pack.header.packetType);
-			if (iterator == m_sentCallbacks.end())
-				return false;
-
-			m_callbackPool->pushJob(std::bind(iterator->second.callback, pack.header.packetID, nBytesSent, iterator->second.pParam));
-			return true;
+			if (handler)
+				m_sentHandlers[pType] = std::make_shared<PacketSentHandler>(std::move(handler));
+			else
+				m_sentHandlers.erase(pType);
 		}
 
-		bool ManagedSocket::callRecvCallback(Packet& pack, uint64_t nBytesReceived)
+		void ManagedSocket::setRecvHandler(PacketType pType, PacketRecvHandler handler)
 		{
 			std::unique_lock<std::mutex> lock(m_mtxRecvCallbacks);
 
-			auto iterator = m_recvCallbacks.find(pack.header.packetType);
-			if (iterator == m_recvCallbacks.end())
-				return false;
+			if (handler)
+				m_recvDispatch[pType].handler = std::make_shared<PacketRecvHandler>(std::move(handler));
+			else if (auto dispatch = m_recvDispatch.find(pType))
+				dispatch->handler.reset();
+		}
+
+		void ManagedSocket::setDispatchPolicy(PacketType pType, DispatchPolicy policy, PacketKeyFunc keyFunc)
+		{
+			std::unique_lock<std::mutex> lock(m_mtxRecvCallbacks);
+
+			auto& dispatch = m_recvDispatch[pType];
+			dispatch.policy = policy;
+			dispatch.keyFunc = keyFunc ? std::make_shared<PacketKeyFunc>(std::move(keyFunc)) : nullptr;
+		}
+
+		void ManagedSocket::setStreamCallback(PacketType pType, PacketChunkCallback cb, void* pParam, uint32_t maxChunksQueued)
+		{
+			std::unique_lock<std::mutex> lock(m_mtxRecvCallbacks);
+
+			StreamData sd;
+			sd.cd.callback = cb;
+			sd.cd.pParam = pParam;
+			sd.maxChunksQueued = std::max(1u, maxChunksQueued);
+
+			if (cb)
+				m_streamCallbacks[pType] = sd;
+			else
+				m_streamCallbacks.erase(pType);
+		}
+
+		void ManagedSocket::setSendLimits(uint64_t maxBytes, uint64_t maxPackets, uint64_t lowWaterBytes)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+				m_maxSendBytes = maxBytes;
+				m_maxSendPackets = maxPackets;
+				m_sendLowWater = lowWaterBytes;
+			}
+			m_sendSpace.notify_all();
+		}
+
+		void ManagedSocket::setSendDrainCallback(SendDrainCallback cb, void* pParam)
+		{
+			std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+
+			m_sendDrainCallback.callback = cb;
+			m_sendDrainCallback.pParam = pParam;
+		}
+
+		uint64_t ManagedSocket::nSendBytesQueued()
+		{
+			std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+			return m_nSendBytesQueued;
+		}
+
+		uint64_t ManagedSocket::nSendPacketsQueued()
+		{
+			std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+			return m_nSendPacketsQueued;
+		}
+
+		void ManagedSocket::setRecvLimits(uint64_t maxPacketSize, uint64_t maxBytesQueued, uint64_t maxPacketsPerType)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+				m_maxRecvPacketSize = maxPacketSize;
+				m_maxRecvBytes = maxBytesQueued;
+				m_maxRecvPacketsPerType = maxPacketsPerType;
+			}
+			m_recvSpace.notify_all();
+		}
+
+		uint64_t ManagedSocket::nRecvBytesQueued()
+		{
+			std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+			return m_nRecvBytesReserved;
+		}
+
+		void ManagedSocket::setGlobalRecvLimits(uint64_t maxPacketSize, uint64_t maxBytesQueued)
+		{
+			{
+				std::unique_lock<std::mutex> lock(s_mtxGlobalRecv);
+				s_maxGlobalRecvPacketSize = maxPacketSize;
+				s_maxGlobalRecvBytes = maxBytesQueued;
+			}
+			s_globalRecvSpace.notify_all();
+		}
+
+		uint64_t ManagedSocket::nGlobalRecvBytesQueued()
+		{
+			std::unique_lock<std::mutex> lock(s_mtxGlobalRecv);
+			return s_nGlobalRecvBytesReserved;
+		}
+
+		bool ManagedSocket::setCompression(compression::Codec codec, uint64_t minSize, float maxSampleRatio)
+		{
+			bool available = (codec == compression::CODEC_NONE) || compression::isAvailable(codec);
+
+			std::unique_lock<std::mutex> lock(m_mtxCompression);
+			m_compressionCodec = available ? codec : compression::CODEC_NONE;
+			m_compressionMinSize = minSize;
+			m_compressionMaxRatio = maxSampleRatio;
+
+			return available;
+		}
+
+		CompressionMetrics ManagedSocket::getCompressionMetrics()
+		{
+			std::unique_lock<std::mutex> lock(m_mtxCompression);
+			return m_compressionMetrics;
+		}
+
+		PacketTypeStats ManagedSocket::getTypeStats(PacketType pType)
+		{
+			PacketTypeStats pts;
+
+			auto stats = m_typeStats.find(pType);
+			if (!stats)
+				return pts;
+
+			pts.nPacketsSent = stats->nPacketsSent.load(std::memory_order_relaxed);
+			pts.nBytesSent = stats->nBytesSent.load(std::memory_order_relaxed);
+			pts.nPacketsReceived = stats->nPacketsReceived.load(std::memory_order_relaxed);
+			pts.nBytesReceived = stats->nBytesReceived.load(std::memory_order_relaxed);
+			pts.sendQueueTime = stats->sendQueueTime.load(std::memory_order_relaxed);
+			pts.encryptTime = stats->encryptTime.load(std::memory_order_relaxed);
+			pts.nDelivered = stats->nDelivered.load(std::memory_order_relaxed);
+			pts.deliverTime = stats->deliverTime.load(std::memory_order_relaxed);
+			return pts;
+		}
+
+		std::vector<std::pair<PacketType, PacketTypeStats>> ManagedSocket::getTypeStats()
+		{
+			std::vector<std::pair<PacketType, PacketTypeStats>> allStats;
+
+			m_typeStats.forEach(
+				[this, &allStats](PacketType pType, TypeStats& stats)
+				{
+					if (stats.nPacketsSent || stats.nBytesSent || stats.nPacketsReceived || stats.nBytesReceived)
+						allStats.emplace_back(pType, getTypeStats(pType));
+				}
+			);
+
+			return allStats;
+		}
+
+		void ManagedSocket::resetTypeStats()
+		{
+			m_typeStats.forEach(
+				[](PacketType, TypeStats& stats)
+				{
+					stats.nPacketsSent = 0;
+					stats.nBytesSent = 0;
+					stats.nPacketsReceived = 0;
+					stats.nBytesReceived = 0;
+					stats.sendQueueTime = 0;
+					stats.encryptTime = 0;
+					stats.nDelivered = 0;
+					stats.deliverTime = 0;
+				}
+			);
+		}
+
+		void ManagedSocket::probe()
+		{
+			packets::RTTProbe probe;
+			probe.tSent = CURR_TIME_NS();
+
+			auto buffer = std::make_shared<PacketBuffer>(sizeof(probe));
+			buffer->write(probe);
+			push(SPT_RTT_PROBE, FLAG_PH_SEND_IMMEDIATE, buffer, PRIO_CONTROL);
+		}
+
+		void ManagedSocket::startProbing(uint32_t intervalMS)
+		{
+			stopProbing();
+
+			std::unique_lock<std::mutex> lock(m_mtxProbe);
+			m_probing = true;
+			m_probeInterval = std::max(1u, intervalMS);
+			m_probeThread = std::thread(&ManagedSocket::probeThreadFunc, this);
+		}
+
+		void ManagedSocket::stopProbing()
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mtxProbe);
+				m_probing = false;
+				m_probeNotify.notify_all();
+			}
+
+			if (m_probeThread.joinable())
+				m_probeThread.join();
+		}
+
+		LinkStats ManagedSocket::getLinkStats()
+		{
+			std::unique_lock<std::mutex> lock(m_mtxLinkStats);
+			return m_linkStats;
+		}
+
+		bool ManagedSocket::callSentCallback(const Packet& pack, uint64_t nBytesSent)
+		{
+			std::unique_lock<std::mutex> lock(m_mtxSentCallbacks);
+
+			auto iterator = m_sentHandlers.find(pack.header.packetType);
+			if (iterator == m_sentHandlers.end())
+				return false;
+
+			m_callbackPool->pushJob(
+				[handler = iterator->second, pID = pack.header.packetID, nBytesSent]()
+				{
+					(*handler)(pID, nBytesSent);
+				}
+			);
+			return true;
+		}
+
+		bool ManagedSocket::callRecvCallback(Packet& pack, uint64_t nBytesReceived)
+		{
+			// Every received packet passes through here, whether it has a handler or not.
+			// Packets cut short by a disconnect count towards the bytes only.
+			uint64_t tReceived = CURR_TIME_NS();
+			auto& stats = m_typeStats[pack.header.packetType];
+			if (nBytesReceived >= pack.header.packetSize)
+				stats.nPacketsReceived.fetch_add(1, std::memory_order_relaxed);
+			stats.nBytesReceived.fetch_add(nBytesReceived, std::memory_order_relaxed);
+
+			RecvDispatch dispatch;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxRecvCallbacks);
+
+				auto entry = m_recvDispatch.find(pack.header.packetType);
+				if (!entry || !entry->handler)
+					return false;
+				dispatch = *entry;
+			}
+
+			if (dispatch.policy == DISPATCH_INLINE)
+			{
+				EHSN_TRACE_SPAN(span, "callback", pack.header.packetID);
+				stats.nDelivered.fetch_add(1, std::memory_order_relaxed);
+				stats.deliverTime.fetch_add(CURR_TIME_NS() - tReceived, std::memory_order_relaxed);
+				(*dispatch.handler)(pack, nBytesReceived);
+				releaseRecv(pack.header);
+				return true;
+			}
+
+			uint64_t key = pack.header.packetType;
+			if (dispatch.policy == DISPATCH_PER_KEY && dispatch.keyFunc)
+				key = (*dispatch.keyFunc)(pack);
+
+			auto pool = dispatchPool(dispatch.policy, key);
+			if (pool != m_callbackPool)
+			{
+				std::unique_lock<std::mutex> lock(m_mtxDispatchPending);
+				++m_nDispatchPending;
+			}
+
+			pool->pushJob(
+				[this, &stats, handler = dispatch.handler, pack, nBytesReceived, tReceived, isShared = pool != m_callbackPool]()
+				{
+					{
+						EHSN_TRACE_SPAN(span, "callback", pack.header.packetID);
+						stats.nDelivered.fetch_add(1, std::memory_order_relaxed);
+						stats.deliverTime.fetch_add(CURR_TIME_NS() - tReceived, std::memory_order_relaxed);
+						(*handler)(pack, nBytesReceived);
+						releaseRecv(pack.header);
+					}
+
+					if (isShared)
+					{
+						std::unique_lock<std::mutex> lock(m_mtxDispatchPending);
+						if (--m_nDispatchPending == 0)
+							m_condDispatchDone.notify_all();
+					}
+				}
+			);
+			return true;
+		}
+
+		ThreadPoolRef ManagedSocket::dispatchPool(DispatchPolicy policy, uint64_t key)
+		{
+			if (policy == DISPATCH_SERIALIZED)
+				return m_callbackPool;
+
+			std::unique_lock<std::mutex> lock(s_mtxDispatchPools);
+
+			if (policy == DISPATCH_PARALLEL)
+			{
+				if (!s_parallelPool)
+					s_parallelPool = std::make_shared<ThreadPool>(m_nDispatchThreads);
+				return s_parallelPool;
+			}
+
+			if (s_keyPools.empty())
+			{
+				s_keyPools.resize(std::min(m_nDispatchThreads, MAX_DISPATCH_KEY_THREADS));
+				for (auto& pool : s_keyPools)
+					pool = std::make_shared<ThreadPool>(1);
+			}
+			return s_keyPools[key % s_keyPools.size()];
+		}
+
+		void ManagedSocket::sendJobEncrypt()
+		{
+			SendEntryRef entry;
+			uint64_t frame;
+			if (nextSendFrame(entry, frame, false))
+				sendFrame(entry, frame, !entry->isEncrypted);
+		}
+
+		void ManagedSocket::sendJobNoEncrypt()
+		{
+			SendEntryRef entry;
+			uint64_t frame;
+			if (nextSendFrame(entry, frame, true))
+				sendFrame(entry, frame, false);
+		}
+
+		void ManagedSocket::makeSendableJob()
+		{
+			SendEntryRef entry;
+			uint64_t frame = 0;
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+					for (auto& lane : m_cryptQueue)
+					{
+						if (lane.empty())
+							continue;
+
+						entry = lane.front();
+						if (entry->needsCompression)
+							break;
+
+						frame = entry->nFramesCryptTaken++;
+						if (entry->nFramesCryptTaken == entry->nFrames)
+							lane.pop_front();
+						break;
+					}
+				}
+
+				if (!entry || !entry->needsCompression)
+					break;
+
+				// Compress before encrypting the first frame, then look for the most urgent frame again.
+				compressSendEntry(entry);
+				entry = nullptr;
+			}
+
+			if (!entry)
+				return;
+
+			auto& packet = entry->packet;
+			EHSN_TRACE_SPAN(span, "encrypt", packet.header.packetID);
+			if (packet.buffer && !entry->isEncrypted)
+			{
+				uint64_t offset = frame * FRAGMENT_SIZE;
+				uint64_t size = std::min(FRAGMENT_SIZE, packet.header.packetSize - offset);
+				if (size > 0)
+				{
+					uint64_t tStart = CURR_TIME_NS();
+					crypto::aes::encryptThreaded(
+						(char*)packet.buffer->data() + offset,
+						size,
+						(char*)packet.buffer->data() + offset,
+						m_sock->getAESKey(),
+						true,
+						m_cryptThreadPool->size(),
+						m_cryptThreadPool
+					);
+					m_typeStats[packet.header.packetType].encryptTime.fetch_add(CURR_TIME_NS() - tStart, std::memory_order_relaxed);
+				}
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+				++entry->nFramesEncrypted;
+			}
+
+			m_sendPool->pushJob(std::bind(&ManagedSocket::sendJobNoEncrypt, this));
+		}
+
+		void ManagedSocket::expressJob(SendEntryRef entry)
+		{
+			auto& packet = entry->packet;
+			EHSN_TRACE_SPAN(span, "encrypt", packet.header.packetID);
+
+			if (packet.header.packetSize > 0)
+			{
+				uint64_t tStart = CURR_TIME_NS();
+				crypto::aes::encrypt(packet.buffer->data(), packet.header.packetSize, packet.buffer->data(), m_sock->getAESKey(), true);
+				m_typeStats[packet.header.packetType].encryptTime.fetch_add(CURR_TIME_NS() - tStart, std::memory_order_relaxed);
+			}
+
+			uint64_t nJobs = 0;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+				entry->nFramesEncrypted = entry->nFrames;
+				nJobs = scheduleExpressLocked();
+			}
+
+			for (uint64_t i = 0; i < nJobs; ++i)
+				m_sendPool->pushJob(std::bind(&ManagedSocket::sendJobNoEncrypt, this));
+		}
+
+		uint64_t ManagedSocket::scheduleExpressLocked()
+		{
+			// Express packets are sent in order, a packet encrypted early waits for the ones in front of it.
+			uint64_t nJobs = 0;
+			for (auto& entry : m_expressQueue)
+			{
+				if (entry->nFramesEncrypted < entry->nFrames)
+					break;
+
+				if (!entry->hasSendJobs)
+				{
+					nJobs += entry->nFrames - entry->nFramesSent;
+					entry->hasSendJobs = true;
+				}
+			}
+			return nJobs;
+		}
+
+		bool ManagedSocket::nextSendFrame(SendEntryRef& entry, uint64_t& frame, bool needsEncrypted)
+		{
+			std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+
+			SendEntryRef uncompressed;
+			const auto takeFrame = [&](std::deque<SendEntryRef>& lane) -> bool
+			{
+				if (lane.empty())
+					return false;
+
+				// Frames of a lane get encrypted in order, so only the first packet can have a frame ready.
+				auto& front = lane.front();
+				uint64_t nReady = needsEncrypted ? front->nFramesEncrypted : front->nFrames;
+				if (front->nFramesSent >= nReady)
+					return false;
+
+				// Only reached without m_cryptThreadPool, the crypt job compresses before encrypting otherwise.
+				if (front->needsCompression)
+				{
+					uncompressed = front;
+					return true;
+				}
+
+				entry = front;
+				frame = entry->nFramesSent++;
+				if (entry->nFramesSent == entry->nFrames)
+					lane.pop_front();
+				return true;
+			};
+
+			while (true)
+			{
+				bool taken = takeFrame(m_expressQueue);
+				for (auto& lane : m_sendQueue)
+				{
+					if (taken)
+						break;
+					taken = takeFrame(lane);
+				}
+
+				if (!uncompressed)
+					return taken;
+
+				// Compress before sending the first frame, then look for the most urgent frame again.
+				lock.unlock();
+				compressSendEntry(uncompressed);
+				uncompressed = nullptr;
+				lock.lock();
+			}
+		}
+
+		void ManagedSocket::sendFrame(SendEntryRef entry, uint64_t frame, bool encrypt)
+		{
+			auto& packet = entry->packet;
+			auto& stats = m_typeStats[packet.header.packetType];
+			EHSN_TRACE_SPAN(span, "send", packet.header.packetID);
+
+			if (frame == 0)
+			{
+				stats.sendQueueTime.fetch_add(CURR_TIME_NS() - entry->tQueued, std::memory_order_relaxed);
+			}
+
+			uint64_t offset = frame * FRAGMENT_SIZE;
+			uint64_t size = std::min(FRAGMENT_SIZE, packet.header.packetSize - offset);
+
+			PacketHeader header = packet.header;
+			header.frameFlags = (entry->nFrames > 1) ? FRAME_FLAG_FRAGMENT : FRAME_FLAG_NONE;
+			header.fragmentOffset = offset;
+			header.fragmentSize = (uint32_t)size;
+			header.priority = entry->priority;
+
+			bool isLastFrame = (frame == entry->nFrames - 1);
+			bool failed = false;
+
+			// Header and payload go out with a single gather write.
+			uint64_t nEncrypted = m_sock->autoEncrypt(&header, sizeof(PacketHeader), &header, m_sock->getAESKey(), false);
+
+			std::vector<asio::const_buffer> buffers = { asio::buffer(&header, nEncrypted) };
+			if (size > 0)
+			{
+				char* data = (char*)packet.buffer->data() + offset;
+
+				if (encrypt)
+				{
+					uint64_t tStart = CURR_TIME_NS();
+					m_sock->autoEncrypt(data, size, data, m_sock->getAESKey(), true);
+					stats.encryptTime.fetch_add(CURR_TIME_NS() - tStart, std::memory_order_relaxed);
+				}
+
+				buffers.push_back(asio::buffer(data, crypto::aes::paddedSize(size)));
+			}
+
+			uint64_t nWritten = m_sock->writeRaw(std::move(buffers));
+			if (nWritten < nEncrypted)
+			{
+				failed = true;
+			}
+			else if (size > 0)
+			{
+				uint64_t nPayloadWritten = std::min(size, nWritten - nEncrypted);
+
+				entry->nBytesSent += nPayloadWritten;
+				stats.nBytesSent.fetch_add(nPayloadWritten, std::memory_order_relaxed);
+				failed = (nPayloadWritten < size);
+			}
+
+			if (failed && !isLastFrame)
+			{
+				// Drop the remaining frames of the packet.
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+				for (auto& lane : m_sendQueue)
+					lane.erase(std::remove(lane.begin(), lane.end(), entry), lane.end());
+				for (auto& lane : m_cryptQueue)
+					lane.erase(std::remove(lane.begin(), lane.end(), entry), lane.end());
+				m_expressQueue.erase(std::remove(m_expressQueue.begin(), m_expressQueue.end(), entry), m_expressQueue.end());
+			}
+
+			if (failed || isLastFrame)
+			{
+				if (!failed)
+					stats.nPacketsSent.fetch_add(1, std::memory_order_relaxed);
+				releaseSendEntry(entry, failed ? SEND_FAILED : SEND_COMPLETE);
+				callSentCallback(packet, entry->nBytesSent);
+			}
+		}
+
+		void ManagedSocket::findStaleSendEntries(PacketType packType, std::vector<SendEntryRef>& stale)
+		{
+			for (auto& lane : m_sendQueue)
+			{
+				for (auto& entry : lane)
+				{
+					if (entry->packet.header.packetType == packType && entry->nFramesCryptTaken == 0 && entry->nFramesSent == 0)
+						stale.push_back(entry);
+				}
+			}
+		}
+
+		bool ManagedSocket::sendQueueFits(uint64_t size) const
+		{
+			if (m_maxSendPackets > 0 && m_nSendPacketsQueued >= m_maxSendPackets)
+				return false;
+			if (m_maxSendBytes > 0 && m_nSendBytesQueued > 0 && m_nSendBytesQueued + size > m_maxSendBytes)
+				return false;
+			return true;
+		}
+
+		void ManagedSocket::releaseSendEntry(const SendEntryRef& entry, SendStatus status)
+		{
+			Ref<SendHandle::State> completion;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+
+				m_pendingSends.erase(entry->packet.header.packetID);
+				completion = entry->completion;
+
+				// The counters may have been reset by clear while the packet was being sent.
+				uint64_t nBytesBefore = m_nSendBytesQueued;
+				m_nSendBytesQueued -= std::min(m_nSendBytesQueued, entry->packet.header.packetSize);
+				m_nSendPacketsQueued -= std::min<uint64_t>(m_nSendPacketsQueued, 1);
+
+				if (m_sendDrainCallback.callback && nBytesBefore > m_sendLowWater && m_nSendBytesQueued <= m_sendLowWater)
+					m_callbackPool->pushJob(std::bind(m_sendDrainCallback.callback, m_nSendBytesQueued, m_sendDrainCallback.pParam));
+			}
+			m_sendSpace.notify_all();
+
+			if (completion)
+				SendHandle::complete(completion, status, entry->nBytesSent);
+		}
+
+		void ManagedSocket::recvJobDecrypt()
+		{
+			Packet pack;
+			PacketHeader header;
+
+			uint64_t nRead = 0;
+
+			if (!m_sock->isConnected())
+				goto NextIterationRecvDecrypt;
+
+			// Waiting for the next header is idle time, not read latency.
+			if (m_sock->readSecure(&header, sizeof(PacketHeader), false) < sizeof(PacketHeader))
+				goto NextIterationRecvDecrypt;
+
+			{
+				EHSN_TRACE_SPAN(span, "recv", header.packetID);
+
+				if (recvStream(header))
+					goto NextIterationRecvDecrypt;
+
+				if (!recvFrame(header, pack, nRead, true))
+					goto NextIterationRecvDecrypt;
+
+				if (!decompressPacket(pack, nRead))
+					goto NextIterationRecvDecrypt;
+			}
+
+			if (!callRecvCallback(pack, nRead))
+				pushRecvQueue(pack);
+
+		NextIterationRecvDecrypt:
+			if (m_sock->isConnected())
+			{
+				pushRecvJob();
+			}
+			else
+			{
+				for (auto& it : m_recvFragments)
+					releaseRecv(it.second.packet.header);
+				m_recvFragments.clear();
+				wakeWaiters();
+			}
+		}
+
+		void ManagedSocket::recvJobNoDecrypt()
+		{
+			Packet pack;
+			PacketHeader header;
+
+			uint64_t nRead = 0;
+			if (!m_sock->isConnected())
+				goto NextIterationRecvNoDecrypt;
+
+			// Waiting for the next header is idle time, not read latency.
+			if (m_sock->readSecure(&header, sizeof(PacketHeader), false) < sizeof(PacketHeader))
+				goto NextIterationRecvNoDecrypt;
+
+			{
+				EHSN_TRACE_SPAN(span, "recv", header.packetID);
+
+				if (recvStream(header))
+					goto NextIterationRecvNoDecrypt;
+
+				bool isComplete = recvFrame(header, pack, nRead, false);
+				if (!isComplete && !pack.buffer)
+					goto NextIterationRecvNoDecrypt;
+
+				DecryptEntry de;
+				de.packet = pack;
+				de.offset = header.fragmentOffset;
+				de.size = (header.frameFlags & FRAME_FLAG_FRAGMENT) ? header.fragmentSize : header.packetSize;
+				de.nRead = nRead;
+				de.isComplete = isComplete;
+
+				bool isDropped = false;
+				{
+					std::unique_lock<std::mutex> lock(m_mtxDecryptQueue);
+					isDropped = m_droppedFragments.count(header.packetID) > 0;
+					if (!isDropped)
+						m_decryptQueue[std::min(header.priority, (PacketPriority)(PRIO_COUNT - 1))].push_back(de);
+					else if (isComplete)
+						m_droppedFragments.erase(header.packetID);
+				}
+
+				if (!isDropped)
+					m_cryptPool->pushJob(std::bind(&ManagedSocket::cryptJob, this));
+				else if (isComplete)
+					releaseRecv(pack.header);
+			}
+
+		NextIterationRecvNoDecrypt:
+			if (m_sock->isConnected())
+			{
+				pushRecvJob();
+			}
+			else
+			{
+				for (auto& it : m_recvFragments)
+					releaseRecv(it.second.packet.header);
+				m_recvFragments.clear();
+				{
+					std::unique_lock<std::mutex> lock(m_mtxDecryptQueue);
+					m_droppedFragments.clear();
+				}
+				wakeWaiters();
+			}
+		}
+
+		bool ManagedSocket::recvFrame(const PacketHeader& header, Packet& pack, uint64_t& nRead, bool decrypt)
+		{
+			const auto readPayload = [this, decrypt](void* buffer, uint64_t nBytes) -> uint64_t
+			{
+				if (decrypt)
+					return m_sock->readSecure(buffer, nBytes);
+				return std::min(nBytes, m_sock->readRaw(buffer, crypto::aes::paddedSize(nBytes)));
+			};
+
+			if (!(header.frameFlags & FRAME_FLAG_FRAGMENT))
+			{
+				pack.header = header;
+				pack.header.fragmentSize = 0;
+				nRead = 0;
 
-			m_callbackPool->pushJob(std::bind(iterator->second.callback, pack, nBytesReceived, iterator->second.pParam));
-			return true;
-		}
+				if (!reserveRecv(pack.header))
+					return false;
 
-		void ManagedSocket::sendJobEncrypt(Packet packet)
-		{
-			m_currPacketIDBeingSent = packet.header.packetID;
+				if (header.packetSize > 0)
+				{
+					pack.buffer = m_recvBuffers.acquire(header.packetSize);
+					nRead = readPayload(pack.buffer->data(), header.packetSize);
+				}
+				return true;
+			}
 
-			uint64_t nWritten = 0;
-			if ((nWritten = m_sock->writeSecure(&packet.header, sizeof(PacketHeader), false)) < sizeof(PacketHeader))
+			// Written without a sum, which could wrap around for values chosen by the remote endpoint.
+			if (header.fragmentOffset > header.packetSize || header.fragmentSize > header.packetSize - header.fragmentOffset)
 			{
-				callSentCallback(packet, nWritten);
-				return;
+				m_sock->disconnect(); // The remote endpoint does not follow the protocol.
+				return false;
 			}
 
-			if (packet.buffer)
+			// The payload is read padded to AES_BLOCK_SIZE, so only the last fragment may end inside a block.
+			bool isLastFragment = header.fragmentOffset + header.fragmentSize == header.packetSize;
+			if (header.fragmentOffset % AES_BLOCK_SIZE != 0 || (!isLastFragment && header.fragmentSize % AES_BLOCK_SIZE != 0))
 			{
-				if ((nWritten = m_sock->writeSecure(packet.buffer)) < packet.buffer->size())
+				m_sock->disconnect(); // The remote endpoint does not follow the protocol.
+				return false;
+			}
+
+			auto it = m_recvFragments.find(header.packetID);
+			if (it == m_recvFragments.end())
+			{
+				if (header.fragmentOffset != 0)
 				{
-					callSentCallback(packet, nWritten);
-					return;
+					m_sock->disconnect(); // Fragments are sent in order, starting at offset 0.
+					return false;
 				}
+
+				RecvFragments fragments;
+				fragments.packet.header = header;
+				fragments.packet.header.frameFlags = FRAME_FLAG_NONE;
+				fragments.packet.header.fragmentOffset = 0;
+				fragments.packet.header.fragmentSize = 0;
+
+				if (!reserveRecv(fragments.packet.header))
+					return false;
+
+				fragments.packet.buffer = m_recvBuffers.acquire(header.packetSize);
+				it = m_recvFragments.emplace(header.packetID, fragments).first;
 			}
-			callSentCallback(packet, nWritten);
+
+			auto& fragments = it->second;
+
+			// Fragments must continue exactly where the previous one ended, so every byte of the packet gets written exactly once.
+			if (header.packetSize != fragments.packet.header.packetSize || header.fragmentOffset != fragments.nReceived ||
+				header.fragmentOffset + crypto::aes::paddedSize(header.fragmentSize) > fragments.packet.buffer->reserved())
+			{
+				releaseRecv(fragments.packet.header);
+				m_recvFragments.erase(it);
+				m_sock->disconnect(); // The remote endpoint does not follow the protocol.
+				return false;
+			}
+
+			uint64_t nReadFragment = readPayload((char*)fragments.packet.buffer->data() + header.fragmentOffset, header.fragmentSize);
+			fragments.nReceived += nReadFragment;
+
+			pack = fragments.packet;
+			nRead = fragments.nReceived;
+
+			if (nReadFragment == header.fragmentSize && fragments.nReceived < header.packetSize)
+				return false;
+
+			m_recvFragments.erase(it);
+			return true;
 		}
 
-		void ManagedSocket::sendJobNoEncrypt(Packet packet)
+		bool ManagedSocket::recvStream(const PacketHeader& header)
 		{
-			m_currPacketIDBeingSent = packet.header.packetID;
+			StreamData sd;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxRecvCallbacks);
+
+				auto iterator = m_streamCallbacks.find(header.packetType);
+				if (iterator == m_streamCallbacks.end())
+					return false;
+				sd = iterator->second;
+			}
+
+			PacketHeader packHeader = header;
+			packHeader.frameFlags = FRAME_FLAG_NONE;
+			packHeader.fragmentOffset = 0;
+			packHeader.fragmentSize = 0;
+
+			bool isFragment = header.frameFlags & FRAME_FLAG_FRAGMENT;
+			uint64_t frameOffset = isFragment ? header.fragmentOffset : 0;
+			uint64_t frameSize = isFragment ? header.fragmentSize : header.packetSize;
 
-			uint64_t nWritten = 0;
-			if ((nWritten = m_sock->writeSecure(&packet.header, sizeof(PacketHeader), false)) < sizeof(PacketHeader))
+			if (frameOffset > header.packetSize || frameSize > header.packetSize - frameOffset)
 			{
-				callSentCallback(packet, nWritten);
-				return;
+				m_sock->disconnect(); // The remote endpoint does not follow the protocol.
+				return true;
 			}
 
-			if (packet.buffer)
+			uint64_t nConsumed = 0;
+			do
 			{
-				if ((nWritten = m_sock->writeRaw(packet.buffer->data(), packet.buffer->size())) < packet.buffer->size())
+				uint64_t chunkSize = std::min(STREAM_CHUNK_SIZE, frameSize - nConsumed);
+
+				PacketBufferRef chunk;
+				uint64_t nRead = 0;
+				if (chunkSize > 0)
 				{
-					callSentCallback(packet, nWritten);
-					return;
+					chunk = m_streamChunks.acquire(chunkSize);
+					if (m_cryptThreadPool)
+					{
+						nRead = std::min(chunkSize, m_sock->readRaw(chunk->data(), crypto::aes::paddedSize(chunkSize)));
+						crypto::aes::decryptThreaded(chunk->data(), nRead, chunk->data(), m_sock->getAESKey(), true, m_cryptThreadPool->size(), m_cryptThreadPool);
+					}
+					else
+					{
+						nRead = m_sock->readSecure(chunk->data(), chunkSize);
+					}
+					chunk->resize(nRead);
 				}
-			}
-			callSentCallback(packet, nWritten);
+
+				uint64_t chunkOffset = frameOffset + nConsumed;
+				bool failed = nRead < chunkSize;
+				bool isLast = failed || (chunkOffset + nRead == header.packetSize);
+
+				{
+					std::unique_lock<std::mutex> lock(m_mtxStream);
+					m_streamNotify.wait(lock, [this, &sd]() { return m_nStreamChunksQueued < sd.maxChunksQueued || !m_sock->isConnected(); });
+					++m_nStreamChunksQueued;
+				}
+
+				m_callbackPool->pushJob(
+					[this, sd, packHeader, chunk, chunkOffset, isLast]()
+					{
+						sd.cd.callback(packHeader, chunk, chunkOffset, isLast, sd.cd.pParam);
+
+						{
+							std::unique_lock<std::mutex> lock(m_mtxStream);
+							--m_nStreamChunksQueued;
+						}
+						m_streamNotify.notify_one();
+					}
+				);
+
+				if (failed)
+					break;
+				nConsumed += nRead;
+			} while (nConsumed < frameSize);
+
+			return true;
 		}
 
-		void ManagedSocket::makeSendableJob(Packet packet)
+		void ManagedSocket::makePullableJob()
 		{
-			if (packet.buffer)
+			DecryptEntry de;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxDecryptQueue);
+
+				auto lane = std::find_if(std::begin(m_decryptQueue), std::end(m_decryptQueue), [](auto& l) { return !l.empty(); });
+				if (lane == std::end(m_decryptQueue))
+					return;
+
+				de = lane->front();
+				lane->pop_front();
+			}
+
+			EHSN_TRACE_SPAN(span, "decrypt", de.packet.header.packetID);
+			if (de.size > 0)
 			{
-				uint64_t newSize = crypto::aes::encryptThreaded(
-					packet.buffer->data(),
-					packet.buffer->size(),
-					packet.buffer->data(),
+				crypto::aes::decryptThreaded(
+					(char*)de.packet.buffer->data() + de.offset,
+					de.size,
+					(char*)de.packet.buffer->data() + de.offset,
 					m_sock->getAESKey(),
 					true,
 					m_cryptThreadPool->size(),
 					m_cryptThreadPool
 				);
-				packet.buffer->resize(newSize);
 			}
 
-			m_sendPool->pushJob(std::bind(&ManagedSocket::sendJobNoEncrypt, this, packet));
+			if (!de.isComplete)
+				return;
+
+			if (!decompressPacket(de.packet, de.nRead))
+				return;
+
+			if (!callRecvCallback(de.packet, de.nRead))
+				pushRecvQueue(de.packet);
+		}
+
+		void ManagedSocket::compressPacket(Packet& pack)
+		{
+			compression::Codec codec;
+			uint64_t minSize;
+			float maxRatio;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxCompression);
+				codec = m_compressionCodec;
+				minSize = m_compressionMinSize;
+				maxRatio = m_compressionMaxRatio;
+			}
+
+			if (codec == compression::CODEC_NONE || !pack.buffer || pack.buffer->size() < minSize || pack.buffer->size() == 0)
+				return;
+
+			uint64_t rawSize = pack.buffer->size();
+
+			PacketBufferRef compressed;
+			if (compression::sampleRatio(codec, pack.buffer->data(), rawSize) <= maxRatio)
+				compressed = compression::compress(codec, pack.buffer->data(), rawSize, m_cryptThreadPool);
+
+			std::unique_lock<std::mutex> lock(m_mtxCompression);
+			if (!compressed)
+			{
+				++m_compressionMetrics.nPacketsSkipped;
+				return;
+			}
+
+			++m_compressionMetrics.nPacketsCompressed;
+			m_compressionMetrics.nBytesRaw += rawSize;
+			m_compressionMetrics.nBytesCompressed += compressed->size();
+
+			pack.buffer = compressed;
+			pack.header.flags |= FLAG_PH_COMPRESSED;
 		}
 
-		void ManagedSocket::recvJobDecrypt()
+		void ManagedSocket::compressSendEntry(const SendEntryRef& entry)
 		{
 			Packet pack;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+				pack = entry->packet;
+			}
 
-			uint64_t nRead = 0;
+			EHSN_TRACE_SPAN(span, "compress", pack.header.packetID);
+			compressPacket(pack);
 
-			if (!m_sock->isConnected())
-				goto NextIterationRecvDecrypt;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+				entry->needsCompression = false;
 
-			if (m_sock->readSecure(&pack.header, sizeof(PacketHeader)) < sizeof(PacketHeader))
-				goto NextIterationRecvDecrypt;
+				// Not worth compressing, or dropped by clear or replaced by a newer packet in the meantime.
+				if (!(pack.header.flags & FLAG_PH_COMPRESSED) || !m_pendingSends.count(pack.header.packetID))
+					return;
+
+				uint64_t nSaved = entry->packet.header.packetSize - pack.buffer->size();
+				entry->packet.buffer = pack.buffer;
+				entry->packet.header.flags = pack.header.flags;
+				entry->packet.header.packetSize = pack.buffer->size();
+				entry->nFrames = std::max<uint64_t>(1, (entry->packet.header.packetSize + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE);
+				m_nSendBytesQueued -= std::min(m_nSendBytesQueued, nSaved);
+			}
+			m_sendSpace.notify_all();
+		}
+
+		bool ManagedSocket::decompressPacket(Packet& pack, uint64_t& nRead)
+		{
+			if (!(pack.header.flags & FLAG_PH_COMPRESSED) || nRead < pack.header.packetSize)
+				return true; // Incomplete packets are delivered as they are.
+
+			// Reject payloads exceeding the receive limits before decompress allocates anything.
+			uint64_t maxSize = compression::MAX_RAW_SIZE;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+				if (m_maxRecvPacketSize > 0)
+					maxSize = std::min(maxSize, m_maxRecvPacketSize);
+				if (m_maxRecvBytes > 0)
+					maxSize = std::min(maxSize, m_maxRecvBytes);
+			}
+			{
+				std::unique_lock<std::mutex> lock(s_mtxGlobalRecv);
+				if (s_maxGlobalRecvPacketSize > 0)
+					maxSize = std::min(maxSize, s_maxGlobalRecvPacketSize);
+				if (s_maxGlobalRecvBytes > 0)
+					maxSize = std::min(maxSize, s_maxGlobalRecvBytes);
+			}
+
+			PacketBufferRef raw;
+			if (pack.buffer)
+				raw = compression::decompress(pack.buffer->data(), pack.header.packetSize, maxSize, m_cryptThreadPool);
+
+			if (!raw)
+			{
+				releaseRecv(pack.header);
+				m_sock->disconnect(); // Invalid or too big payload.
+				return false;
+			}
 
-			if (pack.header.packetSize > 0)
+			// Account for the decompressed size instead of the received size from now on.
+			if (!resizeRecv(pack.header, raw->size()))
 			{
-				pack.buffer = std::make_shared<PacketBuffer>(pack.header.packetSize); // TODO: Aquire buffer from pool
+				releaseRecv(pack.header);
+				m_sock->disconnect(); // The decompressed payload exceeds the receive limits.
+				return false;
+			}
+
+			pack.buffer = raw;
+			pack.header.packetSize = raw->size();
+			pack.header.flags &= ~FLAG_PH_COMPRESSED;
+			nRead = pack.header.packetSize;
+			return true;
+		}
 
-				if ((nRead = m_sock->readSecure(pack.buffer)) < pack.buffer->size())
+		void ManagedSocket::cryptJob()
+		{
+			const auto firstLane = [](auto& lanes) -> uint32_t
+			{
+				for (uint32_t i = 0; i < PRIO_COUNT; ++i)
 				{
-					callRecvCallback(pack, nRead);
-					goto NextIterationRecvDecrypt;
+					if (!lanes[i].empty())
+						return i;
 				}
+				return PRIO_COUNT;
+			};
+
+			uint32_t encryptLane;
+			uint32_t decryptLane;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+				encryptLane = firstLane(m_cryptQueue);
+			}
+			{
+				std::unique_lock<std::mutex> lock(m_mtxDecryptQueue);
+				decryptLane = firstLane(m_decryptQueue);
 			}
 
-			if (!callRecvCallback(pack, nRead))
+			if (decryptLane <= encryptLane && decryptLane < PRIO_COUNT)
+				makePullableJob();
+			else if (encryptLane < PRIO_COUNT)
+				makeSendableJob();
+		}
+
+		void ManagedSocket::pushRecvJob()
+		{
+			if (m_cryptThreadPool)
+				m_recvPool->pushJob(std::bind(&ManagedSocket::recvJobNoDecrypt, this));
+			else
+				m_recvPool->pushJob(std::bind(&ManagedSocket::recvJobDecrypt, this));
+		}
+
+		void ManagedSocket::pushRecvQueue(Packet pack)
+		{
+			std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+
+			auto& typeQueue = m_recvTypeQueues[pack.header.packetType];
+
+			if (pack.header.flags & FLAG_PH_REMOVE_PREVIOUS)
 			{
+				for (auto& it : typeQueue.packets)
 				{
-					std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+					releaseRecvLocked(it->packet.header);
+					m_recvQueue.erase(it);
+				}
+				typeQueue.packets.clear();
+			}
+
+			RecvEntry re;
+			re.packet = pack;
+			re.tReceived = CURR_TIME_NS();
+			typeQueue.packets.push_back(m_recvQueue.insert(m_recvQueue.end(), re));
+
+			auto& waiters = typeQueue.waiters.empty() ? m_recvAnyWaiters : typeQueue.waiters;
+			if (waiters.empty())
+				return;
+
+			RecvWaiter* waiter = waiters.front();
+			waiters.pop_front();
+			waiter->signaled = true;
+			waiter->cond.notify_one();
+		}
+
+		bool ManagedSocket::popRecvQueue(PacketType packType, Packet& pack)
+		{
+			if (packType == SPT_UNDEFINED)
+			{
+				if (m_recvQueue.empty())
+					return false;
+
+				// The oldest packet is always the oldest of its type as well.
+				auto& re = m_recvQueue.front();
+				pack = re.packet;
+				addDeliverTime(re);
+				m_recvTypeQueues[pack.header.packetType].packets.pop_front();
+				m_recvQueue.pop_front();
+				releaseRecvLocked(pack.header);
+				return true;
+			}
+
+			auto typeQueue = m_recvTypeQueues.find(packType);
+			if (!typeQueue || typeQueue->packets.empty())
+				return false;
+
+			auto it = typeQueue->packets.front();
+			pack = it->packet;
+			addDeliverTime(*it);
+			typeQueue->packets.pop_front();
+			m_recvQueue.erase(it);
+			releaseRecvLocked(pack.header);
+			return true;
+		}
 
-					auto typeIterator = m_recvQueue.find(pack.header.packetType);
-					if (typeIterator == m_recvQueue.end())
-						typeIterator = m_recvQueue.emplace(pack.header.packetType, std::queue<Packet>()).first;
+		bool ManagedSocket::reserveRecv(const PacketHeader& header)
+		{
+			uint64_t size = header.packetSize;
+
+			{
+				std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
 
-					if (pack.header.flags & FLAG_PH_REMOVE_PREVIOUS)
+				if (m_maxRecvPacketSize > 0 && size > m_maxRecvPacketSize)
+				{
+					lock.unlock();
+					m_sock->disconnect(); // The packet is too big and would be allocated as a whole.
+					return false;
+				}
+
+				auto& typeQueue = m_recvTypeQueues[header.packetType];
+				m_recvSpace.wait(
+					lock,
+					[this, size, &typeQueue]()
 					{
-						while (!typeIterator->second.empty())
-							typeIterator->second.pop();
+						if (!m_sock->isConnected())
+							return true;
+						if (m_maxRecvBytes > 0 && m_nRecvBytesReserved > 0 && m_nRecvBytesReserved + size > m_maxRecvBytes)
+							return false;
+						return m_maxRecvPacketsPerType == 0 || typeQueue.nReserved < m_maxRecvPacketsPerType;
 					}
-					typeIterator->second.push(pack);
+				);
+				if (!m_sock->isConnected())
+					return false;
 
-					m_recvAvail = true;
+				m_nRecvBytesReserved += size;
+				++typeQueue.nReserved;
+			}
+
+			bool accepted = false;
+			{
+				std::unique_lock<std::mutex> lock(s_mtxGlobalRecv);
+
+				if (s_maxGlobalRecvPacketSize == 0 || size <= s_maxGlobalRecvPacketSize)
+				{
+					s_globalRecvSpace.wait(
+						lock,
+						[this, size]()
+						{
+							return !m_sock->isConnected() || s_maxGlobalRecvBytes == 0 || s_nGlobalRecvBytesReserved == 0 || s_nGlobalRecvBytesReserved + size <= s_maxGlobalRecvBytes;
+						}
+					);
+					accepted = m_sock->isConnected();
 				}
+
+				if (accepted)
+					s_nGlobalRecvBytesReserved += size;
 			}
 
-		NextIterationRecvDecrypt:
-			if (m_sock->isConnected())
-				pushRecvJob();
-			m_recvNotify.notify_all();
+			if (!accepted)
+			{
+				m_sock->disconnect();
+
+				// Undo the reservation on this connection only.
+				std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+				m_nRecvBytesReserved -= size;
+				--m_recvTypeQueues[header.packetType].nReserved;
+			}
+
+			return accepted;
 		}
 
-		void ManagedSocket::recvJobNoDecrypt()
+		bool ManagedSocket::resizeRecv(const PacketHeader& header, uint64_t newSize)
 		{
-			Packet pack;
+			if (newSize <= header.packetSize)
+			{
+				uint64_t nFreed = header.packetSize - newSize;
+				{
+					std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+					m_nRecvBytesReserved -= nFreed;
+				}
+				m_recvSpace.notify_all();
+				{
+					std::unique_lock<std::mutex> lock(s_mtxGlobalRecv);
+					s_nGlobalRecvBytesReserved -= nFreed;
+				}
+				s_globalRecvSpace.notify_all();
+				return true;
+			}
 
-			uint64_t nRead = 0;
-			if (!m_sock->isConnected())
-				goto NextIterationRecvNoDecrypt;
+			// Never wait for space here: the packets reserved by the recv thread in the meantime can only be released after this one.
+			// A packet that fits the limits on its own is counted right away, reserveRecv then holds back further packets until it has been consumed.
+			uint64_t nExtra = newSize - header.packetSize;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
 
-			if (m_sock->readSecure(&pack.header, sizeof(pack.header)) < sizeof(pack.header))
-				goto NextIterationRecvNoDecrypt;
+				if ((m_maxRecvPacketSize > 0 && newSize > m_maxRecvPacketSize) || (m_maxRecvBytes > 0 && newSize > m_maxRecvBytes))
+					return false;
 
-			if (pack.header.packetSize > 0)
+				m_nRecvBytesReserved += nExtra;
+			}
+
+			bool accepted = false;
 			{
-				pack.buffer = std::make_shared<PacketBuffer>(pack.header.packetSize); // TODO: Aquire buffer from pool
+				std::unique_lock<std::mutex> lock(s_mtxGlobalRecv);
 
-				uint64_t paddedSize = crypto::aes::paddedSize(pack.buffer->size());
-				nRead = m_sock->readRaw(pack.buffer->data(), paddedSize);
+				accepted = (s_maxGlobalRecvPacketSize == 0 || newSize <= s_maxGlobalRecvPacketSize) && (s_maxGlobalRecvBytes == 0 || newSize <= s_maxGlobalRecvBytes);
+				if (accepted)
+					s_nGlobalRecvBytesReserved += nExtra;
 			}
 
-			m_cryptPool->pushJob(std::bind(&ManagedSocket::makePullableJob, this, pack, nRead));
+			if (!accepted)
+			{
+				std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+				m_nRecvBytesReserved -= nExtra;
+			}
 
-		NextIterationRecvNoDecrypt:
-			if (m_sock->isConnected())
-				pushRecvJob();
-			m_recvNotify.notify_all();
+			return accepted;
 		}
 
-		void ManagedSocket::makePullableJob(Packet packet, uint64_t nRead)
+		void ManagedSocket::releaseRecv(const PacketHeader& header)
 		{
-			if (packet.buffer)
+			std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+			releaseRecvLocked(header);
+		}
+
+		void ManagedSocket::releaseRecvLocked(const PacketHeader& header)
+		{
+			--m_recvTypeQueues[header.packetType].nReserved;
+			m_nRecvBytesReserved -= header.packetSize;
+			m_recvSpace.notify_all();
+
 			{
-				crypto::aes::decryptThreaded(
-					packet.buffer->data(),
-					packet.buffer->size(),
-					packet.buffer->data(),
-					m_sock->getAESKey(),
-					true,
-					m_cryptThreadPool->size(),
-					m_cryptThreadPool
-				);
+				std::unique_lock<std::mutex> lock(s_mtxGlobalRecv);
+				s_nGlobalRecvBytesReserved -= header.packetSize;
 			}
+			s_globalRecvSpace.notify_all();
+		}
 
-			if (!callRecvCallback(packet, nRead))
+		void ManagedSocket::wakeWaiters()
+		{
 			{
-				{
-					std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
+				std::unique_lock<std::mutex> lock(m_mtxSendQueue);
+			}
+			m_sendSpace.notify_all();
 
-					auto typeIterator = m_recvQueue.find(packet.header.packetType);
-					if (typeIterator == m_recvQueue.end())
-						typeIterator = m_recvQueue.emplace(packet.header.packetType, std::queue<Packet>()).first;
+			{
+				std::unique_lock<std::mutex> lock(m_mtxRecvQueue);
 
-					if (packet.header.flags & FLAG_PH_REMOVE_PREVIOUS)
+				for (auto waiter : m_recvAnyWaiters)
+					waiter->cond.notify_one();
+				m_recvTypeQueues.forEach(
+					[](PacketType, RecvTypeQueue& typeQueue)
 					{
-						while (!typeIterator->second.empty())
-							typeIterator->second.pop();
+						for (auto waiter : typeQueue.waiters)
+							waiter->cond.notify_one();
 					}
-					typeIterator->second.push(packet);
+				);
+				m_recvSpace.notify_all();
+			}
+			{
+				std::unique_lock<std::mutex> lock(m_mtxStream);
+			}
+			m_streamNotify.notify_all();
+			{
+				std::unique_lock<std::mutex> lock(s_mtxGlobalRecv);
+			}
+			s_globalRecvSpace.notify_all();
+		}
 
-					m_recvAvail = true;
-				}
+		void ManagedSocket::addRTTSample(const packets::RTTProbeReply& reply, uint64_t tRecv)
+		{
+			if (reply.tSent > tRecv)
+				return;
+
+			float rtt = (float)(tRecv - reply.tSent) / 1000.0f;
+			int64_t offset = (int64_t)reply.tRemote - (int64_t)(reply.tSent + (tRecv - reply.tSent) / 2);
+
+			std::unique_lock<std::mutex> lock(m_mtxLinkStats);
+			auto& ls = m_linkStats;
+
+			// RFC 6298
+			if (ls.nSamples == 0)
+			{
+				ls.srtt = rtt;
+				ls.rttVar = rtt / 2.0f;
+			}
+			else
+			{
+				ls.rttVar = 0.75f * ls.rttVar + 0.25f * std::abs(ls.srtt - rtt);
+				ls.srtt = 0.875f * ls.srtt + 0.125f * rtt;
+			}
+			ls.rto = ls.srtt + 4.0f * ls.rttVar;
+
+			// The sample with the lowest RTT has the least queuing delay and therefore the most symmetric path.
+			if (ls.nSamples == 0 || rtt <= ls.minRTT)
+			{
+				ls.minRTT = rtt;
+				ls.clockOffset = offset;
 			}
 
-			m_recvNotify.notify_all();
+			ls.lastRTT = rtt;
+			ls.remoteReadSpeed = reply.remoteReadSpeed;
+			ls.remoteWriteSpeed = reply.remoteWriteSpeed;
+			++ls.nSamples;
+
+			m_remoteWriteSpeed = reply.remoteWriteSpeed;
 		}
 
-		void ManagedSocket::pushRecvJob()
+		void ManagedSocket::updateThroughput()
 		{
-			if (m_cryptThreadPool)
-				m_recvPool->pushJob(std::bind(&ManagedSocket::recvJobNoDecrypt, this));
-			else
-				m_recvPool->pushJob(std::bind(&ManagedSocket::recvJobDecrypt, this));
+			uint64_t now = CURR_TIME_NS();
+			auto& metrics = m_sock->getDataMetrics();
+			metrics.sample();
+			uint64_t nRead = metrics.nRead();
+			uint64_t nWritten = metrics.nWritten();
+
+			std::unique_lock<std::mutex> lock(m_mtxLinkStats);
+			auto& ls = m_linkStats;
+
+			// Skip the first call and calls after the metrics have been reset.
+			if (m_lastThroughputTime != 0 && now > m_lastThroughputTime && nRead >= m_lastNRead && nWritten >= m_lastNWritten)
+			{
+				float seconds = (float)(now - m_lastThroughputTime) / 1e9f;
+				float readSpeed = (float)(nRead - m_lastNRead) / seconds;
+				float writeSpeed = (float)(nWritten - m_lastNWritten) / seconds;
+
+				constexpr float alpha = 0.25f;
+				ls.readSpeed = alpha * readSpeed + (1.0f - alpha) * ls.readSpeed;
+				ls.writeSpeed = alpha * writeSpeed + (1.0f - alpha) * ls.writeSpeed;
+			}
+
+			m_lastThroughputTime = now;
+			m_lastNRead = nRead;
+			m_lastNWritten = nWritten;
+
+			m_sock->setAvgReadSpeed(ls.readSpeed);
 		}
 
-		void ManagedSocket::setCurrentPacketBeingSent(PacketID pID)
+		void ManagedSocket::probeThreadFunc()
 		{
+			std::unique_lock<std::mutex> lock(m_mtxProbe);
+			while (m_probing)
 			{
-				std::unique_lock<std::mutex> lock(m_mtxPacketIDBeingSent);
-				m_currPacketIDBeingSent = pID;
+				if (isConnected())
+					probe();
+
+				lock.unlock();
+				updateThroughput();
+				lock.lock();
+				m_probeNotify.wait_for(lock, std::chrono::milliseconds(m_probeInterval), [this]() { return !m_probing; });
 			}
-			m_sentNotify.notify_all();
 		}
+
+		void ManagedSocket::addDeliverTime(const RecvEntry& re)
+		{
+			auto& stats = m_typeStats[re.packet.header.packetType];
+			stats.nDelivered.fetch_add(1, std::memory_order_relaxed);
+			stats.deliverTime.fetch_add(CURR_TIME_NS() - re.tReceived, std::memory_order_relaxed);
+		}
+
 	} // namespace net
 } // namespace EHSN
\ No newline at end of file
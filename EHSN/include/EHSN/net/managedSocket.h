@@ -1,42 +1,42 @@
 #pragma once
 
-#include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <queue>
+#include <deque>
+#include <list>
 #include <cstdint>
 
 #include "secSocket.h"
 #include "packetBuffer.h"
+#include "packetTypes.h"
+#include "packetTypeTable.h"
+#include "compression.h"
 #include "EHSN/ThreadPool.h"
+#include "EHSN/MoveOnlyFunction.h"
 
 namespace EHSN {
 	namespace net {
 
-		typedef uint16_t PacketType;
-		typedef uint8_t PacketFlags;
-		typedef uint32_t PacketID;
-
-		enum : PacketFlags
-		{
-			FLAG_PH_NONE = 0b00000000,
-			FLAG_PH_REMOVE_PREVIOUS = 0b00000001, // (Packets are only removed on receiver side)
-			FLAG_PH_UNUSED_1 = 0b00000010, // FLAG_PH_SEND_IMMEDIATE
-			FLAG_PH_UNUSED_2 = 0b00000100,
-			FLAG_PH_UNUSED_3 = 0b00001000,
-			FLAG_PH_UNUSED_4 = 0b00010000,
-			FLAG_PH_UNUSED_5 = 0b00100000,
-			FLAG_PH_UNUSED_6 = 0b01000000,
-			FLAG_PH_UNUSED_7 = 0b10000000,
-		};
+		constexpr uint64_t FRAGMENT_SIZE = 64_KB; // Packets bigger than FRAGMENT_SIZE are split into frames of this size. Must be a multiple of AES_BLOCK_SIZE!
+		constexpr uint64_t STREAM_CHUNK_SIZE = 64_KB; // Maximum size of the chunks passed to a PacketChunkCallback. Must be a multiple of AES_BLOCK_SIZE!
+		constexpr uint64_t STREAM_CHUNKS_POOLED = 16; // Number of free chunk buffers kept per connection for reuse.
+		constexpr uint32_t MAX_DISPATCH_KEY_THREADS = 16; // Maximum number of single threaded pools shared by all DISPATCH_PER_KEY handlers.
+		constexpr uint64_t BROADCAST_POOLED_BYTES = 64_MB; // Maximum number of bytes kept in the free broadcast buffers.
+		constexpr uint64_t RECV_BUFFERS_POOLED = 64; // Number of free receive buffers kept per connection for reuse.
+		constexpr uint64_t RECV_POOLED_BYTES = 16_MB; // Maximum number of bytes kept in the free receive buffers of a connection.
 
 		struct PacketHeader // sizeof(PacketHeader) must be a multiple of AES_BLOCK_SIZE!
 		{
 			PacketType packetType = 0; /* Must be set prior to push. */
 			PacketFlags flags = FLAG_PH_NONE; /* Must be set prior to push. */
-			uint8_t reserved = 0;
+			uint8_t frameFlags = FRAME_FLAG_NONE; /* Set internally. */
 			PacketID packetID = 0;
 			uint64_t packetSize = 0;
-			char padding[12];
+			uint64_t fragmentOffset = 0; /* Set internally. */
+			uint32_t fragmentSize = 0; /* Set internally. */
+			PacketPriority priority = PRIO_NORMAL; /* Set internally. */
+			uint8_t reserved[3] = {};
 		};
 
 		bool operator<(const PacketHeader& left, const PacketHeader& right);
@@ -55,9 +55,137 @@ namespace EHSN {
 			SPT_CHANGE_AES_KEY, // Currently unused
 			SPT_KEEP_ALIVE_REQUEST, // Can be sent to tell the remote side that the connection should be kept alive. This Type has a built-in recvCallback!
 			SPT_KEEP_ALIVE_REPLY, // Sent after a SPT_KEEP_ALIVE_REQUEST has been received (default behavior)
+			SPT_RTT_PROBE, // Sent by the RTT estimator (see startProbing). This Type has a built-in recvCallback!
+			SPT_RTT_PROBE_REPLY, // Sent after a SPT_RTT_PROBE has been received. This Type has a built-in recvCallback!
 			SPT_FIRST_FREE_PACKET_TYPE // Can be used to determine the associated value of the first user-defined packet type. All previous/smaller values are reserved.
 		};
 
+		struct PacketTypeStats
+		{
+			uint64_t nPacketsSent = 0; // Packets sent completely.
+			uint64_t nBytesSent = 0; // Payload bytes written to the socket.
+			uint64_t nPacketsReceived = 0; // Packets received completely.
+			uint64_t nBytesReceived = 0; // Payload bytes read from the socket.
+			uint64_t sendQueueTime = 0; // Total time (ns) the packets waited in the send queue before their first frame was written.
+			uint64_t encryptTime = 0; // Total time (ns) spent encrypting the packets.
+			uint64_t nDelivered = 0; // Received packets handed to a recv handler or pulled.
+			uint64_t deliverTime = 0; // Total time (ns) between receiving the packets completely and handing them to a recv handler or pull.
+		public:
+			float avgSendQueueTime() const { return nPacketsSent ? (float)sendQueueTime / nPacketsSent : 0.0f; }
+			float avgDeliverTime() const { return nDelivered ? (float)deliverTime / nDelivered : 0.0f; }
+		};
+
+		struct LinkStats
+		{
+			uint64_t nSamples = 0; // Number of RTT samples taken.
+			float lastRTT = 0.0f; // Most recent RTT sample (us).
+			float minRTT = 0.0f; // Lowest RTT sample (us).
+			float srtt = 0.0f; // Smoothed RTT (us), see RFC 6298.
+			float rttVar = 0.0f; // RTT variation (us), see RFC 6298.
+			float rto = 0.0f; // Retransmission timeout style upper bound for a reply (us): srtt + 4 * rttVar.
+			int64_t clockOffset = 0; // Remote clock minus local clock (ns), estimated from the sample with the lowest RTT.
+			float readSpeed = 0.0f; // Bytes per second read from the connection (EWMA).
+			float writeSpeed = 0.0f; // Bytes per second written to the connection (EWMA).
+			float remoteReadSpeed = 0.0f; // Bytes per second the remote side reads, as reported by the last probe reply.
+			float remoteWriteSpeed = 0.0f; // Bytes per second the remote side writes, as reported by the last probe reply.
+		};
+
+		enum DispatchPolicy : uint8_t
+		{
+			DISPATCH_SERIALIZED = 0, // Handlers run one at a time on the callback thread, in the order the packets arrived. Shared by all serialized types. (default)
+			DISPATCH_PARALLEL, // Handlers run on the dispatch threads shared by all sockets. Packets of the type may be handled concurrently and out of order.
+			DISPATCH_PER_KEY, // Handlers run on the shared dispatch thread selected by the key of the packet. Packets with the same key are handled in order.
+			DISPATCH_INLINE, // Handlers run on the thread that received/decrypted the packet, without any thread handoff. See setDispatchPolicy for restrictions.
+		};
+
+		enum SendStatus : uint8_t
+		{
+			SEND_PENDING = 0, // The packet has not been sent completely yet.
+			SEND_COMPLETE, // The packet has been written to the socket completely.
+			SEND_FAILED, // The connection failed while the packet was being sent.
+			SEND_DROPPED, // The packet has been removed from the send queue (FLAG_PH_REMOVE_PREVIOUS, clear).
+		};
+
+		/*
+		* Completion handle of a pushed packet.
+		*
+		* Handles are cheap to copy; all copies refer to the same packet.
+		* Waiting on a handle only gets woken by the completion of that packet.
+		*/
+		class SendHandle
+		{
+			struct State;
+		public:
+			SendHandle() = default;
+		public:
+			/*
+			* Check if the handle refers to a packet.
+			*
+			* @returns True if the handle refers to a packet. Otherwise false (e.g. tryPushTracked failed).
+			*/
+			explicit operator bool() const { return m_state != nullptr; }
+			/*
+			* Get the ID of the packet.
+			*
+			* @returns The packet ID. 0 if the handle is empty.
+			*/
+			PacketID packetID() const;
+			/*
+			* Get the status of the packet.
+			*
+			* @returns The status of the packet. SEND_DROPPED if the handle is empty.
+			*/
+			SendStatus status() const;
+			/*
+			* Get the number of payload bytes written to the socket.
+			*
+			* @returns The number of bytes sent. Only final once the packet is done.
+			*/
+			uint64_t nBytesSent() const;
+			/*
+			* Check if the packet is done (sent, failed or dropped).
+			*
+			* @returns True if the packet is done. Otherwise false.
+			*/
+			bool isDone() const;
+			/*
+			* Wait until the packet is done.
+			*/
+			void wait() const;
+			/*
+			* Wait until the packet is done or the timeout expired.
+			*
+			* @param timeoutMS Maximum time to wait in milliseconds.
+			* @returns True if the packet is done. Otherwise false.
+			*/
+			bool waitFor(uint64_t timeoutMS) const;
+		public:
+			/*
+			* Wait until all packets are done or the timeout expired.
+			*
+			* @param handles The handles to wait for.
+			* @param timeoutMS Maximum time to wait in milliseconds.
+			* @returns True if all packets are done. Otherwise false.
+			*/
+			static bool waitAll(const std::vector<SendHandle>& handles, uint64_t timeoutMS = UINT64_MAX);
+			/*
+			* Wait until any of the packets is done or the timeout expired.
+			*
+			* @param handles The handles to wait for.
+			* @param timeoutMS Maximum time to wait in milliseconds.
+			* @returns Index of the first done packet in handles. -1 if none is done.
+			*/
+			static int64_t waitAny(const std::vector<SendHandle>& handles, uint64_t timeoutMS = UINT64_MAX);
+		private:
+			SendHandle(Ref<State> state) : m_state(state) {}
+			static Ref<State> makeState(PacketID pID);
+			static void complete(const Ref<State>& state, SendStatus status, uint64_t nBytesSent);
+		private:
+			Ref<State> m_state;
+		private:
+			friend class ManagedSocket;
+		};
+
 		class ManagedSocket
 		{
 		public:
@@ -65,7 +193,7 @@ namespace EHSN {
 			* This function gets called when a packet was sent.
 			*
 			* @param pID The ID of the packet that was sent.
-			* @param nBytesSent The number of bytes that have been sent. Same value as pack.header.packetSize on success.
+			* @param nBytesSent The number of bytes that have been sent. Same value as pack.header.packetSize on success. 0 if the packet has been dropped by a newer packet with FLAG_PH_REMOVE_PREVIOUS.
 			* @param pParam Pointer to user defined data.
 			*/
 			typedef void (*PacketSentCallback)(PacketID pID, uint64_t nBytesSent, void* pParam);
@@ -77,20 +205,57 @@ namespace EHSN {
 			* @param pParam Pointer to user defined data.
 			*/
 			typedef void (*PacketRecvCallback)(Packet pack, uint64_t nBytesReceived, void* pParam);
+			/*
+			* This function gets called for every chunk of a packet received in streaming mode.
+			*
+			* The chunks of a packet are passed in order.
+			*
+			* @param header Header of the packet the chunk belongs to.
+			* @param chunk Buffer holding the decrypted chunk. Null if the packet is empty.
+			* @param offset Offset of the chunk in the packet.
+			* @param isLast True for the last chunk of the packet. Also true if the connection was lost while receiving the chunk (offset + chunk->size() < header.packetSize).
+			* @param pParam Pointer to user defined data.
+			*/
+			typedef void (*PacketChunkCallback)(const PacketHeader& header, PacketBufferRef chunk, uint64_t offset, bool isLast, void* pParam);
+			/*
+			* This function gets called when the send queue drained below the low-water mark.
+			*
+			* @param nBytesQueued The number of bytes still queued for sending.
+			* @param pParam Pointer to user defined data.
+			*/
+			typedef void (*SendDrainCallback)(uint64_t nBytesQueued, void* pParam);
+			/*
+			* Same as PacketSentCallback, but may capture state instead of taking pParam.
+			*/
+			typedef MoveOnlyFunction<void(PacketID pID, uint64_t nBytesSent)> PacketSentHandler;
+			/*
+			* Same as PacketRecvCallback, but may capture state instead of taking pParam.
+			*/
+			typedef MoveOnlyFunction<void(Packet pack, uint64_t nBytesReceived)> PacketRecvHandler;
+			/*
+			* Get the key of a packet for DISPATCH_PER_KEY.
+			*
+			* Called on the receiving thread, so it should only read a few bytes from the packet.
+			*
+			* @param pack The received packet.
+			* @returns The key of the packet.
+			*/
+			typedef MoveOnlyFunction<uint64_t(const Packet& pack)> PacketKeyFunc;
 
 			template<typename T>
 			struct CallbackData
 			{
 				T callback;
-				void* pParam; // Data shared between multiple callbacks (send AND recv) must not be thread safe, as long as it won't be accessed outside of the callbacks. Only one callback is called at a time for the same connection.
+				void* pParam; // Data shared between multiple callbacks (send AND recv) must not be thread safe, as long as it won't be accessed outside of the callbacks and all packet types involved use DISPATCH_SERIALIZED. Only one serialized callback is called at a time for the same connection.
 			};
 			/*
 			* Constructor of ManagedSocket.
 			*
 			* @param sock Socket used for read/write operations.
 			* @param nThreads If set to true, packets will be en-/decrypted in a separate thread. For values greater than 0 the passed socket should be created with 0 threads.
+			* @param nDispatchThreads Number of threads running handlers of types with DISPATCH_PARALLEL/DISPATCH_PER_KEY. If 0, the number of cores is used. The dispatch threads are shared by all sockets and created on first use, so only the first socket using them determines their number (DISPATCH_PER_KEY uses at most MAX_DISPATCH_KEY_THREADS).
 			*/
-			ManagedSocket(SecSocketRef sock, uint32_t nThreads = 0);
+			ManagedSocket(SecSocketRef sock, uint32_t nThreads = 0, uint32_t nDispatchThreads = 0);
 			/*
 			* Destructor of PacketQueue.
 			* 
@@ -129,28 +294,95 @@ namespace EHSN {
 			/*
 			* Push a packet onto the write-queue.
 			*
-			* The supplied packet buffer should not be used after calling this function.
+			* The supplied packet buffer should not be used after calling this function, its contents are consumed (encrypted in place),
+			* also for packets with FLAG_PH_SEND_IMMEDIATE.
+			* Packets bigger than FRAGMENT_SIZE are sent in fragments, so packets with a higher priority
+			* can be sent in between without waiting for the whole packet.
+			* Blocks while the send queue is full (see setSendLimits) and the socket is connected.
 			*
 			* @param packetType Type of the packet to be sent.
 			* @param flags Flags determining how to handle this and other packets.
 			* @param buffer Packet buffer holding the data to be sent.
+			* @param priority Priority of the packet. Pending fragments of higher priorities are always sent first.
 			* @returns The packed ID identifying the pushed packet.
 			*/
-			PacketID push(PacketType packetType, PacketFlags flags, PacketBufferRef buffer);
+			PacketID push(PacketType packetType, PacketFlags flags, PacketBufferRef buffer, PacketPriority priority = PRIO_NORMAL);
 			/*
 			* Push a packet onto the write-queue.
 			* 
-			* The supplied packet buffer should not be used after calling this function.
+			* The supplied packet buffer should not be used after calling this function, its contents are consumed (encrypted in place).
 			* 
 			* @param pack The packet to send. See PacketHeader for information about what members should get initialized before a push.
+			* @param priority Priority of the packet. Pending fragments of higher priorities are always sent first.
 			* @returns Unique packet ID. (Can be used to wait until the packet has been sent.)
 			*/
-			PacketID push(Packet pack);
+			PacketID push(Packet pack, PacketPriority priority = PRIO_NORMAL);
+			/*
+			* Push a packet onto the write-queue if the send queue is not full.
+			*
+			* Same as push, but never blocks.
+			*
+			* @param packetType Type of the packet to be sent.
+			* @param flags Flags determining how to handle this and other packets.
+			* @param buffer Packet buffer holding the data to be sent. Consumed like with push (also for FLAG_PH_SEND_IMMEDIATE), left untouched if the packet was not pushed.
+			* @param priority Priority of the packet.
+			* @returns The packet ID identifying the pushed packet. 0 if the send queue is full.
+			*/
+			PacketID tryPush(PacketType packetType, PacketFlags flags, PacketBufferRef buffer, PacketPriority priority = PRIO_NORMAL);
+			/*
+			* Push a packet onto the write-queue if the send queue is not full.
+			*
+			* Same as push, but never blocks.
+			*
+			* @param pack The packet to send. Its buffer is consumed like with push, left untouched if the packet was not pushed.
+			* @param priority Priority of the packet.
+			* @returns The packet ID identifying the pushed packet. 0 if the send queue is full.
+			*/
+			PacketID tryPush(Packet pack, PacketPriority priority = PRIO_NORMAL);
+			/*
+			* Push a packet onto the write-queue and get a completion handle for it.
+			*
+			* Same as push.
+			*
+			* @param pack The packet to send.
+			* @param priority Priority of the packet.
+			* @returns Handle reporting when and how the packet is done.
+			*/
+			SendHandle pushTracked(Packet pack, PacketPriority priority = PRIO_NORMAL);
+			/*
+			* Push a packet onto the write-queue if the send queue is not full and get a completion handle for it.
+			*
+			* Same as tryPush.
+			*
+			* @param pack The packet to send.
+			* @param priority Priority of the packet.
+			* @returns Handle reporting when and how the packet is done. Empty if the send queue is full.
+			*/
+			SendHandle tryPushTracked(Packet pack, PacketPriority priority = PRIO_NORMAL);
+			/*
+			* Push the same packet to many sockets.
+			*
+			* The payload gets encrypted once per socket (with the socket's key) into pooled buffers, in parallel on the broadcast threads.
+			* The source buffer is never copied or changed and can be reused or broadcast again right away.
+			* Broadcast packets are not compressed.
+			* Never waits for space in a send queue. Sockets whose send queue is full are skipped (see tryPush) and get an empty handle.
+			* Blocks until the packet has been encrypted and pushed (or skipped) for every socket.
+			* If pushing to a socket throws (e.g. bad_alloc), the other sockets are still served and the first exception is rethrown afterwards.
+			*
+			* @param sockets The sockets to push the packet to.
+			* @param packetType Type of the packet to be sent.
+			* @param flags Flags determining how to handle this and other packets.
+			* @param buffer Packet buffer holding the data to be sent.
+			* @param priority Priority of the packet.
+			* @returns One handle per socket (in the same order) reporting when and how the packet is done. Empty for skipped sockets.
+			*/
+			static std::vector<SendHandle> broadcast(const std::vector<ManagedSocket*>& sockets, PacketType packetType, PacketFlags flags, PacketBufferRef buffer, PacketPriority priority = PRIO_NORMAL);
 			/*
 			* Pull a packet from the read-queue.
 			*
 			* This function blocks until a matching buffer is available or the connection is lost.
-			* When packType == SPT_UNDEFINED, the first available packet of any type is returned.
+			* When packType == SPT_UNDEFINED, the oldest available packet of any type is returned.
+			* Every received packet wakes at most one waiting pull (waiters for the packet's type take precedence over waiters for any type).
 			*
 			* @param packType Type of the packet to be pulled.
 			* @returns The first packet with the specified type.
@@ -171,13 +403,18 @@ namespace EHSN {
 			*/
 			std::vector<PacketType> typesPullable();
 			/*
-			* Wait until a specific packet has been sent.
+			* Wait until a specific packet is done (sent, failed or dropped).
+			*
+			* Returns immediately for unknown packet IDs and packets that are already done.
+			* Use pushTracked for timeouts and waiting on multiple packets.
 			*
 			* @param packetID The ID of the packet returned by a call to push.
 			*/
 			void wait(PacketID packetID);
 			/*
 			* Clear all incoming/outgoing packets.
+			*
+			* Outgoing packets that have already started sending (e.g. the first fragments of a big packet) are sent completely.
 			*/
 			void clear();
 			/*
@@ -196,6 +433,242 @@ namespace EHSN {
 			* @param pParam Pointer to user defined data. This pointer is passed to cb.
 			*/
 			void setRecvCallback(PacketType pType, PacketRecvCallback cb, void* pParam);
+			/*
+			* Set the handler for packets of a specific type that have been sent.
+			*
+			* Replaces any callback/handler set before.
+			*
+			* @param pType The type of the packet to set the handler for.
+			* @param handler The handler. Use null to remove any existing handler for the passed packet type.
+			*/
+			void setSentHandler(PacketType pType, PacketSentHandler handler);
+			/*
+			* Set the handler for received packets of a specific type.
+			*
+			* Replaces any callback/handler set before. The handler is run according to the dispatch policy of the packet type.
+			*
+			* @param pType The type of the packet to set the handler for.
+			* @param handler The handler. Use null to remove any existing handler for the passed packet type.
+			*/
+			void setRecvHandler(PacketType pType, PacketRecvHandler handler);
+			/*
+			* Set how the recv callback/handler of a packet type is run.
+			*
+			* Handlers of types with DISPATCH_INLINE block receiving (and in threaded mode en-/decryption) of all packets while they run. They must:
+			*   - return quickly and never wait for other packets (e.g. by calling pull or wait),
+			*   - only push packets that can't block (tryPush, PRIO_CONTROL or FLAG_PH_SEND_IMMEDIATE) when send limits are set,
+			*   - not call clear, disconnect or any set*Callback/set*Handler function.
+			*
+			* @param pType The packet type.
+			* @param policy The dispatch policy.
+			* @param keyFunc Function returning the key of a packet (only used with DISPATCH_PER_KEY). If null, the packet type is used as key.
+			*/
+			void setDispatchPolicy(PacketType pType, DispatchPolicy policy, PacketKeyFunc keyFunc = nullptr);
+			/*
+			* Send a timestamped probe to measure the RTT.
+			*
+			* The reply is handled internally and updates the link stats.
+			*/
+			void probe();
+			/*
+			* Start a thread probing the link periodically.
+			*
+			* Each interval a probe is sent (if connected) and the throughput estimates are updated.
+			*
+			* @param intervalMS Time between two probes in milliseconds.
+			*/
+			void startProbing(uint32_t intervalMS = 1000);
+			/*
+			* Stop the thread started by startProbing.
+			*/
+			void stopProbing();
+			/*
+			* Get the current estimates about the link.
+			*
+			* RTT values are only available after a probe reply was received.
+			* Throughput values are only updated while probing.
+			*
+			* @returns The link stats.
+			*/
+			LinkStats getLinkStats();
+			/*
+			* Receive packets of a specific type in streaming mode.
+			*
+			* Instead of allocating the whole packet, the payload gets read and decrypted in chunks of up to STREAM_CHUNK_SIZE bytes,
+			* which are passed to cb as soon as they arrive. Memory usage is bounded by maxChunksQueued * STREAM_CHUNK_SIZE bytes.
+			* When maxChunksQueued chunks are waiting for cb, receiving stops until cb catches up.
+			* Packets of a streamed type are neither passed to the recv callback nor pushed onto the receive queue.
+			* Compressed packets are passed as received (FLAG_PH_COMPRESSED is set), so the sender should not compress streamed packet types.
+			*
+			* @param pType The type of the packets to stream.
+			* @param cb The callback being called for every chunk. Use null to disable streaming for the passed packet type.
+			* @param pParam Pointer to user defined data. This pointer is passed to cb.
+			* @param maxChunksQueued Maximum number of chunks waiting for cb.
+			*/
+			void setStreamCallback(PacketType pType, PacketChunkCallback cb, void* pParam, uint32_t maxChunksQueued = 16);
+			/*
+			* Limit the size of the send queue.
+			*
+			* A packet counts as queued from push until its last byte has been written to the socket.
+			* A single packet bigger than maxBytes is still accepted when nothing else is queued.
+			* Packets with PRIO_CONTROL are always accepted (but still counted).
+			*
+			* @param maxBytes Maximum number of payload bytes queued for sending. 0 means unlimited.
+			* @param maxPackets Maximum number of packets queued for sending. 0 means unlimited.
+			* @param lowWaterBytes The drain callback gets called when the number of queued bytes drops from above to at most this value.
+			*/
+			void setSendLimits(uint64_t maxBytes, uint64_t maxPackets, uint64_t lowWaterBytes = 0);
+			/*
+			* Set the callback being called when the send queue drained below the low-water mark.
+			*
+			* @param cb The callback. Use null to remove an existing callback.
+			* @param pParam Pointer to user defined data. This pointer is passed to cb.
+			*/
+			void setSendDrainCallback(SendDrainCallback cb, void* pParam);
+			/*
+			* Get the number of payload bytes queued for sending.
+			*
+			* @returns The number of queued bytes.
+			*/
+			uint64_t nSendBytesQueued();
+			/*
+			* Get the number of packets queued for sending.
+			*
+			* @returns The number of queued packets.
+			*/
+			uint64_t nSendPacketsQueued();
+			/*
+			* Limit the memory used for received packets of this connection.
+			*
+			* Limits are checked before a packet buffer gets allocated. A packet counts as queued from then on
+			* until it has been pulled or its recv callback has returned.
+			* When a limit is reached, the socket stops reading until enough packets have been consumed,
+			* so TCP flow control slows down the sender. (Waiting for a packet type that is stuck behind
+			* a full queue of another type will block forever!)
+			* Packets exceeding the maximum packet size close the connection. Streamed packet types are not limited.
+			*
+			* @param maxPacketSize Maximum size of a single received packet. 0 means unlimited.
+			* @param maxBytesQueued Maximum number of payload bytes queued. A single packet is always accepted when nothing else is queued. 0 means unlimited.
+			* @param maxPacketsPerType Maximum number of packets queued per packet type. 0 means unlimited.
+			*/
+			void setRecvLimits(uint64_t maxPacketSize, uint64_t maxBytesQueued, uint64_t maxPacketsPerType);
+			/*
+			* Get the number of received payload bytes queued on this connection.
+			*
+			* @returns The number of queued bytes.
+			*/
+			uint64_t nRecvBytesQueued();
+			/*
+			* Limit the memory used for received packets of all connections in this process.
+			*
+			* Works like setRecvLimits, but the limits apply to all ManagedSockets together.
+			*
+			* @param maxPacketSize Maximum size of a single received packet. 0 means unlimited.
+			* @param maxBytesQueued Maximum number of payload bytes queued on all connections. 0 means unlimited.
+			*/
+			static void setGlobalRecvLimits(uint64_t maxPacketSize, uint64_t maxBytesQueued);
+			/*
+			* Get the number of received payload bytes queued on all connections.
+			*
+			* @returns The number of queued bytes.
+			*/
+			static uint64_t nGlobalRecvBytesQueued();
+			/*
+			* Compress outgoing packets.
+			*
+			* Packets of at least minSize bytes are compressed before encryption, if a sample of their payload
+			* compresses to at most maxSampleRatio of its size. Big packets are compressed in blocks on the crypto threads.
+			* Compression is done by the crypt job (or the send job without crypto threads) right before the packet's first frame, never by push.
+			* Packets with FLAG_PH_SEND_IMMEDIATE are never compressed.
+			* Received packets are always decompressed, regardless of this setting.
+			*
+			* @param codec The codec to compress with. Use CODEC_NONE to disable compression.
+			* @param minSize Minimum size of a packet to be compressed.
+			* @param maxSampleRatio Maximum compressed/raw size of the sample (see compression::sampleRatio).
+			* @returns True if the codec is available. Otherwise false (compression stays disabled).
+			*/
+			bool setCompression(compression::Codec codec, uint64_t minSize = 1024, float maxSampleRatio = 0.9f);
+			/*
+			* Get statistics about the packets compressed by this socket.
+			*
+			* @returns The compression metrics.
+			*/
+			CompressionMetrics getCompressionMetrics();
+			/*
+			* Get the traffic and latency statistics of a packet type.
+			*
+			* @param pType The packet type.
+			* @returns The statistics since the last reset.
+			*/
+			PacketTypeStats getTypeStats(PacketType pType);
+			/*
+			* Get the traffic and latency statistics of every packet type seen so far.
+			*
+			* @returns Pairs of packet type and statistics, sorted by packet type.
+			*/
+			std::vector<std::pair<PacketType, PacketTypeStats>> getTypeStats();
+			/*
+			* Reset the statistics of all packet types.
+			*/
+			void resetTypeStats();
+		private:
+			struct RecvWaiter
+			{
+				bool signaled = false;
+				std::condition_variable cond;
+			};
+			struct RecvEntry
+			{
+				Packet packet;
+				uint64_t tReceived = 0; // Time the packet was received completely.
+			};
+			struct RecvTypeQueue
+			{
+				std::deque<std::list<RecvEntry>::iterator> packets; // Packets of this type in m_recvQueue.
+				std::deque<RecvWaiter*> waiters; // Threads waiting for a packet of this type.
+				uint64_t nReserved = 0; // Packets of this type counted by reserveRecv and not yet released.
+			};
+			struct SendEntry
+			{
+				Packet packet;
+				PacketPriority priority = PRIO_NORMAL;
+				uint64_t nFrames = 1;
+				uint64_t nFramesCryptTaken = 0; // Frames taken by makeSendableJob.
+				uint64_t nFramesEncrypted = 0;
+				uint64_t nFramesSent = 0; // Frames taken by a sendJob.
+				uint64_t nBytesSent = 0;
+				bool isEncrypted = false; // Encrypted by broadcast.
+				bool hasSendJobs = false; // Express packets with m_cryptThreadPool only: the send jobs for its frames have been pushed.
+				bool needsCompression = false; // Compressed by the job taking its first frame, so push never waits for it.
+				uint64_t tQueued = 0; // Time the packet was pushed.
+				Ref<SendHandle::State> completion; // Created on demand by pushTracked and wait. Protected by m_mtxSendQueue.
+			};
+			typedef Ref<SendEntry> SendEntryRef;
+			struct RecvFragments
+			{
+				Packet packet;
+				uint64_t nReceived = 0;
+			};
+			struct StreamData
+			{
+				CallbackData<PacketChunkCallback> cd;
+				uint32_t maxChunksQueued;
+			};
+			struct DecryptEntry
+			{
+				Packet packet;
+				uint64_t offset = 0; // Range of the frame in the packet buffer.
+				uint64_t size = 0;
+				uint64_t nRead = 0;
+				bool isComplete = false;
+			};
+		private:
+			struct RecvDispatch
+			{
+				Ref<PacketRecvHandler> handler;
+				DispatchPolicy policy = DISPATCH_SERIALIZED;
+				Ref<PacketKeyFunc> keyFunc;
+			};
 		private:
 			/*
 			* Call the corresponding callback to the packet type.
@@ -208,25 +681,78 @@ namespace EHSN {
 			/*
 			* Call the corresponding callback to the packet type.
 			*
+			* The callback is run according to the dispatch policy of the packet type.
+			*
 			* @param pack The packet that has been received/tried to receive.
 			* @param nBytesReceived The number of bytes that have been received. Same value as pack.header.packetSize on success.
 			* @returns True if a corresponding callback was found and called. Otherwise false.
 			*/
 			bool callRecvCallback(Packet& pack, uint64_t nBytesReceived);
 			/*
-			* Thread function for sending packets whose buffer is not encrypted.
+			* Get the pool to run a recv handler on.
+			*
+			* Creates the process-wide dispatch pools on first use.
+			*
+			* @param policy The dispatch policy of the packet type.
+			* @param key The key of the packet (only used with DISPATCH_PER_KEY).
+			* @returns The pool to push the handler onto.
+			*/
+			ThreadPoolRef dispatchPool(DispatchPolicy policy, uint64_t key);
+			/*
+			* Thread function for encrypting and sending the next frame.
+			*
+			* Used when en-/decryption is done on the send/recv thread.
 			*/
-			void sendJobEncrypt(Packet packet);
+			void sendJobEncrypt();
 			/*
-			* Thread function for sending packets whose buffer is already encrypted.
+			* Thread function for sending the next frame that has already been encrypted.
 			*/
-			void sendJobNoEncrypt(Packet packet);
+			void sendJobNoEncrypt();
 			/*
-			* Thread function for encrypting packet buffers and creating the corresponding sendJob.
-			* 
-			* @param packet The packet to encrypt.
+			* Encrypt the next frame and create the corresponding sendJob.
+			*
+			* Frames with a higher priority are encrypted first.
 			*/
-			void makeSendableJob(Packet packet);
+			void makeSendableJob();
+			/*
+			* Encrypt a packet with FLAG_PH_SEND_IMMEDIATE and create the sendJobs for it.
+			*
+			* Runs on m_cryptThreadPool, so the express packet neither waits behind the jobs on m_cryptPool nor gets encrypted by push.
+			*
+			* @param entry Entry of the express packet.
+			*/
+			void expressJob(SendEntryRef entry);
+			/*
+			* Mark the encrypted express packets at the front of m_expressQueue as scheduled.
+			*
+			* Express packets are encrypted in parallel, but sent in order. So the send jobs of a packet are only pushed
+			* once the packets in front of it are encrypted as well, otherwise the jobs could find no frame ready and get lost.
+			* m_mtxSendQueue must be locked by the caller.
+			*
+			* @returns The number of send jobs to push.
+			*/
+			uint64_t scheduleExpressLocked();
+			/*
+			* Take the next frame to be sent.
+			*
+			* The frame is taken from the packet with the highest priority which has a frame ready to be sent.
+			*
+			* @param entry Entry of the packet the frame belongs to.
+			* @param frame Index of the frame in the packet.
+			* @param needsEncrypted If set to true, only frames that have already been encrypted are taken.
+			* @returns True if a frame was taken. Otherwise false.
+			*/
+			bool nextSendFrame(SendEntryRef& entry, uint64_t& frame, bool needsEncrypted);
+			/*
+			* Write a frame to the socket.
+			*
+			* Calls the sent callback after the last frame of the packet or when the write failed.
+			*
+			* @param entry Entry of the packet the frame belongs to.
+			* @param frame Index of the frame in the packet.
+			* @param encrypt If set to true, the frame gets encrypted before it is written.
+			*/
+			void sendFrame(SendEntryRef entry, uint64_t frame, bool encrypt);
 			/*
 			* Thread function for receiving packets and decrypting them.
 			*/
@@ -236,33 +762,245 @@ namespace EHSN {
 			*/
 			void recvJobNoDecrypt();
 			/*
-			* Thread function for decrypting packet buffers and pushing them onto the recvQueue.
-			* 
-			* @param packet The packet to decrypt.
-			* @param nRead The number of bytes that have been read.
+			* Receive the payload of a frame.
+			*
+			* Fragments are collected until their packet is complete. They must arrive in order and, except for the last one,
+			* cover whole AES blocks. Other fragments close the connection.
+			*
+			* @param header Header of the frame.
+			* @param pack Packet to write the packet the frame belongs to to. Left empty if the frame is invalid.
+			* @param nRead Variable to write the number of payload bytes received for the packet so far to.
+			* @param decrypt If set to true, the payload gets decrypted.
+			* @returns True if pack is complete (or the connection failed while receiving it). Otherwise false.
+			*/
+			bool recvFrame(const PacketHeader& header, Packet& pack, uint64_t& nRead, bool decrypt);
+			/*
+			* Receive the payload of a frame in streaming mode.
+			*
+			* Passes the payload in chunks to the stream callback of the packet type (if any).
+			*
+			* @param header Header of the frame.
+			* @returns True if the packet type is streamed and the payload has been consumed. Otherwise false.
 			*/
-			void makePullableJob(Packet packet, uint64_t nRead);
+			bool recvStream(const PacketHeader& header);
+			/*
+			* Put a packet onto the send queue.
+			*
+			* @param pack The packet to send.
+			* @param priority Priority of the packet.
+			* @param block If set to true, blocks until the send queue has room for the packet. Otherwise fails immediately.
+			* @param pHandle If not null, receives a completion handle for the packet.
+			* @param isEncrypted If set to true, the buffer already holds the encrypted payload (padded to AES_BLOCK_SIZE) and pack.header.packetSize must be set.
+			* @returns The packet ID of the pushed packet. 0 if the send queue is full and block is false.
+			*/
+			PacketID pushSendQueue(Packet& pack, PacketPriority priority, bool block, SendHandle* pHandle = nullptr, bool isEncrypted = false);
+			/*
+			* Check if the send queue has room for another packet.
+			*
+			* The caller must hold m_mtxSendQueue.
+			*
+			* @param size Size of the packet.
+			* @returns True if the packet fits. Otherwise false.
+			*/
+			bool sendQueueFits(uint64_t size) const;
+			/*
+			* Remove a packet from the send queue accounting once it has been sent (or failed).
+			*
+			* Wakes blocked pushes and calls the drain callback when the low-water mark is reached.
+			* Completes the handle of the packet.
+			*
+			* @param entry The packet that left the send queue.
+			* @param status How the packet left the send queue.
+			*/
+			void releaseSendEntry(const SendEntryRef& entry, SendStatus status);
+			/*
+			* Find queued packets of a type whose frames have not been taken for encryption/sending yet.
+			*
+			* m_mtxSendQueue must be locked by the caller.
+			*
+			* @param packType Type of the packets to find.
+			* @param stale Vector to append the found packets to.
+			*/
+			void findStaleSendEntries(PacketType packType, std::vector<SendEntryRef>& stale);
+			/*
+			* Decrypt the next received frame and push completed packets onto the recvQueue.
+			*
+			* Frames with a higher priority are decrypted first.
+			*/
+			void makePullableJob();
+			/*
+			* Thread function for m_cryptPool.
+			*
+			* Runs either makeSendableJob or makePullableJob, depending on which one has the frame with the highest priority.
+			* One job gets pushed for every frame to en-/decrypt.
+			*/
+			void cryptJob();
 			/*
 			* Push a job onto m_recvPool to keep it alive.
 			*/
 			void pushRecvJob();
 			/*
-			* Sets the ID of the packet currently being sent.
-			* 
-			* Notifies all threads which are waiting on a 'sent' event.
+			* Push a received packet onto the receive queue and wake one interested waiter.
 			*
-			* @param pID The ID of the packet currently being sent.
+			* @param pack The packet to push.
 			*/
-			void setCurrentPacketBeingSent(PacketID pID);
+			void pushRecvQueue(Packet pack);
+			/*
+			* Count a packet against the receive limits before allocating its buffer.
+			*
+			* Blocks the recv thread while a limit is reached. Closes the connection if the packet is too big.
+			*
+			* @param header Header of the packet.
+			* @returns True if the packet may be allocated. False if the connection has been lost.
+			*/
+			bool reserveRecv(const PacketHeader& header);
+			/*
+			* Change the size counted for a packet reserved by reserveRecv, e.g. after decompressing it.
+			*
+			* Growing fails if the packet alone exceeds the packet or byte limits. Never blocks, as the packets reserved after this one
+			* can only be released once it has been delivered. Further reserveRecv calls wait until the grown packet has been consumed.
+			*
+			* @param header Header of the packet with the size counted so far.
+			* @param newSize Size to count from now on.
+			* @returns True if the new size has been counted. False if it exceeds the limits, the old size stays counted.
+			*/
+			bool resizeRecv(const PacketHeader& header, uint64_t newSize);
+			/*
+			* Release a packet counted by reserveRecv.
+			*
+			* @param header Header of the packet.
+			*/
+			void releaseRecv(const PacketHeader& header);
+			/*
+			* Same as releaseRecv, but m_mtxRecvQueue must be locked by the caller.
+			*
+			* @param header Header of the packet.
+			*/
+			void releaseRecvLocked(const PacketHeader& header);
+			/*
+			* Compress the payload of a packet if enabled and worthwhile.
+			*
+			* @param pack The packet to compress. Its buffer and flags get replaced on success.
+			*/
+			void compressPacket(Packet& pack);
+			/*
+			* Compress a queued packet before its first frame is taken.
+			*
+			* Only called by the crypt job (with m_cryptThreadPool) or the send job (without), so an entry is never compressed twice at the same time.
+			*
+			* @param entry The entry of the packet. Its packet and nFrames get replaced on success.
+			*/
+			void compressSendEntry(const SendEntryRef& entry);
+			/*
+			* Decompress a received packet with FLAG_PH_COMPRESSED set.
+			*
+			* Closes the connection if the payload is invalid.
+			*
+			* @param pack The packet to decompress. Its buffer, size and flags get replaced on success.
+			* @param nRead The number of bytes received for the packet. Gets updated to the decompressed size.
+			* @returns True if the packet can be delivered. Otherwise false.
+			*/
+			bool decompressPacket(Packet& pack, uint64_t& nRead);
+			/*
+			* Pop a packet from the receive queue.
+			*
+			* m_mtxRecvQueue must be locked by the caller.
+			*
+			* @param packType Type of the packet to pop. SPT_UNDEFINED pops the oldest packet of any type.
+			* @param pack Packet to write the popped packet to.
+			* @returns True if a packet was popped. Otherwise false.
+			*/
+			bool popRecvQueue(PacketType packType, Packet& pack);
+			/*
+			* Count a queued packet as delivered in the stats of its type.
+			*
+			* @param re The packet being pulled.
+			*/
+			void addDeliverTime(const RecvEntry& re);
+			/*
+			* Wake all threads blocked on this socket (pull, push on a full send queue and the recv thread blocked on the stream chunk limit).
+			*
+			* Used when the connection was lost.
+			*/
+			void wakeWaiters();
+			/*
+			* Add an RTT sample from a probe reply.
+			*
+			* @param reply The probe reply.
+			* @param tRecv Local time when the reply was received (ns).
+			*/
+			void addRTTSample(const packets::RTTProbeReply& reply, uint64_t tRecv);
+			/*
+			* Update the throughput estimates from the data metrics of the socket.
+			*/
+			void updateThroughput();
+			/*
+			* Thread function of the probe thread.
+			*/
+			void probeThreadFunc();
 		private:
-			bool m_recvAvail = false;
-			std::condition_variable m_recvNotify;
-
 			std::mutex m_mtxSent;
-			std::condition_variable m_sentNotify;
+
+			std::mutex m_mtxSendQueue;
+			std::deque<SendEntryRef> m_sendQueue[PRIO_COUNT]; // Packets with frames left to send.
+			std::deque<SendEntryRef> m_cryptQueue[PRIO_COUNT]; // Packets with frames left to encrypt (only used with m_cryptThreadPool).
+			std::deque<SendEntryRef> m_expressQueue; // Packets with FLAG_PH_SEND_IMMEDIATE. Sent before every other lane.
+			std::unordered_map<PacketID, SendEntryRef> m_pendingSends; // Every packet pushed and not done yet.
+			std::condition_variable m_sendSpace;
+			uint64_t m_nSendBytesQueued = 0;
+			uint64_t m_nSendPacketsQueued = 0;
+			uint64_t m_maxSendBytes = 0;
+			uint64_t m_maxSendPackets = 0;
+			uint64_t m_sendLowWater = 0;
+			CallbackData<SendDrainCallback> m_sendDrainCallback = { nullptr, nullptr };
+
+			std::unordered_map<PacketID, RecvFragments> m_recvFragments; // Only accessed by the recv jobs.
+			PacketBufferPool m_recvBuffers = PacketBufferPool(RECV_BUFFERS_POOLED, RECV_POOLED_BYTES); // Received packets return their buffers here once they have been dropped.
+
+			std::mutex m_mtxDecryptQueue;
+			std::deque<DecryptEntry> m_decryptQueue[PRIO_COUNT]; // Received frames left to decrypt (only used with m_cryptThreadPool).
+			std::unordered_set<PacketID> m_droppedFragments; // Packets whose queued fragments got dropped by clear(), their remaining fragments are discarded.
 
 			std::mutex m_mtxRecvQueue;
-			std::map<PacketType, std::queue<Packet>> m_recvQueue;
+			std::list<RecvEntry> m_recvQueue; // Every pullable packet in the order of arrival.
+			PacketTypeTable<RecvTypeQueue> m_recvTypeQueues;
+			std::deque<RecvWaiter*> m_recvAnyWaiters; // Threads waiting for a packet of any type.
+			std::condition_variable m_recvSpace;
+			uint64_t m_nRecvBytesReserved = 0;
+			uint64_t m_maxRecvPacketSize = 0;
+			uint64_t m_maxRecvBytes = 0;
+			uint64_t m_maxRecvPacketsPerType = 0;
+
+			static std::mutex s_mtxGlobalRecv;
+			static std::condition_variable s_globalRecvSpace;
+			static uint64_t s_nGlobalRecvBytesReserved;
+			static uint64_t s_maxGlobalRecvPacketSize;
+			static uint64_t s_maxGlobalRecvBytes;
+			static std::mutex s_mtxBroadcast;
+			static ThreadPoolRef s_broadcastPool;
+			static PacketBufferPool s_broadcastBuffers;
+			static std::mutex s_mtxDispatchPools;
+			static ThreadPoolRef s_parallelPool; // Used by DISPATCH_PARALLEL.
+			static std::vector<ThreadPoolRef> s_keyPools; // Single threaded pools used by DISPATCH_PER_KEY.
+
+			std::mutex m_mtxCompression;
+			compression::Codec m_compressionCodec = compression::CODEC_NONE;
+			uint64_t m_compressionMinSize = 0;
+			float m_compressionMaxRatio = 0.0f;
+			CompressionMetrics m_compressionMetrics;
+
+			struct TypeStats
+			{
+				std::atomic<uint64_t> nPacketsSent = 0;
+				std::atomic<uint64_t> nBytesSent = 0;
+				std::atomic<uint64_t> nPacketsReceived = 0;
+				std::atomic<uint64_t> nBytesReceived = 0;
+				std::atomic<uint64_t> sendQueueTime = 0;
+				std::atomic<uint64_t> encryptTime = 0;
+				std::atomic<uint64_t> nDelivered = 0;
+				std::atomic<uint64_t> deliverTime = 0;
+			};
+			PacketTypeTable<TypeStats> m_typeStats; // Updated with relaxed atomics, so it can stay enabled.
 
 			ThreadPoolRef m_sendPool;
 			ThreadPoolRef m_recvPool;
@@ -270,16 +1008,37 @@ namespace EHSN {
 			ThreadPoolRef m_cryptThreadPool;
 			ThreadPoolRef m_callbackPool;
 
+			uint32_t m_nDispatchThreads;
+			std::mutex m_mtxDispatchPending;
+			std::condition_variable m_condDispatchDone;
+			uint64_t m_nDispatchPending = 0; // Handlers queued on the shared dispatch pools, waited for by the destructor.
+
 			std::mutex m_mtxSentCallbacks;
 			std::mutex m_mtxRecvCallbacks;
-			std::unordered_map<PacketType, CallbackData<PacketSentCallback>> m_sentCallbacks;
-			std::unordered_map<PacketType, CallbackData<PacketRecvCallback>> m_recvCallbacks;
+			std::unordered_map<PacketType, Ref<PacketSentHandler>> m_sentHandlers;
+			PacketTypeTable<RecvDispatch> m_recvDispatch;
+			std::unordered_map<PacketType, StreamData> m_streamCallbacks;
+
+			std::mutex m_mtxStream;
+			std::condition_variable m_streamNotify;
+			uint64_t m_nStreamChunksQueued = 0;
+			PacketBufferPool m_streamChunks = PacketBufferPool(STREAM_CHUNKS_POOLED); // Chunk buffers return here once the stream callback dropped them.
 		private:
-			std::mutex m_mtxPacketIDBeingSent;
-			PacketID m_currPacketIDBeingSent = 0;
-			PacketID m_nextPacketID = 1;
+			std::atomic<PacketID> m_nextPacketID = 1;
 			bool m_paused = true;
 			std::atomic<float> m_remoteWriteSpeed;
+		private:
+			std::mutex m_mtxLinkStats;
+			LinkStats m_linkStats;
+			uint64_t m_lastThroughputTime = 0;
+			uint64_t m_lastNRead = 0;
+			uint64_t m_lastNWritten = 0;
+
+			std::mutex m_mtxProbe;
+			std::condition_variable m_probeNotify;
+			std::thread m_probeThread;
+			bool m_probing = false;
+			uint32_t m_probeInterval = 1000;
 		private:
 			SecSocketRef m_sock;
 		};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <tuple>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+#include "packetBuffer.h"
+
+namespace EHSN {
+	namespace net {
+
+		/*
+		* Layout of a message with fixed-size fields.
+		*
+		* The fields are packed back to back in the given order (like the structs in packets.h),
+		* so every offset is known at compile time.
+		*/
+		template <typename... Fields>
+		class MessageSchema
+		{
+			static_assert((std::is_trivially_copyable_v<Fields> && ...), "MessageSchema requires trivially copyable fields!");
+		public:
+			template <size_t I>
+			using Field = std::tuple_element_t<I, std::tuple<Fields...>>;
+		public:
+			static constexpr size_t N_FIELDS = sizeof...(Fields);
+			static constexpr uint64_t FIXED_SIZE = (uint64_t(0) + ... + sizeof(Fields));
+		public:
+			/*
+			* Get the offset of a field.
+			*
+			* @returns Offset of the field relative to the start of the message.
+			*/
+			template <size_t I>
+			static constexpr uint64_t offset()
+			{
+				static_assert(I < N_FIELDS, "Field index out of range!");
+				constexpr uint64_t sizes[] = { sizeof(Fields)... };
+				uint64_t off = 0;
+				for (size_t i = 0; i < I; ++i)
+					off += sizes[i];
+				return off;
+			}
+		};
+
+		/*
+		* Typed view of a message stored in a PacketBuffer.
+		*
+		* Fields are read and written directly inside PacketBuffer::data(), without copying the message into a struct.
+		* The size of the buffer is checked once when creating the view, so accessing fields needs no further checks.
+		* The bytes after the fixed fields form a variable-length tail of TailType elements.
+		*
+		* Example:
+		*   enum { QUOTE_TIME, QUOTE_PRICE, QUOTE_QTY };
+		*   typedef MessageView<MessageSchema<uint64_t, double, uint32_t>, char> QuoteView; // Tail holds the symbol.
+		*
+		*   auto quote = QuoteView::create(4);
+		*   quote.set<QUOTE_PRICE>(1.25);
+		*   memcpy(quote.tail(), "EHSN", 4);
+		*   queue.push(CPT_QUOTE, FLAG_PH_NONE, quote.buffer());
+		*
+		*   QuoteView received(queue.pull(CPT_QUOTE).buffer);
+		*   if (received) price = received.get<QUOTE_PRICE>();
+		*/
+		template <typename Schema, typename TailType = uint8_t>
+		class MessageView
+		{
+			static_assert(std::is_trivially_copyable_v<TailType>, "MessageView requires a trivially copyable tail type!");
+		public:
+			template <size_t I>
+			using Field = typename Schema::template Field<I>;
+		public:
+			static constexpr uint64_t FIXED_SIZE = Schema::FIXED_SIZE;
+			static constexpr uint64_t TAIL_OFFSET = (FIXED_SIZE + alignof(TailType) - 1) / alignof(TailType) * alignof(TailType); // Tail elements are aligned relative to the start of the buffer.
+		public:
+			MessageView() = default;
+			/*
+			* Constructor of MessageView.
+			*
+			* If the buffer is too small for the fixed fields or the tail is not a whole number of elements, the view is invalid.
+			*
+			* @param buffer Buffer holding the message.
+			*/
+			MessageView(PacketBufferRef buffer);
+		public:
+			/*
+			* Create a new message.
+			*
+			* The fixed fields and the padding before the tail are zero-initialized, the tail is not.
+			*
+			* @param tailCount Number of tail elements.
+			* @returns View of the new message.
+			*/
+			static MessageView create(uint64_t tailCount = 0);
+		public:
+			/*
+			* Check if the view refers to a message large enough for its schema.
+			*
+			* @returns True if the view is valid. Otherwise false.
+			*/
+			bool valid() const;
+			explicit operator bool() const;
+			/*
+			* Get the buffer of the message.
+			*
+			* @returns Buffer holding the message.
+			*/
+			PacketBufferRef buffer() const;
+		public:
+			/*
+			* Read a field.
+			*
+			* The view must be valid.
+			*
+			* @returns Value of the field.
+			*/
+			template <size_t I>
+			Field<I> get() const;
+			/*
+			* Write a field.
+			*
+			* The view must be valid.
+			*
+			* @param value New value of the field.
+			*/
+			template <size_t I>
+			void set(const Field<I>& value);
+		public:
+			/*
+			* Get the number of tail elements.
+			*
+			* @returns Number of tail elements.
+			*/
+			uint64_t tailCount() const;
+			/*
+			* Get the tail elements.
+			*
+			* @returns Pointer to the first tail element inside the buffer.
+			*/
+			TailType* tail();
+			const TailType* tail() const;
+		private:
+			PacketBufferRef m_buffer;
+			uint8_t* m_data = nullptr;
+			uint64_t m_tailCount = 0;
+		};
+
+		template <typename Schema, typename TailType>
+		inline MessageView<Schema, TailType>::MessageView(PacketBufferRef buffer)
+		{
+			if (!buffer || buffer->size() < TAIL_OFFSET)
+				return;
+
+			uint64_t tailSize = buffer->size() - TAIL_OFFSET;
+			if (tailSize % sizeof(TailType))
+				return;
+
+			m_buffer = buffer;
+			m_data = (uint8_t*)buffer->data();
+			m_tailCount = tailSize / sizeof(TailType);
+		}
+
+		template <typename Schema, typename TailType>
+		inline MessageView<Schema, TailType> MessageView<Schema, TailType>::create(uint64_t tailCount)
+		{
+			auto buffer = std::make_shared<PacketBuffer>(TAIL_OFFSET + tailCount * sizeof(TailType));
+			memset(buffer->data(), 0, TAIL_OFFSET);
+			return MessageView(buffer);
+		}
+
+		template <typename Schema, typename TailType>
+		inline bool MessageView<Schema, TailType>::valid() const
+		{
+			return m_data != nullptr;
+		}
+
+		template <typename Schema, typename TailType>
+		inline MessageView<Schema, TailType>::operator bool() const
+		{
+			return valid();
+		}
+
+		template <typename Schema, typename TailType>
+		inline PacketBufferRef MessageView<Schema, TailType>::buffer() const
+		{
+			return m_buffer;
+		}
+
+		template <typename Schema, typename TailType>
+		template <size_t I>
+		inline typename MessageView<Schema, TailType>::template Field<I> MessageView<Schema, TailType>::get() const
+		{
+			Field<I> value;
+			memcpy(&value, m_data + Schema::template offset<I>(), sizeof(value)); // Fields are packed, so they may be unaligned.
+			return value;
+		}
+
+		template <typename Schema, typename TailType>
+		template <size_t I>
+		inline void MessageView<Schema, TailType>::set(const Field<I>& value)
+		{
+			memcpy(m_data + Schema::template offset<I>(), &value, sizeof(value));
+		}
+
+		template <typename Schema, typename TailType>
+		inline uint64_t MessageView<Schema, TailType>::tailCount() const
+		{
+			return m_tailCount;
+		}
+
+		template <typename Schema, typename TailType>
+		inline TailType* MessageView<Schema, TailType>::tail()
+		{
+			return (TailType*)(m_data + TAIL_OFFSET);
+		}
+
+		template <typename Schema, typename TailType>
+		inline const TailType* MessageView<Schema, TailType>::tail() const
+		{
+			return (const TailType*)(m_data + TAIL_OFFSET);
+		}
+
+	} // namespace net
+} // namespace EHSN
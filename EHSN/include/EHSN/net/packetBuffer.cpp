@@ -1,10 +1,35 @@
 #include "packetBuffer.h"
 
 #include <cstring>
+#include <new>
+#include <algorithm>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 namespace EHSN {
 	namespace net {
 
+		static void* defaultAlloc(uint64_t size, uint64_t alignment, void*)
+		{
+			void* ptr = ::operator new[](size, std::align_val_t(alignment));
+		#if defined(__linux__) && defined(MADV_HUGEPAGE)
+			if (size >= HUGE_PAGE_THRESHOLD)
+				madvise(ptr, size, MADV_HUGEPAGE); // Only a hint, failing is fine.
+		#endif
+			return ptr;
+		}
+
+		static void defaultFree(void* ptr, uint64_t, uint64_t alignment, void*)
+		{
+			::operator delete[](ptr, std::align_val_t(alignment));
+		}
+
+		static BufferAllocFunc s_allocFunc = defaultAlloc;
+		static BufferFreeFunc s_freeFunc = defaultFree;
+		static void* s_pAllocParam = nullptr;
+
 		PacketBuffer::PacketBuffer()
 			: PacketBuffer(1)
 		{
@@ -18,7 +43,7 @@ namespace EHSN {
 		PacketBuffer::PacketBuffer(const PacketBuffer& other)
 		{
 			createBuffer(other.m_size);
-			write(other.m_buffer, m_size);
+			write((const void*)other.m_buffer, m_size);
 		}
 
 		PacketBuffer::~PacketBuffer()
@@ -51,6 +76,31 @@ namespace EHSN {
 			memcpy(m_buffer + offset, src, size);
 		}
 
+		void PacketBuffer::setAllocator(BufferAllocFunc allocFunc, BufferFreeFunc freeFunc, void* pParam)
+		{
+			if (allocFunc && freeFunc)
+			{
+				s_allocFunc = allocFunc;
+				s_freeFunc = freeFunc;
+				s_pAllocParam = pParam;
+			}
+			else
+			{
+				s_allocFunc = defaultAlloc;
+				s_freeFunc = defaultFree;
+				s_pAllocParam = nullptr;
+			}
+		}
+
+		uint64_t PacketBuffer::alignmentFor(uint64_t size)
+		{
+			if (size >= HUGE_PAGE_THRESHOLD)
+				return MEM_HUGE_PAGE_SIZE;
+			if (size >= PAGE_ALIGN_THRESHOLD)
+				return MEM_PAGE_SIZE;
+			return CACHE_LINE_SIZE;
+		}
+
 		void PacketBuffer::resize(uint64_t newSize)
 		{
 			if (newSize <= m_nReserved)
@@ -66,21 +116,90 @@ namespace EHSN {
 			uint64_t paddedSize = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
 			paddedSize *= CHUNK_SIZE;
 
-			m_buffer = new uint8_t[paddedSize];
+			m_buffer = (uint8_t*)s_allocFunc(paddedSize, alignmentFor(paddedSize), s_pAllocParam);
 			m_size = size;
 			m_nReserved = paddedSize;
+			m_freeFunc = s_freeFunc;
+			m_pFreeParam = s_pAllocParam;
 		}
 
 		void PacketBuffer::deleteBuffer()
 		{
 			if (m_buffer != nullptr)
 			{
-				delete[]m_buffer;
+				m_freeFunc(m_buffer, m_nReserved, alignmentFor(m_nReserved), m_pFreeParam);
 				m_buffer = nullptr;
 			}
 			m_size = 0;
 			m_nReserved = 0;
 		}
 
+		PacketBufferPool::PacketBufferPool(uint64_t maxPooled, uint64_t maxPooledBytes)
+			: m_state(std::make_shared<State>())
+		{
+			m_state->maxPooled = maxPooled;
+			m_state->maxPooledBytes = maxPooledBytes;
+		}
+
+		PacketBufferRef PacketBufferPool::acquire(uint64_t size)
+		{
+			PacketBuffer* buffer = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(m_state->mtx);
+				auto& buffers = m_state->buffers;
+				for (auto it = buffers.rbegin(); it != buffers.rend(); ++it)
+				{
+					// Don't waste big buffers on small requests.
+					if ((*it)->reserved() >= size && (*it)->reserved() <= 2 * std::max(size, CHUNK_SIZE))
+					{
+						buffer = *it;
+						buffers.erase(std::next(it).base());
+						m_state->nPooledBytes -= buffer->reserved();
+						break;
+					}
+				}
+			}
+
+			if (buffer)
+				buffer->resize(size);
+			else
+				buffer = new PacketBuffer(size);
+
+			return PacketBufferRef(
+				buffer,
+				[state = m_state](PacketBuffer* buffer)
+				{
+					{
+						std::unique_lock<std::mutex> lock(state->mtx);
+						if (state->buffers.size() < state->maxPooled && state->nPooledBytes + buffer->reserved() <= state->maxPooledBytes)
+						{
+							state->buffers.push_back(buffer);
+							state->nPooledBytes += buffer->reserved();
+							return;
+						}
+					}
+					delete buffer;
+				}
+			);
+		}
+
+		uint64_t PacketBufferPool::nPooled() const
+		{
+			std::unique_lock<std::mutex> lock(m_state->mtx);
+			return m_state->buffers.size();
+		}
+
+		uint64_t PacketBufferPool::nPooledBytes() const
+		{
+			std::unique_lock<std::mutex> lock(m_state->mtx);
+			return m_state->nPooledBytes;
+		}
+
+		PacketBufferPool::State::~State()
+		{
+			for (auto buffer : buffers)
+				delete buffer;
+		}
+
 	} // namespace net
 } // namespace EHSN
\ No newline at end of file
@@ -1,12 +1,39 @@
 #pragma once
 
+#include <mutex>
+#include <vector>
 #include <cstdint>
+#include <type_traits>
 #include "../Reference.h"
+#include "EHSN/CacheLine.h"
 
 namespace EHSN {
 	namespace net {
 
 		constexpr uint64_t CHUNK_SIZE = 2048;
+		constexpr uint64_t MEM_PAGE_SIZE = 4096;
+		constexpr uint64_t MEM_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+		constexpr uint64_t PAGE_ALIGN_THRESHOLD = 64 * 1024; // Buffers of at least this size are page-aligned instead of cache-line-aligned.
+		constexpr uint64_t HUGE_PAGE_THRESHOLD = 4 * MEM_HUGE_PAGE_SIZE; // Buffers of at least this size are huge-page-aligned and advised to use transparent huge pages.
+
+		/*
+		* Allocate memory for a PacketBuffer.
+		*
+		* @param size Number of bytes to allocate.
+		* @param alignment Required alignment of the memory (power of two).
+		* @param pParam Parameter passed to PacketBuffer::setAllocator.
+		* @returns Pointer to the allocated memory.
+		*/
+		typedef void* (*BufferAllocFunc)(uint64_t size, uint64_t alignment, void* pParam);
+		/*
+		* Free memory allocated by a BufferAllocFunc.
+		*
+		* @param ptr Pointer returned by the allocation function.
+		* @param size Number of bytes allocated.
+		* @param alignment Alignment passed to the allocation function.
+		* @param pParam Parameter passed to PacketBuffer::setAllocator.
+		*/
+		typedef void (*BufferFreeFunc)(void* ptr, uint64_t size, uint64_t alignment, void* pParam);
 
 		class PacketBuffer
 		{
@@ -52,10 +79,12 @@ namespace EHSN {
 			/*
 			* Read data from the packet buffer.
 			*
+			* Pointers are excluded, so read(ptr, size) always resolves to the overload above.
+			*
 			* @param obj The object where to write the data to.
 			* @param offset The offset in the packet buffer of the first byte being read.
 			*/
-			template <typename T>
+			template <typename T, typename = std::enable_if_t<!std::is_pointer_v<T> && std::is_trivially_copyable_v<T>>>
 			void read(T& obj, uint64_t offset = 0) const;
 			/*
 			* Write data to the packet buffer.
@@ -68,11 +97,32 @@ namespace EHSN {
 			/*
 			* Write data to the packet buffer.
 			*
+			* Pointers are excluded, so write(ptr, size) always resolves to the overload above.
+			*
 			* @param obj The object to write to the buffer.
 			* @param offset The offset in the packet buffer of the first byte being written.
 			*/
-			template <typename T>
+			template <typename T, typename = std::enable_if_t<!std::is_pointer_v<T> && std::is_trivially_copyable_v<T>>>
 			void write(const T& obj, uint64_t offset = 0);
+		public:
+			/*
+			* Set the functions used to allocate the memory of new buffers (e.g. to supply NUMA-local memory).
+			*
+			* Existing buffers keep being freed with the function they were allocated with.
+			* Should be set before buffers are created concurrently.
+			*
+			* @param allocFunc Function allocating the memory. If null, the default allocator is used.
+			* @param freeFunc Function freeing the memory. Must be set if allocFunc is set.
+			* @param pParam Parameter passed to allocFunc and freeFunc.
+			*/
+			static void setAllocator(BufferAllocFunc allocFunc, BufferFreeFunc freeFunc, void* pParam = nullptr);
+			/*
+			* Get the alignment of the memory of a buffer.
+			*
+			* @param size Reserved size of the buffer.
+			* @returns Alignment of the memory (at least CACHE_LINE_SIZE).
+			*/
+			static uint64_t alignmentFor(uint64_t size);
 		public:
 			/*
 			* Resize the buffer.
@@ -91,6 +141,7 @@ namespace EHSN {
 			* Delete the old buffer and creates a new one.
 			*
 			* The size of the buffer always gets padded to the next multiple of CHUNK_SIZE.
+			* The memory is aligned to alignmentFor(size).
 			*
 			* @param size Size of the new buffer.
 			*/
@@ -105,17 +156,72 @@ namespace EHSN {
 			uint8_t* m_buffer = nullptr;
 			uint64_t m_size = 0;
 			uint64_t m_nReserved = 0;
+			BufferFreeFunc m_freeFunc = nullptr;
+			void* m_pFreeParam = nullptr;
 		};
 
 		typedef Ref<PacketBuffer> PacketBufferRef;
 
-		template<typename T>
+		/*
+		* Recycles PacketBuffers of similar sizes.
+		*
+		* Buffers acquired from the pool return to it when their last reference is dropped,
+		* so buffers handed to ManagedSocket::push get reused after they have been sent.
+		*/
+		class PacketBufferPool
+		{
+		public:
+			/*
+			* Constructor of PacketBufferPool.
+			*
+			* @param maxPooled Maximum number of free buffers kept for reuse.
+			* @param maxPooledBytes Maximum number of bytes reserved by the free buffers. Returned buffers exceeding it are freed.
+			*/
+			PacketBufferPool(uint64_t maxPooled = 1024, uint64_t maxPooledBytes = 64 * 1024 * 1024);
+		public:
+			/*
+			* Get a buffer from the pool or create a new one.
+			*
+			* The content of a reused buffer is undefined.
+			*
+			* @param size Size of the buffer.
+			* @returns Buffer of the requested size.
+			*/
+			PacketBufferRef acquire(uint64_t size);
+			/*
+			* Get the number of free buffers in the pool.
+			*
+			* @returns Number of buffers ready for reuse.
+			*/
+			uint64_t nPooled() const;
+			/*
+			* Get the number of bytes reserved by the free buffers in the pool.
+			*
+			* @returns Number of bytes held for reuse.
+			*/
+			uint64_t nPooledBytes() const;
+		private:
+			struct State
+			{
+				std::mutex mtx;
+				std::vector<PacketBuffer*> buffers;
+				uint64_t maxPooled = 0;
+				uint64_t maxPooledBytes = 0;
+				uint64_t nPooledBytes = 0;
+			public:
+				~State();
+			};
+		private:
+			Ref<State> m_state; // Shared with the buffers in use, so they can outlive the pool.
+		};
+
+		template<typename T, typename>
 		inline void PacketBuffer::read(T& obj, uint64_t offset) const
 		{
 			read(&obj, sizeof(T), offset);
 		}
 
-		template<typename T>
+		template<typename T, typename>
 		inline void PacketBuffer::write(const T& obj, uint64_t offset)
 		{
 			write(&obj, sizeof(T), offset);
@@ -0,0 +1,156 @@
+#include "packetChain.h"
+
+#include <mutex>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+namespace EHSN {
+	namespace net {
+
+		static std::mutex s_mtxSegmentPool;
+		static std::vector<uint8_t*> s_segmentPool;
+
+		PacketChain::PacketChain(PacketChain&& other) noexcept
+			: m_segments(std::move(other.m_segments)), m_size(other.m_size)
+		{
+			other.m_segments.clear();
+			other.m_size = 0;
+		}
+
+		PacketChain& PacketChain::operator=(PacketChain&& other) noexcept
+		{
+			if (this != &other)
+			{
+				clear();
+				m_segments = std::move(other.m_segments);
+				m_size = other.m_size;
+				other.m_segments.clear();
+				other.m_size = 0;
+			}
+			return *this;
+		}
+
+		PacketChain::~PacketChain()
+		{
+			clear();
+		}
+
+		void PacketChain::append(const void* src, uint64_t size)
+		{
+			m_size += size;
+			while (size > 0)
+			{
+				if (m_segments.empty() || m_segments.back().external || m_segments.back().end == m_segments.back().capacity)
+					m_segments.push_back({ acquireSegment(), SEGMENT_SIZE, 0, 0, nullptr });
+
+				auto& seg = m_segments.back();
+				uint64_t n = std::min(size, seg.capacity - seg.end);
+				memcpy(seg.storage + seg.end, src, n);
+				seg.end += n;
+				src = (const uint8_t*)src + n;
+				size -= n;
+			}
+		}
+
+		void PacketChain::append(PacketBufferRef buffer)
+		{
+			if (!buffer || buffer->size() == 0)
+				return;
+
+			m_size += buffer->size();
+			m_segments.push_back({ (uint8_t*)buffer->data(), buffer->size(), 0, buffer->size(), buffer });
+		}
+
+		void PacketChain::prepend(const void* src, uint64_t size)
+		{
+			// Fill the segments from back to front, so the headroom of a new segment stays usable for further prepends.
+			m_size += size;
+			while (size > 0)
+			{
+				if (m_segments.empty() || m_segments.front().external || m_segments.front().begin == 0)
+					m_segments.push_front({ acquireSegment(), SEGMENT_SIZE, SEGMENT_SIZE, SEGMENT_SIZE, nullptr });
+
+				auto& seg = m_segments.front();
+				uint64_t n = std::min(size, seg.begin);
+				seg.begin -= n;
+				size -= n;
+				memcpy(seg.storage + seg.begin, (const uint8_t*)src + size, n);
+			}
+		}
+
+		void PacketChain::prepend(PacketBufferRef buffer)
+		{
+			if (!buffer || buffer->size() == 0)
+				return;
+
+			m_size += buffer->size();
+			m_segments.push_front({ (uint8_t*)buffer->data(), buffer->size(), 0, buffer->size(), buffer });
+		}
+
+		uint64_t PacketChain::size() const
+		{
+			return m_size;
+		}
+
+		const std::deque<PacketChain::Segment>& PacketChain::segments() const
+		{
+			return m_segments;
+		}
+
+		void PacketChain::copyTo(void* dest) const
+		{
+			for (auto& seg : m_segments)
+			{
+				memcpy(dest, seg.data(), seg.size());
+				dest = (uint8_t*)dest + seg.size();
+			}
+		}
+
+		PacketBufferRef PacketChain::toBuffer() const
+		{
+			auto buffer = std::make_shared<PacketBuffer>(m_size);
+			copyTo(buffer->data());
+			return buffer;
+		}
+
+		void PacketChain::clear()
+		{
+			for (auto& seg : m_segments)
+			{
+				if (!seg.external)
+					releaseSegment(seg.storage);
+			}
+			m_segments.clear();
+			m_size = 0;
+		}
+
+		uint8_t* PacketChain::acquireSegment()
+		{
+			{
+				std::unique_lock<std::mutex> lock(s_mtxSegmentPool);
+				if (!s_segmentPool.empty())
+				{
+					uint8_t* storage = s_segmentPool.back();
+					s_segmentPool.pop_back();
+					return storage;
+				}
+			}
+			return new uint8_t[SEGMENT_SIZE];
+		}
+
+		void PacketChain::releaseSegment(uint8_t* storage)
+		{
+			{
+				std::unique_lock<std::mutex> lock(s_mtxSegmentPool);
+				if (s_segmentPool.size() < MAX_POOLED_SEGMENTS)
+				{
+					s_segmentPool.push_back(storage);
+					return;
+				}
+			}
+			delete[] storage;
+		}
+
+	} // namespace net
+} // namespace EHSN
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <deque>
+#include <cstdint>
+
+#include "packetBuffer.h"
+
+namespace EHSN {
+	namespace net {
+
+		constexpr uint64_t SEGMENT_SIZE = 8 * CHUNK_SIZE; // Size of the pooled segments of a PacketChain.
+		constexpr uint64_t MAX_POOLED_SEGMENTS = 256; // Number of free segments kept for reuse.
+
+		/*
+		* Buffer made of a chain of segments.
+		*
+		* Appending and prepending never moves data that has already been written,
+		* so a message can be assembled from several sources (e.g. a payload and the headers in front of it) in O(bytes).
+		* Copied data lives in pooled segments of SEGMENT_SIZE bytes. Existing PacketBuffers can be linked in without copying.
+		* SecSocket::writeSecure encrypts the segments in place and writes them with a single gather write.
+		*/
+		class PacketChain
+		{
+		public:
+			/*
+			* A contiguous region of the chain.
+			*/
+			struct Segment
+			{
+				uint8_t* storage = nullptr;
+				uint64_t capacity = 0;
+				uint64_t begin = 0; // Offset of the first used byte in storage.
+				uint64_t end = 0; // Offset past the last used byte in storage.
+				PacketBufferRef external; // Set if the segment refers to a linked PacketBuffer instead of a pooled segment.
+			public:
+				uint8_t* data() const { return storage + begin; }
+				uint64_t size() const { return end - begin; }
+			};
+		public:
+			PacketChain() = default;
+			PacketChain(const PacketChain&) = delete;
+			PacketChain(PacketChain&& other) noexcept;
+			PacketChain& operator=(PacketChain&& other) noexcept;
+			/*
+			* Destructor of PacketChain.
+			*
+			* Returns the segments to the pool.
+			*/
+			~PacketChain();
+		public:
+			/*
+			* Copy data to the end of the chain.
+			*
+			* @param src Pointer to the data.
+			* @param size Number of bytes to append.
+			*/
+			void append(const void* src, uint64_t size);
+			/*
+			* Copy an object to the end of the chain.
+			*
+			* @param obj The object to append.
+			*/
+			template <typename T>
+			void append(const T& obj);
+			/*
+			* Link a buffer to the end of the chain without copying it.
+			*
+			* The buffer becomes part of the chain. Its content gets encrypted when the chain is written with SecSocket::writeSecure.
+			*
+			* @param buffer The buffer to link.
+			*/
+			void append(PacketBufferRef buffer);
+			/*
+			* Copy data to the front of the chain.
+			*
+			* @param src Pointer to the data.
+			* @param size Number of bytes to prepend.
+			*/
+			void prepend(const void* src, uint64_t size);
+			/*
+			* Copy an object to the front of the chain.
+			*
+			* @param obj The object to prepend.
+			*/
+			template <typename T>
+			void prepend(const T& obj);
+			/*
+			* Link a buffer to the front of the chain without copying it.
+			*
+			* @param buffer The buffer to link.
+			*/
+			void prepend(PacketBufferRef buffer);
+		public:
+			/*
+			* Get the number of bytes in the chain.
+			*
+			* @returns Number of bytes stored.
+			*/
+			uint64_t size() const;
+			/*
+			* Get the segments of the chain.
+			*
+			* @returns The segments in order.
+			*/
+			const std::deque<Segment>& segments() const;
+			/*
+			* Copy the content of the chain to a contiguous buffer.
+			*
+			* @param dest Buffer to copy the data to. Must be at least size() bytes.
+			*/
+			void copyTo(void* dest) const;
+			/*
+			* Copy the content of the chain to a new PacketBuffer, e.g. to push it to a ManagedSocket.
+			*
+			* @returns Buffer holding the content of the chain.
+			*/
+			PacketBufferRef toBuffer() const;
+			/*
+			* Remove all data and return the segments to the pool.
+			*/
+			void clear();
+		private:
+			/*
+			* Take a segment from the pool or allocate a new one.
+			*
+			* @returns Pointer to SEGMENT_SIZE bytes.
+			*/
+			static uint8_t* acquireSegment();
+			/*
+			* Return a segment to the pool.
+			*
+			* @param storage Pointer returned by acquireSegment.
+			*/
+			static void releaseSegment(uint8_t* storage);
+		private:
+			std::deque<Segment> m_segments;
+			uint64_t m_size = 0;
+		};
+
+		template <typename T>
+		inline void PacketChain::append(const T& obj)
+		{
+			append((const void*)&obj, sizeof(T));
+		}
+
+		template <typename T>
+		inline void PacketChain::prepend(const T& obj)
+		{
+			prepend((const void*)&obj, sizeof(T));
+		}
+
+	} // namespace net
+} // namespace EHSN
@@ -0,0 +1,159 @@
+#include "packetReader.h"
+
+namespace EHSN {
+	namespace net {
+
+		PacketReader::PacketReader(PacketBufferRef buffer)
+			: m_buffer(buffer)
+		{
+			open();
+		}
+
+		bool PacketReader::recv(SecSocket& sock, uint64_t maxSize)
+		{
+			m_buffer.reset();
+			m_good = false;
+
+			// The first block holds the size prefix.
+			auto first = std::make_shared<PacketBuffer>(AES_BLOCK_SIZE);
+			if (sock.readSecure(first->data(), AES_BLOCK_SIZE) < AES_BLOCK_SIZE)
+				return false;
+
+			uint64_t size;
+			first->read(size);
+			if (size > maxSize)
+				return false;
+
+			uint64_t nBytes = crypto::aes::paddedSize(SERIALIZED_PREFIX_SIZE + size);
+			if (nBytes > AES_BLOCK_SIZE)
+			{
+				m_buffer = std::make_shared<PacketBuffer>(nBytes);
+				memcpy(m_buffer->data(), first->data(), AES_BLOCK_SIZE);
+				uint64_t nRemaining = nBytes - AES_BLOCK_SIZE;
+				if (sock.readSecure((char*)m_buffer->data() + AES_BLOCK_SIZE, nRemaining) < nRemaining)
+				{
+					m_buffer.reset();
+					return false;
+				}
+			}
+			else
+			{
+				m_buffer = first;
+			}
+
+			open();
+			return m_good;
+		}
+
+		bool PacketReader::readBytes(void* dest, uint64_t size)
+		{
+			const void* src = readBytesInPlace(size);
+			if (!src)
+				return false;
+
+			if (size > 0)
+				memcpy(dest, src, size);
+			return true;
+		}
+
+		const void* PacketReader::readBytesInPlace(uint64_t size)
+		{
+			return take(size);
+		}
+
+		bool PacketReader::readVarint(uint64_t& value)
+		{
+			value = 0;
+			for (uint32_t shift = 0; shift < 64; shift += 7)
+			{
+				const uint8_t* byte = take(1);
+				if (!byte)
+					return false;
+
+				value |= (uint64_t)(*byte & 0x7F) << shift;
+				if (!(*byte & 0x80))
+					return true;
+			}
+
+			m_good = false; // More than 10 bytes.
+			return false;
+		}
+
+		bool PacketReader::readSignedVarint(int64_t& value)
+		{
+			uint64_t zigzag;
+			if (!readVarint(zigzag))
+				return false;
+
+			value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+			return true;
+		}
+
+		bool PacketReader::readString(std::string& str)
+		{
+			std::string_view view;
+			if (!readStringView(view))
+				return false;
+
+			str.assign(view.data(), view.size());
+			return true;
+		}
+
+		bool PacketReader::readStringView(std::string_view& str)
+		{
+			uint64_t size;
+			if (!readVarint(size))
+				return false;
+
+			const char* data = (const char*)take(size);
+			if (!data)
+				return false;
+
+			str = std::string_view(data, size);
+			return true;
+		}
+
+		bool PacketReader::good() const
+		{
+			return m_good;
+		}
+
+		uint64_t PacketReader::remaining() const
+		{
+			return m_end - m_offset;
+		}
+
+		const uint8_t* PacketReader::take(uint64_t size)
+		{
+			if (!m_good || size > remaining())
+			{
+				m_good = false;
+				return nullptr;
+			}
+
+			const uint8_t* ptr = (const uint8_t*)m_buffer->data() + m_offset;
+			m_offset += size;
+			return ptr;
+		}
+
+		void PacketReader::open()
+		{
+			m_offset = 0;
+			m_end = 0;
+			m_good = false;
+
+			if (!m_buffer || m_buffer->size() < SERIALIZED_PREFIX_SIZE)
+				return;
+
+			uint64_t size;
+			m_buffer->read(size);
+			if (size > m_buffer->size() - SERIALIZED_PREFIX_SIZE)
+				return;
+
+			m_offset = SERIALIZED_PREFIX_SIZE;
+			m_end = SERIALIZED_PREFIX_SIZE + size;
+			m_good = true;
+		}
+
+	} // namespace net
+} // namespace EHSN
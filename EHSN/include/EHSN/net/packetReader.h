@@ -0,0 +1,191 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+#include "packetBuffer.h"
+#include "packetWriter.h"
+#include "secSocket.h"
+
+namespace EHSN {
+	namespace net {
+
+		/*
+		* Reads messages serialized by PacketWriter.
+		*
+		* Fields are decoded directly from the buffer; strings and spans can be accessed in place.
+		* Reading past the end of the message fails and marks the reader as not good.
+		*/
+		class PacketReader
+		{
+		public:
+			PacketReader() = default;
+			/*
+			* Constructor of PacketReader.
+			*
+			* @param buffer Buffer holding a message created by PacketWriter (e.g. the buffer of a pulled packet).
+			*/
+			PacketReader(PacketBufferRef buffer);
+		public:
+			/*
+			* Receive a message sent with PacketWriter::flush(SecSocket&).
+			*
+			* If false is returned, the socket should be disconnected, as the data stream cannot be continued.
+			*
+			* @param sock The socket to read from.
+			* @param maxSize Maximum number of field bytes accepted.
+			* @returns True if a message has been received. Otherwise false.
+			*/
+			bool recv(SecSocket& sock, uint64_t maxSize = 64_MB);
+		public:
+			/*
+			* Read a trivially copyable object.
+			*
+			* @param obj The object to write the data to.
+			* @returns True on success. Otherwise false.
+			*/
+			template <typename T>
+			bool read(T& obj);
+			/*
+			* Read raw bytes.
+			*
+			* @param dest Buffer to copy the bytes to.
+			* @param size Number of bytes to read.
+			* @returns True on success. Otherwise false.
+			*/
+			bool readBytes(void* dest, uint64_t size);
+			/*
+			* Read raw bytes in place.
+			*
+			* @param size Number of bytes to read.
+			* @returns Pointer to the bytes inside the buffer. Null on failure.
+			*/
+			const void* readBytesInPlace(uint64_t size);
+			/*
+			* Read an unsigned integer written by PacketWriter::writeVarint.
+			*
+			* @param value The variable to write the value to.
+			* @returns True on success. Otherwise false.
+			*/
+			bool readVarint(uint64_t& value);
+			/*
+			* Read a signed integer written by PacketWriter::writeSignedVarint.
+			*
+			* @param value The variable to write the value to.
+			* @returns True on success. Otherwise false.
+			*/
+			bool readSignedVarint(int64_t& value);
+			/*
+			* Read a string written by PacketWriter::writeString.
+			*
+			* @param str The string to write the value to.
+			* @returns True on success. Otherwise false.
+			*/
+			bool readString(std::string& str);
+			/*
+			* Read a string written by PacketWriter::writeString in place.
+			*
+			* The view is valid as long as the buffer of the reader exists.
+			*
+			* @param str The view to point to the string inside the buffer.
+			* @returns True on success. Otherwise false.
+			*/
+			bool readStringView(std::string_view& str);
+			/*
+			* Read an array written by PacketWriter::writeSpan in place.
+			*
+			* The pointer is valid as long as the buffer of the reader exists.
+			*
+			* @param data The pointer to point to the first element inside the buffer.
+			* @param count The variable to write the number of elements to.
+			* @returns True on success. Otherwise false.
+			*/
+			template <typename T>
+			bool readSpan(const T*& data, uint64_t& count);
+			/*
+			* Read a string or a trivially copyable object.
+			*/
+			template <typename T>
+			PacketReader& operator>>(T& obj);
+		public:
+			/*
+			* Check if every read so far succeeded.
+			*
+			* @returns True if no read failed. Otherwise false.
+			*/
+			bool good() const;
+			/*
+			* Get the number of unread field bytes.
+			*
+			* @returns Number of bytes left in the message.
+			*/
+			uint64_t remaining() const;
+		private:
+			/*
+			* Consume bytes of the message.
+			*
+			* @param size Number of bytes to consume.
+			* @returns Pointer to the consumed bytes. Null if the message is too short (marks the reader as not good).
+			*/
+			const uint8_t* take(uint64_t size);
+			/*
+			* Open a message stored in m_buffer.
+			*/
+			void open();
+		private:
+			PacketBufferRef m_buffer;
+			uint64_t m_offset = 0;
+			uint64_t m_end = 0;
+			bool m_good = false;
+		};
+
+		template <typename T>
+		inline bool PacketReader::read(T& obj)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "PacketReader::read requires a trivially copyable type!");
+			return readBytes(&obj, sizeof(T));
+		}
+
+		template <typename T>
+		inline bool PacketReader::readSpan(const T*& data, uint64_t& count)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "PacketReader::readSpan requires a trivially copyable type!");
+			data = nullptr;
+			count = 0;
+
+			uint64_t n;
+			if (!readVarint(n))
+				return false;
+
+			uint64_t padding = (alignof(T) - m_offset % alignof(T)) % alignof(T);
+			if (!take(padding))
+				return false;
+
+			if (n > remaining() / sizeof(T))
+			{
+				m_good = false;
+				return false;
+			}
+
+			data = (const T*)take(n * sizeof(T));
+			count = n;
+			return true;
+		}
+
+		template <typename T>
+		inline PacketReader& PacketReader::operator>>(T& obj)
+		{
+			if constexpr (std::is_same_v<T, std::string>)
+				readString(obj);
+			else if constexpr (std::is_same_v<T, std::string_view>)
+				readStringView(obj);
+			else
+				read(obj);
+			return *this;
+		}
+
+	} // namespace net
+} // namespace EHSN
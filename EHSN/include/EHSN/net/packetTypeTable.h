@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace EHSN {
+	namespace net {
+
+		/*
+		* Table with one entry per 16-bit packet type.
+		*
+		* The entries are stored in pages of 256 entries that get allocated on first access,
+		* so a table only costs memory for the ranges of packet types actually in use.
+		* Looking up or creating an entry is lock-free. Entries are never destroyed before the table.
+		* Synchronizing access to the entries themselves is up to the user.
+		*/
+		template <typename T>
+		class PacketTypeTable
+		{
+			static constexpr uint32_t PAGE_SIZE = 256;
+			static constexpr uint32_t N_PAGES = 65536 / PAGE_SIZE;
+			struct Page
+			{
+				T entries[PAGE_SIZE];
+			};
+		public:
+			PacketTypeTable();
+			PacketTypeTable(const PacketTypeTable&) = delete;
+			~PacketTypeTable();
+		public:
+			/*
+			* Get the entry of a packet type.
+			*
+			* Creates the page of the entry if it does not exist yet.
+			*
+			* @param packType The packet type.
+			* @returns The entry of the packet type.
+			*/
+			T& operator[](uint16_t packType);
+			/*
+			* Get the entry of a packet type without creating it.
+			*
+			* @param packType The packet type.
+			* @returns Pointer to the entry of the packet type. Null if the page of the entry has not been created yet.
+			*/
+			T* find(uint16_t packType) const;
+			/*
+			* Call a function for every entry in the created pages.
+			*
+			* @param func Function with the signature void(uint16_t packType, T& entry).
+			*/
+			template <typename Func>
+			void forEach(Func func) const;
+		private:
+			std::atomic<Page*> m_pages[N_PAGES];
+		};
+
+		template <typename T>
+		inline PacketTypeTable<T>::PacketTypeTable()
+		{
+			for (auto& page : m_pages)
+				page = nullptr;
+		}
+
+		template <typename T>
+		inline PacketTypeTable<T>::~PacketTypeTable()
+		{
+			for (auto& page : m_pages)
+				delete page.load();
+		}
+
+		template <typename T>
+		inline T& PacketTypeTable<T>::operator[](uint16_t packType)
+		{
+			auto& slot = m_pages[packType / PAGE_SIZE];
+
+			Page* page = slot.load(std::memory_order_acquire);
+			if (page == nullptr)
+			{
+				Page* newPage = new Page();
+				if (slot.compare_exchange_strong(page, newPage, std::memory_order_acq_rel, std::memory_order_acquire))
+					page = newPage;
+				else
+					delete newPage; // Another thread created the page first.
+			}
+
+			return page->entries[packType % PAGE_SIZE];
+		}
+
+		template <typename T>
+		inline T* PacketTypeTable<T>::find(uint16_t packType) const
+		{
+			Page* page = m_pages[packType / PAGE_SIZE].load(std::memory_order_acquire);
+			if (page == nullptr)
+				return nullptr;
+			return &page->entries[packType % PAGE_SIZE];
+		}
+
+		template <typename T>
+		template <typename Func>
+		inline void PacketTypeTable<T>::forEach(Func func) const
+		{
+			for (uint32_t i = 0; i < N_PAGES; ++i)
+			{
+				Page* page = m_pages[i].load(std::memory_order_acquire);
+				if (page == nullptr)
+					continue;
+
+				for (uint32_t j = 0; j < PAGE_SIZE; ++j)
+					func((uint16_t)(i * PAGE_SIZE + j), page->entries[j]);
+			}
+		}
+
+	} // namespace net
+} // namespace EHSN
\ No newline at end of file
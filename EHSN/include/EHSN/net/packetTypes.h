@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+namespace EHSN {
+	namespace net {
+
+		typedef uint16_t PacketType;
+		typedef uint8_t PacketFlags;
+		typedef uint32_t PacketID;
+
+		enum : PacketFlags
+		{
+			FLAG_PH_NONE = 0b00000000,
+			FLAG_PH_REMOVE_PREVIOUS = 0b00000001, // Older packets of the same type are removed from the receive queue. Queued packets that have not been encrypted yet are dropped on sender side as well.
+			FLAG_PH_SEND_IMMEDIATE = 0b00000010, // The packet is encrypted right away by a crypto thread (or the send thread) and sent before any other queued frame. Use for small latency critical packets only.
+			FLAG_PH_COMPRESSED = 0b00000100, // (Set internally) The payload has been compressed by the sender, see setCompression.
+			FLAG_PH_UNUSED_3 = 0b00001000,
+			FLAG_PH_UNUSED_4 = 0b00010000,
+			FLAG_PH_UNUSED_5 = 0b00100000,
+			FLAG_PH_UNUSED_6 = 0b01000000,
+			FLAG_PH_UNUSED_7 = 0b10000000,
+		};
+
+		enum : uint8_t
+		{
+			FRAME_FLAG_NONE = 0b00000000,
+			FRAME_FLAG_FRAGMENT = 0b00000001, // The frame holds the range [fragmentOffset, fragmentOffset + fragmentSize) of a bigger packet.
+		};
+
+		enum PacketPriority : uint8_t
+		{
+			PRIO_CONTROL = 0, // Keep-alives, pings and other latency critical control messages.
+			PRIO_HIGH,
+			PRIO_NORMAL,
+			PRIO_BULK, // Big transfers which may be delayed by all other packets.
+			PRIO_COUNT
+		};
+
+	} // namespace net
+} // namespace EHSN
@@ -0,0 +1,106 @@
+#include "packetWriter.h"
+
+#include <algorithm>
+
+#include "secSocket.h"
+#include "managedSocket.h"
+
+namespace EHSN {
+	namespace net {
+
+		PacketWriter::PacketWriter(uint64_t capacity)
+			: m_capacity(SERIALIZED_PREFIX_SIZE + std::max<uint64_t>(capacity, 1))
+		{
+			reset();
+		}
+
+		PacketWriter& PacketWriter::writeBytes(const void* data, uint64_t size)
+		{
+			if (size > 0)
+				memcpy(append(size), data, size);
+			return *this;
+		}
+
+		PacketWriter& PacketWriter::writeVarint(uint64_t value)
+		{
+			uint8_t bytes[10];
+			uint64_t n = 0;
+			do
+			{
+				uint8_t byte = value & 0x7F;
+				value >>= 7;
+				bytes[n++] = byte | (value ? 0x80 : 0x00);
+			} while (value);
+
+			return writeBytes(bytes, n);
+		}
+
+		PacketWriter& PacketWriter::writeSignedVarint(int64_t value)
+		{
+			return writeVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+		}
+
+		PacketWriter& PacketWriter::writeString(std::string_view str)
+		{
+			writeVarint(str.size());
+			return writeBytes(str.data(), str.size());
+		}
+
+		uint64_t PacketWriter::size() const
+		{
+			return m_offset - SERIALIZED_PREFIX_SIZE;
+		}
+
+		void PacketWriter::reset()
+		{
+			if (!m_buffer)
+				m_buffer = std::make_shared<PacketBuffer>(m_capacity);
+			m_offset = SERIALIZED_PREFIX_SIZE;
+		}
+
+		PacketBufferRef PacketWriter::finish()
+		{
+			uint64_t size = this->size();
+			m_buffer->write(size);
+			m_buffer->resize(m_offset);
+
+			auto buffer = m_buffer;
+			m_buffer.reset();
+			reset();
+			return buffer;
+		}
+
+		bool PacketWriter::flush(SecSocket& sock)
+		{
+			uint64_t nBytes = m_offset;
+			auto buffer = finish();
+
+			// The reserved size is a multiple of CHUNK_SIZE, so there is room for the AES padding.
+			return sock.writeSecure(buffer) >= nBytes;
+		}
+
+		PacketID PacketWriter::flush(ManagedSocket& queue, PacketType packetType, PacketFlags flags, PacketPriority priority)
+		{
+			return queue.push(packetType, flags, finish(), priority);
+		}
+
+		uint8_t* PacketWriter::append(uint64_t size)
+		{
+			uint64_t newOffset = m_offset + size;
+			if (newOffset > m_buffer->reserved())
+			{
+				// PacketBuffer::resize drops the content, so grow by copying into a new buffer.
+				auto newBuffer = std::make_shared<PacketBuffer>(std::max(newOffset, m_buffer->reserved() * 2));
+				memcpy(newBuffer->data(), m_buffer->data(), m_offset);
+				m_buffer = newBuffer;
+			}
+			if (newOffset > m_buffer->size())
+				m_buffer->resize(newOffset);
+
+			uint8_t* ptr = (uint8_t*)m_buffer->data() + m_offset;
+			m_offset = newOffset;
+			return ptr;
+		}
+
+	} // namespace net
+} // namespace EHSN
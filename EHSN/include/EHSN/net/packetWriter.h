@@ -0,0 +1,172 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+#include "packetBuffer.h"
+#include "packetTypes.h"
+
+namespace EHSN {
+	namespace net {
+
+		class SecSocket;
+		class ManagedSocket;
+
+		constexpr uint64_t SERIALIZED_PREFIX_SIZE = sizeof(uint64_t); // Every serialized message starts with the number of field bytes following it.
+
+		/*
+		* Serializes many small fields into a single PacketBuffer.
+		*
+		* The whole message gets encrypted and sent at once (flush), instead of one secure write per field.
+		* Layout: [uint64_t size][fields...]. Read it with PacketReader.
+		*/
+		class PacketWriter
+		{
+		public:
+			/*
+			* Constructor of PacketWriter.
+			*
+			* @param capacity Number of bytes to reserve for the fields. The buffer grows as needed.
+			*/
+			PacketWriter(uint64_t capacity = CHUNK_SIZE);
+		public:
+			/*
+			* Write a trivially copyable object.
+			*
+			* @param obj The object to write.
+			* @returns This writer.
+			*/
+			template <typename T>
+			PacketWriter& write(const T& obj);
+			/*
+			* Write raw bytes (without length).
+			*
+			* @param data Pointer to the data.
+			* @param size Number of bytes to write.
+			* @returns This writer.
+			*/
+			PacketWriter& writeBytes(const void* data, uint64_t size);
+			/*
+			* Write an unsigned integer in 1 to 10 bytes (LEB128).
+			*
+			* @param value The value to write.
+			* @returns This writer.
+			*/
+			PacketWriter& writeVarint(uint64_t value);
+			/*
+			* Write a signed integer in 1 to 10 bytes (zigzag + LEB128).
+			*
+			* @param value The value to write.
+			* @returns This writer.
+			*/
+			PacketWriter& writeSignedVarint(int64_t value);
+			/*
+			* Write a string prefixed with its length as varint.
+			*
+			* @param str The string to write.
+			* @returns This writer.
+			*/
+			PacketWriter& writeString(std::string_view str);
+			/*
+			* Write an array of trivially copyable objects prefixed with its element count as varint.
+			*
+			* The elements get aligned to alignof(T), so PacketReader can return them in place.
+			*
+			* @param data Pointer to the first element.
+			* @param count Number of elements.
+			* @returns This writer.
+			*/
+			template <typename T>
+			PacketWriter& writeSpan(const T* data, uint64_t count);
+			/*
+			* Write a string or a trivially copyable object.
+			*/
+			template <typename T>
+			PacketWriter& operator<<(const T& obj);
+		public:
+			/*
+			* Get the number of field bytes written so far.
+			*
+			* @returns Number of bytes written, without the size prefix.
+			*/
+			uint64_t size() const;
+			/*
+			* Discard everything written so far.
+			*/
+			void reset();
+			/*
+			* Finish the message.
+			*
+			* The writer starts a new message afterwards.
+			*
+			* @returns Buffer holding the serialized message, e.g. to push it to a ManagedSocket.
+			*/
+			PacketBufferRef finish();
+			/*
+			* Send the message with a single secure write.
+			*
+			* The writer starts a new message afterwards.
+			*
+			* @param sock The socket to write to.
+			* @returns True if the whole message has been written. Otherwise false.
+			*/
+			bool flush(SecSocket& sock);
+			/*
+			* Push the message as a single packet.
+			*
+			* The writer starts a new message afterwards.
+			*
+			* @param queue The socket to push the packet to.
+			* @param packetType Type of the packet.
+			* @param flags Flags of the packet.
+			* @param priority Priority of the packet.
+			* @returns ID of the pushed packet.
+			*/
+			PacketID flush(ManagedSocket& queue, PacketType packetType, PacketFlags flags = FLAG_PH_NONE, PacketPriority priority = PRIO_NORMAL);
+		private:
+			/*
+			* Make room for more bytes.
+			*
+			* @param size Number of bytes to append.
+			* @returns Pointer to where the bytes have to be written.
+			*/
+			uint8_t* append(uint64_t size);
+		private:
+			PacketBufferRef m_buffer;
+			uint64_t m_offset = SERIALIZED_PREFIX_SIZE;
+			uint64_t m_capacity = 0;
+		};
+
+		template <typename T>
+		inline PacketWriter& PacketWriter::write(const T& obj)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "PacketWriter::write requires a trivially copyable type!");
+			memcpy(append(sizeof(T)), &obj, sizeof(T));
+			return *this;
+		}
+
+		template <typename T>
+		inline PacketWriter& PacketWriter::writeSpan(const T* data, uint64_t count)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "PacketWriter::writeSpan requires a trivially copyable type!");
+			writeVarint(count);
+
+			uint64_t padding = (alignof(T) - m_offset % alignof(T)) % alignof(T);
+			memset(append(padding), 0, padding);
+			return writeBytes(data, count * sizeof(T));
+		}
+
+		template <typename T>
+		inline PacketWriter& PacketWriter::operator<<(const T& obj)
+		{
+			if constexpr (std::is_convertible_v<const T&, std::string_view>)
+				return writeString(obj);
+			else
+				return write(obj);
+		}
+
+	} // namespace net
+} // namespace EHSN
@@ -28,6 +28,18 @@ namespace EHSN {
 				uint64_t hostLocalTime;
 			};
 
+			struct RTTProbe
+			{
+				uint64_t tSent; // Local time of the prober when sending the probe (ns).
+			};
+			struct RTTProbeReply
+			{
+				uint64_t tSent; // Echoed from the probe.
+				uint64_t tRemote; // Local time of the replier when receiving the probe (ns).
+				float remoteReadSpeed; // Bytes per second the replier reads from the connection.
+				float remoteWriteSpeed; // Bytes per second the replier writes to the connection.
+			};
+
 			#pragma pack(pop)
 		} // namespace packets
 	} // namespace net
@@ -3,14 +3,46 @@
 namespace EHSN {
 	namespace net {
 
-		SecAcceptor::SecAcceptor(const std::string& port, SessionFunc sFunc, void* pParam, ExceptionCallback ecb, crypto::RandomDataGenerator rdg, int rsaKeySize)
-			: m_acceptor(IOContext::get(), tcp::endpoint(tcp::v4(), std::stoi(port))), m_sFunc(sFunc), m_pParam(pParam), m_ecb(ecb), m_rdg(rdg)
+		#ifdef SO_REUSEPORT
+		typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+		#endif
+
+		SecAcceptor::SecAcceptor(const std::string& port, SessionFunc sFunc, void* pParam, ExceptionCallback ecb, crypto::RandomDataGenerator rdg, int rsaKeySize, IOContextPoolRef ioPool, uint32_t nShards)
+			: m_ioPool(ioPool), m_sFunc(sFunc), m_pParam(pParam), m_ecb(ecb), m_rdg(rdg)
 		{
 			assert(m_sFunc != nullptr);
 
+		#ifndef SO_REUSEPORT
+			nShards = 1;
+		#endif
+			nShards = std::max(1u, nShards);
+
+			if (nShards > 1 && !m_ioPool)
+				m_ioPool = std::make_shared<IOContextPool>(nShards);
+
+			uint16_t portNum = (uint16_t)std::stoi(port);
+			for (uint32_t i = 0; i < nShards; ++i)
+			{
+				auto shard = std::make_shared<Shard>(m_ioPool ? m_ioPool->acquire() : IOContext::get());
+				openAcceptor(shard->acceptor, portNum, nShards > 1);
+				portNum = shard->acceptor.local_endpoint().port(); // Keep every shard on the same port when binding to port 0.
+				m_shards.push_back(shard);
+			}
+
 			m_rsaKeyPair = crypto::rsa::Key::generate(rsaKeySize);
 		}
 
+		SecAcceptor::~SecAcceptor()
+		{
+			stopShards();
+
+			if (m_ioPool)
+			{
+				for (auto& shard : m_shards)
+					m_ioPool->release(shard->ioContext);
+			}
+		}
+
 		void SecAcceptor::internalSessionFunc(SecSocketRef sock, const crypto::rsa::KeyPair& keyPair, SessionFunc sFunc, void* pParam, ExceptionCallback ecb)
 		{
 			const auto callEcb = [&ecb, &sock, pParam](std::exception& e)
@@ -106,19 +138,118 @@ namespace EHSN {
 			return true;
 		}
 
-		void SecAcceptor::newSession(bool noDelay, uint32_t nCryptThreads)
+		void SecAcceptor::newSession(bool noDelay, uint32_t nCryptThreads, uint32_t shard)
 		{
-			auto sock = std::make_shared<SecSocket>(crypto::defaultRDG, nCryptThreads);
-			m_acceptor.accept(sock->m_sock);
-			sock->m_sock.set_option(tcp::no_delay(noDelay));
-			sock->setConnected(true);
-			std::thread t(std::bind(internalSessionFunc, sock, m_rsaKeyPair, m_sFunc, (void*)m_pParam, m_ecb));
-			t.detach();
+			auto sock = std::make_shared<SecSocket>(crypto::defaultRDG, nCryptThreads, m_ioPool);
+			m_shards[shard % m_shards.size()]->acceptor.accept(sock->m_sock);
+			startSession(sock, noDelay);
+		}
+
+		void SecAcceptor::startShards(bool noDelay, uint32_t nCryptThreads)
+		{
+			if (!m_ioPool)
+				throw std::runtime_error("Running the shards requires an IOContextPool!");
+
+			{
+				std::unique_lock<std::mutex> lock(m_mtxShards);
+				if (m_nShardsRunning > 0)
+					return;
+				m_nShardsRunning = (uint32_t)m_shards.size();
+			}
+
+			for (auto& shard : m_shards)
+				asio::post(shard->ioContext, [this, shard, noDelay, nCryptThreads]() { asyncAccept(shard, noDelay, nCryptThreads); });
+		}
+
+		void SecAcceptor::stopShards()
+		{
+			for (auto& shard : m_shards)
+			{
+				if (m_ioPool)
+				{
+					asio::post(shard->ioContext, [shard]() { asio::error_code ec; shard->acceptor.close(ec); shard->retryTimer.cancel(); });
+				}
+				else
+				{
+					asio::error_code ec;
+					shard->acceptor.close(ec);
+					shard->retryTimer.cancel();
+				}
+			}
+
+			std::unique_lock<std::mutex> lock(m_mtxShards);
+			m_shardsStopped.wait(lock, [this]() { return m_nShardsRunning == 0; });
+		}
+
+		uint32_t SecAcceptor::nShards() const
+		{
+			return (uint32_t)m_shards.size();
 		}
 
 		uint16_t SecAcceptor::getPort() const
 		{
-			return m_acceptor.local_endpoint().port();
+			return m_shards[0]->acceptor.local_endpoint().port();
+		}
+
+		void SecAcceptor::openAcceptor(tcp::acceptor& acceptor, uint16_t port, bool reusePort)
+		{
+			tcp::endpoint endpoint(tcp::v4(), port);
+
+			acceptor.open(endpoint.protocol());
+			acceptor.set_option(tcp::acceptor::reuse_address(true));
+		#ifdef SO_REUSEPORT
+			if (reusePort)
+				acceptor.set_option(reuse_port(true));
+		#endif
+			acceptor.bind(endpoint);
+			acceptor.listen();
+		}
+
+		void SecAcceptor::asyncAccept(ShardRef shard, bool noDelay, uint32_t nCryptThreads)
+		{
+			auto sock = std::make_shared<SecSocket>(crypto::defaultRDG, nCryptThreads, m_ioPool);
+			shard->acceptor.async_accept(
+				sock->m_sock,
+				[this, shard, sock, noDelay, nCryptThreads](const asio::error_code& ec)
+				{
+					if (!shard->acceptor.is_open())
+					{
+						{
+							std::unique_lock<std::mutex> lock(m_mtxShards);
+							--m_nShardsRunning;
+						}
+						m_shardsStopped.notify_all();
+						return;
+					}
+
+					if (ec)
+					{
+						// Errors like EMFILE persist until resources get freed, so don't retry right away.
+						shard->retryTimer.expires_after(std::chrono::milliseconds(ACCEPT_RETRY_DELAY_MS));
+						shard->retryTimer.async_wait([this, shard, noDelay, nCryptThreads](const asio::error_code&) { asyncAccept(shard, noDelay, nCryptThreads); });
+						return;
+					}
+
+					try
+					{
+						startSession(sock, noDelay);
+					}
+					catch (asio::system_error&)
+					{
+						; // The client disconnected before the session could be started.
+					}
+
+					asyncAccept(shard, noDelay, nCryptThreads);
+				}
+			);
+		}
+
+		void SecAcceptor::startSession(SecSocketRef sock, bool noDelay)
+		{
+			sock->m_sock.set_option(tcp::no_delay(noDelay));
+			sock->setConnected(true);
+			std::thread t(std::bind(internalSessionFunc, sock, m_rsaKeyPair, m_sFunc, (void*)m_pParam, m_ecb));
+			t.detach();
 		}
 
 	} // namespace net
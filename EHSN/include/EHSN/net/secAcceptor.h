@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cstdint>
+#include <mutex>
+#include <condition_variable>
 
 #include "secSocket.h"
 #include "EHSN/crypto.h"
@@ -10,6 +12,7 @@ namespace EHSN {
 
 		constexpr uint32_t AES_KEY_SIZE = 32;
 		constexpr uint32_t AES_KEY_ECHO_SIZE = 64;
+		constexpr uint32_t ACCEPT_RETRY_DELAY_MS = 100; // Delay before a shard accepts again after accepting failed (e.g. out of file descriptors).
 
 		typedef void(*SessionFunc)(SecSocketRef sock, void* pParam);
 		typedef void(*ExceptionCallback)(std::exception& e, SecSocketRef, void* pParam);
@@ -26,9 +29,16 @@ namespace EHSN {
 			* @param ecb User defined exception callback for non-handled std::exception's in sFunc. May be NULL.
 			* @param rdg Random data generator used for generating the keys. (Currently unused)
 			* @param rsaKeySize Size of the RSA key to generate.
+			* @param ioPool Pool to acquire the io_contexts of the acceptor and the accepted sockets from. If null, the io_context of IOContext is used.
+			* @param nShards Number of listeners opened on the same port with SO_REUSEPORT. Values greater than 1 require an ioPool (one gets created if null). Falls back to 1 where SO_REUSEPORT is not available.
 			*/
-			SecAcceptor(const std::string& port, SessionFunc sFunc, void* pParam, ExceptionCallback ecb, crypto::RandomDataGenerator rdg = crypto::defaultRDG, int rsaKeySize = 4096);
-			~SecAcceptor() = default;
+			SecAcceptor(const std::string& port, SessionFunc sFunc, void* pParam, ExceptionCallback ecb, crypto::RandomDataGenerator rdg = crypto::defaultRDG, int rsaKeySize = 4096, IOContextPoolRef ioPool = nullptr, uint32_t nShards = 1);
+			/*
+			* Destructor of SecAcceptor.
+			*
+			* Stops the shards (if running) and releases the io_contexts acquired from the IOContextPool.
+			*/
+			~SecAcceptor();
 		public:
 			/*
 			* Create a new session.
@@ -38,8 +48,33 @@ namespace EHSN {
 			*
 			* @param noDelay If set to true latency may be improved, but bandwidth usage increased.
 			* @param nCryptThreads Number of threads used for en-/decryption per session/socket.
+			* @param shard Index of the listener to accept the connection from. Must not be used while the shards are running.
+			*/
+			void newSession(bool noDelay = false, uint32_t nCryptThreads = 0, uint32_t shard = 0);
+			/*
+			* Start accepting connections on every shard.
+			*
+			* Each shard accepts asynchronously on its own io_context and starts a new session for every client, like newSession does.
+			* The kernel spreads incoming connections over the shards.
+			* This function is non-blocking.
+			*
+			* @param noDelay If set to true latency may be improved, but bandwidth usage increased.
+			* @param nCryptThreads Number of threads used for en-/decryption per session/socket.
+			*/
+			void startShards(bool noDelay = false, uint32_t nCryptThreads = 0);
+			/*
+			* Stop accepting connections on every shard.
+			*
+			* Blocks until every shard has stopped. Running sessions are not affected.
+			* The acceptor can not be used anymore afterwards.
+			*/
+			void stopShards();
+			/*
+			* Get the number of listeners opened on the port.
+			*
+			* @returns Number of shards.
 			*/
-			void newSession(bool noDelay = false, uint32_t nCryptThreads = 0);
+			uint32_t nShards() const;
 			/*
 			* Get the port the acceptor is assigned to
 			* 
@@ -47,6 +82,41 @@ namespace EHSN {
 			*/
 			uint16_t getPort() const;
 		private:
+			struct Shard
+			{
+				Shard(asio::io_context& ioc) : ioContext(ioc), acceptor(ioc), retryTimer(ioc) {}
+			public:
+				asio::io_context& ioContext;
+				tcp::acceptor acceptor;
+				asio::steady_timer retryTimer; // Delays the next accept after an error.
+			};
+			typedef Ref<Shard> ShardRef;
+		private:
+			/*
+			* Open a listener on the port.
+			*
+			* @param acceptor The acceptor to open.
+			* @param port Port to bind the acceptor to.
+			* @param reusePort If set to true, SO_REUSEPORT gets set before binding.
+			*/
+			static void openAcceptor(tcp::acceptor& acceptor, uint16_t port, bool reusePort);
+			/*
+			* Accept the next connection on a shard asynchronously.
+			*
+			* Re-arms itself until the shard gets closed. After an error it waits ACCEPT_RETRY_DELAY_MS before accepting again.
+			*
+			* @param shard The shard to accept the connection on.
+			* @param noDelay If set to true latency may be improved, but bandwidth usage increased.
+			* @param nCryptThreads Number of threads used for en-/decryption per session/socket.
+			*/
+			void asyncAccept(ShardRef shard, bool noDelay, uint32_t nCryptThreads);
+			/*
+			* Start the session of an accepted socket in a separate thread.
+			*
+			* @param sock The accepted socket.
+			* @param noDelay If set to true latency may be improved, but bandwidth usage increased.
+			*/
+			void startSession(SecSocketRef sock, bool noDelay);
 			/*
 			* Run the session.
 			*
@@ -87,7 +157,11 @@ namespace EHSN {
 			*/
 			static bool escKeyExchange(SecSocketRef sock, const crypto::rsa::KeyPair& keyPair);
 		private:
-			tcp::acceptor m_acceptor;
+			IOContextPoolRef m_ioPool;
+			std::vector<ShardRef> m_shards;
+			std::mutex m_mtxShards;
+			std::condition_variable m_shardsStopped;
+			uint32_t m_nShardsRunning = 0;
 			SessionFunc m_sFunc;
 			void* m_pParam;
 			ExceptionCallback m_ecb;
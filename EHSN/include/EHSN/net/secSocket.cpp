@@ -2,22 +2,31 @@
 
 #include "EHSN/crypto/rsa.h"
 
+#include <array>
+
 namespace EHSN {
 	namespace net {
 
-		SecSocket::SecSocket(crypto::RandomDataGenerator rdg, uint32_t nCryptThreads)
-			: m_sock(IOContext::get()), m_rdg(rdg)
+		SecSocket::SecSocket(crypto::RandomDataGenerator rdg, uint32_t nCryptThreads, IOContextPoolRef ioPool)
+			: m_ioPool(ioPool), m_ioContext(ioPool ? ioPool->acquire() : IOContext::get()), m_sock(m_ioContext), m_recvBuffer(RECV_BUFFER_SIZE), m_rdg(rdg)
 		{
 			if (nCryptThreads > 0)
 				m_cryptData.threadPool = std::make_shared<ThreadPool>(nCryptThreads);
 		}
 
+		SecSocket::~SecSocket()
+		{
+			if (m_ioPool)
+				m_ioPool->release(m_ioContext);
+		}
+
 		bool SecSocket::connect(const std::string& host, const std::string& port, bool noDelay)
 		{
 			setConnected(false);
+			m_discardRecvBuffer = true; // Cleared by the reading thread, the staging buffer has a single reader.
 
 			// Resolve hostname
-			tcp::resolver resolver(IOContext::get());
+			tcp::resolver resolver(m_ioContext);
 			tcp::resolver::query query(tcp::v4(), host, port);
 			asio::error_code ec;
 			tcp::resolver::iterator iterator = resolver.resolve(query, ec);
@@ -39,6 +48,7 @@ namespace EHSN {
 			asio::error_code ec;
 			m_sock.shutdown(tcp::socket::shutdown_both, ec);
 			m_sock.close();
+			m_discardRecvBuffer = true; // Cleared by the reading thread, the staging buffer has a single reader.
 			setConnected(false);
 		}
 
@@ -52,14 +62,74 @@ namespace EHSN {
 			return !!m_cryptData.aesKey;
 		}
 
-		uint64_t SecSocket::readSecure(PacketBufferRef buffer)
+		uint64_t SecSocket::readSecure(PacketBufferRef buffer, bool measureTime)
 		{
-			return readSecure(buffer->data(), buffer->size());
+			return readSecure(buffer->data(), buffer->size(), measureTime);
+		}
+
+		uint64_t SecSocket::writeSecure(PacketChain& chain, bool measureTime)
+		{
+			// Segments do not start at block boundaries of the stream.
+			// Whole blocks get encrypted inside the segments, blocks spanning segments get stitched together in a separate buffer.
+			const auto& segments = chain.segments();
+			std::vector<uint8_t> stitched((segments.size() + 1) * AES_BLOCK_SIZE);
+			uint64_t nStitched = 0;
+			uint8_t* partial = nullptr; // Block currently being stitched.
+			uint64_t nPartial = 0;
+
+			std::vector<asio::const_buffer> buffers;
+			buffers.reserve(segments.size() * 3 + 1);
+
+			for (auto& seg : segments)
+			{
+				uint8_t* data = seg.data();
+				uint64_t size = seg.size();
+
+				if (nPartial > 0)
+				{
+					uint64_t n = std::min(AES_BLOCK_SIZE - nPartial, size);
+					memcpy(partial + nPartial, data, n);
+					nPartial += n;
+					data += n;
+					size -= n;
+					if (nPartial < AES_BLOCK_SIZE)
+						continue;
+
+					autoEncrypt(partial, AES_BLOCK_SIZE, partial, m_cryptData.aesKey, false);
+					buffers.push_back(asio::buffer(partial, AES_BLOCK_SIZE));
+					nPartial = 0;
+				}
+
+				uint64_t nWhole = size / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+				if (nWhole > 0)
+				{
+					autoEncrypt(data, nWhole, data, m_cryptData.aesKey, false);
+					buffers.push_back(asio::buffer(data, nWhole));
+				}
+
+				if (nWhole < size)
+				{
+					partial = stitched.data() + nStitched;
+					nStitched += AES_BLOCK_SIZE;
+					nPartial = size - nWhole;
+					memcpy(partial, data + nWhole, nPartial);
+				}
+			}
+
+			if (nPartial > 0)
+			{
+				autoEncrypt(partial, nPartial, partial, m_cryptData.aesKey, true);
+				buffers.push_back(asio::buffer(partial, AES_BLOCK_SIZE));
+			}
+
+			uint64_t nWritten = writeRaw(std::move(buffers), measureTime);
+
+			return std::min(chain.size(), nWritten);
 		}
 
-		uint64_t SecSocket::readSecure(void* buffer, uint64_t nBytes)
+		uint64_t SecSocket::readSecure(void* buffer, uint64_t nBytes, bool measureTime)
 		{
-			uint64_t nRead = readRaw(buffer, crypto::aes::paddedSize(nBytes));
+			uint64_t nRead = readRaw(buffer, crypto::aes::paddedSize(nBytes), measureTime);
 			if (nRead) autoDecrypt(buffer, nRead, buffer, m_cryptData.aesKey, true);
 
 			return std::min(nBytes, nRead);
@@ -111,30 +181,46 @@ namespace EHSN {
 			m_dataMetrics.setAvgReadSpeed(speed);
 		}
 
-		uint64_t SecSocket::readRaw(void* buffer, uint64_t nBytes)
+		uint64_t SecSocket::nBuffered() const
+		{
+			return m_discardRecvBuffer ? 0 : m_recvBuffer.nReadable();
+		}
+
+		uint64_t SecSocket::readRaw(void* buffer, uint64_t nBytes, bool measureTime)
 		{
 			asio::error_code ec;
 
-			constexpr uint64_t minToRead = 1_MB;
+			uint64_t tStart = measureTime ? CURR_TIME_NS() : 0;
+
+			if (m_discardRecvBuffer.exchange(false))
+				clearRecvBuffer();
 
-			uint64_t nRead = 0;
-			uint64_t nRemaining = nBytes;
+			uint64_t nRead = readBuffered(buffer, nBytes);
 			while (nRead < nBytes && !ec)
 			{
-				uint64_t nReadable = m_sock.available();
-
-				uint64_t currRead = m_sock.read_some(
-					asio::buffer(
-						(char*)buffer + nRead,
-						std::min(std::max(nReadable, minToRead), nRemaining)
-					),
-					ec
-				);
-				nRead += currRead;
-				nRemaining -= currRead;
-				m_dataMetrics.addReadOp(currRead);
+				uint64_t nRemaining = nBytes - nRead;
+				if (nRemaining >= RECV_DIRECT_SIZE)
+				{
+					uint64_t currRead = m_sock.read_some(
+						asio::buffer(
+							(char*)buffer + nRead,
+							nRemaining
+						),
+						ec
+					);
+					nRead += currRead;
+					m_dataMetrics.addReadOp(currRead);
+				}
+				else
+				{
+					fillRecvBuffer(ec);
+					nRead += readBuffered((char*)buffer + nRead, nRemaining);
+				}
 			}
 
+			if (measureTime)
+				m_dataMetrics.addReadLatency(CURR_TIME_NS() - tStart);
+
 			if (ec)
 				setConnected(false);
 
@@ -145,7 +231,7 @@ namespace EHSN {
 		{
 			asio::error_code ec;
 
-			uint64_t tStart = CURR_TIME_NS();
+			uint64_t tStart = measureTime ? CURR_TIME_NS() : 0;
 
 			uint64_t nWritten = 0;
 			while (nWritten < nBytes && !ec)
@@ -159,10 +245,46 @@ namespace EHSN {
 				);
 				nWritten += currWritten;
 				m_dataMetrics.addWriteOp(currWritten);
-				
 			}
 
-			uint64_t tStop = CURR_TIME_NS();
+			if (measureTime)
+				m_dataMetrics.addWriteLatency(CURR_TIME_NS() - tStart);
+
+			if (ec)
+				setConnected(false);
+
+			return nWritten;
+		}
+
+		uint64_t SecSocket::writeRaw(std::vector<asio::const_buffer> buffers, bool measureTime)
+		{
+			asio::error_code ec;
+
+			uint64_t tStart = measureTime ? CURR_TIME_NS() : 0;
+
+			uint64_t nBytes = asio::buffer_size(buffers);
+			uint64_t nWritten = 0;
+			while (nWritten < nBytes && !ec)
+			{
+				uint64_t currWritten = m_sock.write_some(buffers, ec);
+				nWritten += currWritten;
+				m_dataMetrics.addWriteOp(currWritten);
+
+				// Drop the buffers written completely and advance into the one written partially.
+				auto first = buffers.begin();
+				while (currWritten > 0 && first != buffers.end())
+				{
+					uint64_t n = std::min<uint64_t>(currWritten, first->size());
+					*first += n;
+					currWritten -= n;
+					if (first->size() == 0)
+						++first;
+				}
+				buffers.erase(buffers.begin(), first);
+			}
+
+			if (measureTime)
+				m_dataMetrics.addWriteLatency(CURR_TIME_NS() - tStart);
 
 			if (ec)
 				setConnected(false);
@@ -184,6 +306,38 @@ namespace EHSN {
 			return crypto::aes::decrypt(cipherData, nBytes, clearData, key, pad);
 		}
 
+		uint64_t SecSocket::readBuffered(void* buffer, uint64_t nBytes)
+		{
+			auto regions = m_recvBuffer.peekRead();
+
+			uint64_t nFirst = std::min<uint64_t>(regions.first.size, nBytes);
+			uint64_t nSecond = std::min<uint64_t>(regions.second.size, nBytes - nFirst);
+			memcpy(buffer, regions.first.data, nFirst);
+			memcpy((char*)buffer + nFirst, regions.second.data, nSecond);
+
+			m_recvBuffer.moveReadOffset(nFirst + nSecond);
+			return nFirst + nSecond;
+		}
+
+		void SecSocket::fillRecvBuffer(asio::error_code& ec)
+		{
+			auto regions = m_recvBuffer.peekWrite();
+
+			std::array<asio::mutable_buffer, 2> buffers = {
+				asio::buffer(regions.first.data, regions.first.size),
+				asio::buffer(regions.second.data, regions.second.size)
+			};
+
+			uint64_t currRead = m_sock.read_some(buffers, ec);
+			m_recvBuffer.moveWriteOffset(currRead);
+			m_dataMetrics.addReadOp(currRead);
+		}
+
+		void SecSocket::clearRecvBuffer()
+		{
+			m_recvBuffer.moveReadOffset(m_recvBuffer.nReadable());
+		}
+
 		void SecSocket::setConnected(bool state)
 		{
 			m_isConnected = state;
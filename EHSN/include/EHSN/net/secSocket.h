@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
 #include "EHSN/crypto.h"
 #include "EHSN/CircularBuffer.h"
@@ -9,45 +10,23 @@
 #include "ioContext.h"
 #include "packets.h"
 #include "packetBuffer.h"
+#include "packetChain.h"
+#include "dataMetrics.h"
 
 #define CURR_TIME_NS() std::chrono::time_point_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now()).time_since_epoch().count()
 
-constexpr uint64_t operator"" _B(uint64_t val) { return val; }
-constexpr uint64_t operator"" _KB(uint64_t val) { return val * 1000_B; }
-constexpr uint64_t operator"" _MB(uint64_t val) { return val * 1000_KB; }
-constexpr uint64_t operator"" _GB(uint64_t val) { return val * 1000_MB; }
+constexpr uint64_t operator"" _B(unsigned long long val) { return val; }
+constexpr uint64_t operator"" _KB(unsigned long long val) { return val * 1000_B; }
+constexpr uint64_t operator"" _MB(unsigned long long val) { return val * 1000_KB; }
+constexpr uint64_t operator"" _GB(unsigned long long val) { return val * 1000_MB; }
 
 #include <iostream>
 
 namespace EHSN {
 	namespace net {
 
-		class DataMetrics
-		{
-			struct SpeedPoint
-			{
-				SpeedPoint(float bps = 0.0f, uint64_t ts = 0)
-					: bytesPerSec(bps), tStart(ts)
-				{}
-			public:
-				float bytesPerSec = 0;
-				uint64_t tStart = 0;
-			};
-		public:
-			void reset() { m_nRead = 0; m_nWritten = 0; }
-			void addReadOp(uint64_t size) { m_nRead += size; ++m_nReadOps; }
-			void addWriteOp(uint64_t size) { m_nWritten += size; ++m_nWriteOps; }
-			uint64_t nRead() const { return m_nRead; };
-			uint64_t nWritten() const { return m_nWritten; };
-			void setAvgReadSpeed(float speed) { m_avgReadSpeed = speed; }
-			float avgReadSpeed() const { return m_avgReadSpeed; }
-		private:
-			uint64_t m_nRead = 0;
-			uint64_t m_nReadOps = 0;
-			uint64_t m_nWritten = 0;
-			uint64_t m_nWriteOps = 0;
-			float m_avgReadSpeed = 128.0f;
-		};
+		constexpr uint64_t RECV_BUFFER_SIZE = 256_KB; // Minimum size of the receive staging buffer (gets rounded up to the next power of two).
+		constexpr uint64_t RECV_DIRECT_SIZE = CHUNK_SIZE; // Reads of at least this size bypass the receive staging buffer once it is drained.
 
 		class SecSocket
 		{
@@ -58,9 +37,15 @@ namespace EHSN {
 			*
 			* @param rdg Random data generator used for generating the keys.
 			* @param nThreads Number of threads to use for en-/decryption. If 0, no separate threads will be used.
+			* @param ioPool Pool to acquire the io_context of the socket from. If null, the io_context of IOContext is used.
+			*/
+			SecSocket(crypto::RandomDataGenerator rdg, uint32_t nThreads, IOContextPoolRef ioPool = nullptr);
+			/*
+			* Destructor of SecSocket.
+			*
+			* Releases the io_context of the socket if it was acquired from an IOContextPool.
 			*/
-			SecSocket(crypto::RandomDataGenerator rdg, uint32_t nThreads);
-			~SecSocket() = default;
+			~SecSocket();
 		public:
 			/*
 			* Connect to a host.
@@ -101,15 +86,16 @@ namespace EHSN {
 			* @param buffer The buffer to write the decrypted data to.
 			* @returns Number of bytes read from the socket.
 			*/
-			uint64_t readSecure(PacketBufferRef buffer);
+			uint64_t readSecure(PacketBufferRef buffer, bool measureTime = true);
 			/*
 			* Read encrypted data from the socket and decrypt it.
 			*
 			* @param buffer The buffer to write the decrypted data to. Size must be a multiple of AES_BLOCK_SIZE!
 			* @param nBytes Number of bytes to read from the socket. Must be equal to nBytes of the writeSecure function call on the remote endpoint.
+			* @param measureTime Measure the time it takes to receive the data if set to true.
 			* @returns Number of bytes read from the socket.
 			*/
-			uint64_t readSecure(void* buffer, uint64_t nBytes);
+			uint64_t readSecure(void* buffer, uint64_t nBytes, bool measureTime = true);
 			/*
 			* Encrypt data in-place and write it to the socket.
 			*
@@ -132,6 +118,17 @@ namespace EHSN {
 			* @returns Number of bytes written to the socket.
 			*/
 			uint64_t writeSecure(void* buffer, uint64_t nBytes, bool measureTime = true);
+			/*
+			* Encrypt a chain in-place and write all of its segments with a single gather write.
+			*
+			* The data in the chain may be partially or fully changed.
+			* The remote endpoint reads it like a single buffer of chain.size() bytes.
+			*
+			* @param chain The chain to encrypt and write to the socket.
+			* @param measureTime Measure the time it takes to send the chain if set to true.
+			* @returns Number of bytes written to the socket.
+			*/
+			uint64_t writeSecure(PacketChain& chain, bool measureTime = true);
 		public:
 			/*
 			* Get the IP address of the remote endpoint.
@@ -161,15 +158,26 @@ namespace EHSN {
 			* @param speed The average read speed of the socket.
 			*/
 			void setAvgReadSpeed(float speed);
+			/*
+			* Get the number of bytes received from the kernel that have not been read yet.
+			*
+			* @returns Number of bytes in the receive staging buffer.
+			*/
+			uint64_t nBuffered() const;
 		public:
 			/*
 			* Read raw data from the socket.
 			*
+			* Small reads are served from a staging buffer that gets filled with as much data as the kernel has available,
+			* so consecutive small reads (e.g. packet headers and payloads) cost one system call.
+			* Reads of at least RECV_DIRECT_SIZE bytes go straight to the caller's buffer once the staging buffer is drained.
+			*
 			* @param buffer Buffer to write the raw data to.
 			* @param nBytes Number of bytes to read from the socket.
+			* @param measureTime Measure the time it takes to receive the data if set to true. Includes the time spent waiting for the data to arrive.
 			* @returns Number of bytes read from the socket.
 			*/
-			uint64_t readRaw(void* buffer, uint64_t nBytes);
+			uint64_t readRaw(void* buffer, uint64_t nBytes, bool measureTime = true);
 			/*
 			* Write raw data to the socket.
 			*
@@ -179,6 +187,14 @@ namespace EHSN {
 			* @returns Number of bytes written to the socket.
 			*/
 			uint64_t writeRaw(const void* buffer, uint64_t nBytes, bool measureTime = true);
+			/*
+			* Write raw data from several buffers to the socket (gather write).
+			*
+			* @param buffers Buffers to read the data from, in order.
+			* @param measureTime Measure the time it takes to send the buffers if set to true.
+			* @returns Number of bytes written to the socket.
+			*/
+			uint64_t writeRaw(std::vector<asio::const_buffer> buffers, bool measureTime = true);
 		protected:
 			/*
 			* Encrypt nBytes of data.
@@ -205,6 +221,28 @@ namespace EHSN {
 			*/
 			uint64_t autoDecrypt(const void* cipherData, uint64_t nBytes, void* clearData, crypto::aes::KeyRef key, bool pad);
 		private:
+			/*
+			* Copy data from the receive staging buffer.
+			*
+			* @param buffer Buffer to write the data to.
+			* @param nBytes Maximum number of bytes to copy.
+			* @returns Number of bytes copied.
+			*/
+			uint64_t readBuffered(void* buffer, uint64_t nBytes);
+			/*
+			* Fill the receive staging buffer with a single read from the socket.
+			*
+			* Blocks until at least one byte is available.
+			*
+			* @param ec Error code of the read operation.
+			*/
+			void fillRecvBuffer(asio::error_code& ec);
+			/*
+			* Discard all data in the receive staging buffer.
+			*
+			* Must only be called by the reading thread. Other threads set m_discardRecvBuffer instead.
+			*/
+			void clearRecvBuffer();
 			/*
 			* Set the internal connected state.
 			*
@@ -243,7 +281,11 @@ namespace EHSN {
 			*/
 			bool escKeyExchange(uint32_t aesKeySize, uint32_t aesKeyEchoSize);
 		private:
+			IOContextPoolRef m_ioPool;
+			asio::io_context& m_ioContext;
 			tcp::socket m_sock;
+			CircularBuffer m_recvBuffer;
+			std::atomic_bool m_discardRecvBuffer = false; // Set by connect/disconnect, the next read discards the data of the old connection.
 			bool m_isConnected = false;
 			struct CryptData
 			{
@@ -256,6 +298,7 @@ namespace EHSN {
 			crypto::RandomDataGenerator m_rdg;
 		private:
 			friend class SecAcceptor;
+			friend class ManagedSocket; // Encrypts frames separately from writing them (see ManagedSocket::sendFrame).
 		};
 
 		typedef Ref<SecSocket> SecSocketRef;
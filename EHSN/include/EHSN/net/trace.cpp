@@ -0,0 +1,168 @@
+#include "trace.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define EHSN_TRACE_TSC() __rdtsc()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define EHSN_TRACE_TSC() __rdtsc()
+#endif
+
+#include "secSocket.h"
+
+namespace EHSN {
+	namespace net {
+		namespace trace {
+
+			struct Event
+			{
+				const char* name = nullptr;
+				uint64_t packetID = 0;
+				uint64_t tStart = 0;
+				uint64_t tEnd = 0;
+			};
+
+			/*
+			* Events of a single thread.
+			*
+			* Only the owning thread writes the events and nRecorded, so recording needs no locking.
+			* clear() only moves nCleared, events before it are not exported anymore.
+			*/
+			struct ThreadBuffer
+			{
+				uint32_t threadID = 0;
+				std::atomic<uint64_t> nRecorded = 0;
+				std::atomic<uint64_t> nCleared = 0;
+				std::vector<Event> events = std::vector<Event>(BUFFER_SIZE);
+			};
+
+			/*
+			* Reference point for converting ticks to wall-clock time.
+			*/
+			struct Calibration
+			{
+				uint64_t tick0 = ticks();
+				uint64_t ns0 = CURR_TIME_NS();
+			};
+
+			static std::mutex s_mtxBuffers;
+			static std::vector<std::shared_ptr<ThreadBuffer>> s_buffers; // Kept after the threads exit, so their events can still be exported.
+			static Calibration s_calibration;
+
+			static ThreadBuffer& threadBuffer()
+			{
+				thread_local std::shared_ptr<ThreadBuffer> t_buffer;
+				if (!t_buffer)
+				{
+					t_buffer = std::make_shared<ThreadBuffer>();
+
+					std::unique_lock<std::mutex> lock(s_mtxBuffers);
+					t_buffer->threadID = (uint32_t)s_buffers.size() + 1;
+					s_buffers.push_back(t_buffer);
+				}
+				return *t_buffer;
+			}
+
+			uint64_t ticks()
+			{
+			#ifdef EHSN_TRACE_TSC
+				return EHSN_TRACE_TSC();
+			#else
+				return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			#endif
+			}
+
+			void record(const char* name, uint64_t packetID, uint64_t tStart, uint64_t tEnd)
+			{
+				auto& buffer = threadBuffer();
+
+				uint64_t index = buffer.nRecorded.load(std::memory_order_relaxed);
+				auto& event = buffer.events[index % BUFFER_SIZE];
+				event.name = name;
+				event.packetID = packetID;
+				event.tStart = tStart;
+				event.tEnd = tEnd;
+				buffer.nRecorded.store(index + 1, std::memory_order_release);
+			}
+
+			bool isEnabled()
+			{
+			#ifdef EHSN_ENABLE_TRACING
+				return true;
+			#else
+				return false;
+			#endif
+			}
+
+			std::string toChromeJSON(int64_t clockOffset, uint32_t pid)
+			{
+				// Measure the tick rate over the whole time since the calibration point.
+				uint64_t tick1 = ticks();
+				uint64_t ns1 = CURR_TIME_NS();
+				double ticksPerNs = 1.0;
+				if (ns1 > s_calibration.ns0 && tick1 > s_calibration.tick0)
+					ticksPerNs = (double)(tick1 - s_calibration.tick0) / (double)(ns1 - s_calibration.ns0);
+
+				const auto toUs = [&](uint64_t tick) -> double
+				{
+					double ns = (double)s_calibration.ns0 + ((double)tick - (double)s_calibration.tick0) / ticksPerNs + (double)clockOffset;
+					return ns / 1000.0;
+				};
+
+				std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+				{
+					std::unique_lock<std::mutex> lock(s_mtxBuffers);
+					buffers = s_buffers;
+				}
+
+				std::ostringstream ss;
+				ss.precision(3);
+				ss << std::fixed;
+				ss << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+				bool first = true;
+				for (auto& buffer : buffers)
+				{
+					uint64_t nRecorded = buffer->nRecorded.load(std::memory_order_acquire);
+					uint64_t begin = std::max(nRecorded - std::min(nRecorded, BUFFER_SIZE), buffer->nCleared.load(std::memory_order_relaxed));
+					for (uint64_t i = begin; i < nRecorded; ++i)
+					{
+						auto& event = buffer->events[i % BUFFER_SIZE];
+						if (!event.name)
+							continue;
+
+						if (!first)
+							ss << ",";
+						first = false;
+
+						double ts = toUs(event.tStart);
+						double dur = std::max(0.0, toUs(event.tEnd) - ts);
+						ss << "{\"name\":\"" << event.name << "\",\"cat\":\"ehsn\",\"ph\":\"X\""
+							<< ",\"ts\":" << ts << ",\"dur\":" << dur
+							<< ",\"pid\":" << pid << ",\"tid\":" << buffer->threadID
+							<< ",\"args\":{\"packetID\":" << event.packetID << "}}";
+					}
+				}
+
+				ss << "]}";
+				return ss.str();
+			}
+
+			void clear()
+			{
+				std::unique_lock<std::mutex> lock(s_mtxBuffers);
+				for (auto& buffer : s_buffers)
+					buffer->nCleared = buffer->nRecorded.load(std::memory_order_acquire);
+			}
+
+		} // namespace trace
+	} // namespace net
+} // namespace EHSN
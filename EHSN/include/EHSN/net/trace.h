@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+/*
+* Pipeline tracing.
+*
+* Spans are only recorded when EHSN was built with EHSN_ENABLE_TRACING (CMake option of the same name).
+* Otherwise the macros compile to nothing and the dump contains no events.
+*/
+#ifdef EHSN_ENABLE_TRACING
+#define EHSN_TRACE_SPAN(var, name, packetID) ::EHSN::net::trace::Span var(name, packetID)
+#define EHSN_TRACE_SET_ID(var, packetID) var.setPacketID(packetID)
+#else
+#define EHSN_TRACE_SPAN(var, name, packetID) ((void)0)
+#define EHSN_TRACE_SET_ID(var, packetID) ((void)0)
+#endif
+
+namespace EHSN {
+	namespace net {
+		namespace trace {
+
+			constexpr uint64_t BUFFER_SIZE = 1 << 16; // Number of events kept per thread. Older events get overwritten.
+
+			/*
+			* Get the current timestamp in ticks.
+			*
+			* Uses the TSC where available, the steady clock otherwise.
+			*
+			* @returns Current timestamp in ticks.
+			*/
+			uint64_t ticks();
+			/*
+			* Record a finished span in the buffer of the calling thread.
+			*
+			* Lock-free, except for the first event of a thread (registers the thread's buffer).
+			*
+			* @param name Name of the span. Must be a string literal (only the pointer is stored).
+			* @param packetID ID of the packet the span belongs to.
+			* @param tStart Start of the span in ticks.
+			* @param tEnd End of the span in ticks.
+			*/
+			void record(const char* name, uint64_t packetID, uint64_t tStart, uint64_t tEnd);
+			/*
+			* Check if EHSN was built with tracing.
+			*
+			* @returns True if spans get recorded. Otherwise false.
+			*/
+			bool isEnabled();
+			/*
+			* Export the recorded spans in the Chrome trace event format (chrome://tracing, Perfetto).
+			*
+			* Timestamps are converted to wall-clock time, so traces of both peers can be loaded together.
+			* For an exact match pass the clockOffset of ManagedSocket::getLinkStats, which shifts
+			* the timestamps to the clock of the remote peer.
+			*
+			* Must be called while the traced sockets are idle (no packets being sent or received).
+			* The events are read without synchronization, so spans recorded during the export may be torn.
+			*
+			* @param clockOffset Offset in nanoseconds added to every timestamp.
+			* @param pid Process ID written to the events. Use different values for different peers.
+			* @returns The trace as JSON.
+			*/
+			std::string toChromeJSON(int64_t clockOffset = 0, uint32_t pid = 0);
+			/*
+			* Remove all recorded spans.
+			*
+			* Can be called while spans are being recorded. Spans recorded concurrently may or may not be removed.
+			*/
+			void clear();
+
+			/*
+			* Records a span from its construction to its destruction.
+			*/
+			class Span
+			{
+			public:
+				Span(const char* name, uint64_t packetID)
+					: m_name(name), m_packetID(packetID), m_tStart(ticks())
+				{}
+				Span(const Span&) = delete;
+				~Span() { record(m_name, m_packetID, m_tStart, ticks()); }
+			public:
+				void setPacketID(uint64_t packetID) { m_packetID = packetID; }
+			private:
+				const char* m_name;
+				uint64_t m_packetID;
+				uint64_t m_tStart;
+			};
+
+		} // namespace trace
+	} // namespace net
+} // namespace EHSN
@@ -1,6 +1,7 @@
 #include "EHSN.h"
 
 #include <iostream>
+#include <fstream>
 
 #define CLIENT_THREADS_PER_SOCKET 4
 #define SERVER_THREADS_PER_SOCKET 4
@@ -58,38 +59,94 @@ std::vector<std::string> splitCommand(const std::string& command) {
 
 enum CUSTOM_PACKET_TYPES : EHSN::net::PacketType {
 	CPT_RAW_DATA = EHSN::net::SPT_FIRST_FREE_PACKET_TYPE,
+	CPT_MESSAGE,
+	CPT_QUOTE,
 };
 
+enum QUOTE_FIELDS {
+	QUOTE_TIME,
+	QUOTE_PRICE,
+	QUOTE_QTY,
+};
+typedef EHSN::net::MessageView<EHSN::net::MessageSchema<uint64_t, double, uint32_t>, char> QuoteView; // Tail holds the symbol.
+
 void sessionFunc(EHSN::net::SecSocketRef sock, void* pParam) {
 	EHSN::net::ManagedSocket queue(sock, SERVER_THREADS_PER_SOCKET);
 
-	queue.setRecvCallback(
+	queue.setRecvHandler(
 		EHSN::net::SPT_PING,
-		[](EHSN::net::Packet pack, uint64_t nBytesReceived, void* pParam)
+		[&queue](EHSN::net::Packet pack, uint64_t nBytesReceived)
 		{
 			if (nBytesReceived < pack.header.packetSize)
 				return;
 
 			std::cout << "    Got ping request!" << std::endl;
-			auto& queue = *(EHSN::net::ManagedSocket*)pParam;
 			pack.header.packetType = EHSN::net::SPT_PING_REPLY;
-			queue.push(pack);
-		},
-		&queue
-			);
+			queue.push(pack, EHSN::net::PRIO_CONTROL);
+		}
+	);
+	queue.setDispatchPolicy(EHSN::net::SPT_PING, EHSN::net::DISPATCH_INLINE); // Reply straight from the receiving thread.
 
-	queue.setRecvCallback(
+	queue.setStreamCallback(
 		CPT_RAW_DATA,
-		[](EHSN::net::Packet pack, uint64_t nBytesReceived, void* pParam)
+		[](const EHSN::net::PacketHeader& header, EHSN::net::PacketBufferRef chunk, uint64_t offset, bool isLast, void*)
 		{
-			if (nBytesReceived < pack.header.packetSize)
+			if (!isLast)
+				return;
+			if (offset + (chunk ? chunk->size() : 0) < header.packetSize)
 				return;
 
 			std::cout << "    Got raw data!" << std::endl;
 		},
 		nullptr
 			);
+
+	queue.setRecvHandler(
+		CPT_MESSAGE,
+		[](EHSN::net::Packet pack, uint64_t nBytesReceived)
+		{
+			if (nBytesReceived < pack.header.packetSize)
+				return;
+
+			EHSN::net::PacketReader reader(pack.buffer);
+			int64_t timestamp;
+			std::string_view text;
+			const uint32_t* codes;
+			uint64_t nCodes;
+			reader.readSignedVarint(timestamp);
+			reader.readStringView(text);
+			reader.readSpan(codes, nCodes);
+			if (!reader.good())
+			{
+				std::cout << "    Got malformed message!" << std::endl;
+				return;
+			}
+
+			uint32_t checksum = 0;
+			for (uint64_t i = 0; i < nCodes; ++i)
+				checksum += codes[i];
+			std::cout << "    Got message '" << text << "' (" << nCodes << " codes, checksum " << checksum << ", sent " << (int64_t)CURR_TIME_NS() - timestamp << " ns ago)" << std::endl;
+		}
+	);
 	
+	queue.setRecvHandler(
+		CPT_QUOTE,
+		[](EHSN::net::Packet pack, uint64_t nBytesReceived)
+		{
+			if (nBytesReceived < pack.header.packetSize)
+				return;
+
+			QuoteView quote(pack.buffer);
+			if (!quote)
+			{
+				std::cout << "    Got malformed quote!" << std::endl;
+				return;
+			}
+
+			std::cout << "    Got quote " << std::string_view(quote.tail(), quote.tailCount()) << ": " << quote.get<QUOTE_QTY>() << " @ " << quote.get<QUOTE_PRICE>() << " (sent " << CURR_TIME_NS() - quote.get<QUOTE_TIME>() << " ns ago)" << std::endl;
+		}
+	);
+
 	uint64_t nWrittenLast = 0;
 	uint64_t nReadLast = 0;
 	bool sentAliveRequest = false;
@@ -156,7 +213,8 @@ int main(int argc, const char* argv[], const char* env[]) {
 	if (runServer)
 	{
 		std::cout << "Creating secAcceptor..." << std::endl;
-		EHSN::net::SecAcceptor acceptor("10000", sessionFunc, nullptr, nullptr);
+		auto ioPool = std::make_shared<EHSN::net::IOContextPool>(0, true, EHSN::net::IO_ASSIGN_LEAST_LOADED);
+		EHSN::net::SecAcceptor acceptor("10000", sessionFunc, nullptr, nullptr, EHSN::crypto::defaultRDG, 4096, ioPool);
 		while (true)
 		{
 			std::cout << "Waiting for connection..." << std::endl;
@@ -171,6 +229,7 @@ int main(int argc, const char* argv[], const char* env[]) {
 	std::string port = "10000";
 
 	EHSN::net::ManagedSocket queue(std::make_shared<EHSN::net::SecSocket>(EHSN::crypto::defaultRDG, 0), CLIENT_THREADS_PER_SOCKET);
+	queue.startProbing(500);
 
 	while (true)
 	{
@@ -220,6 +279,20 @@ int main(int argc, const char* argv[], const char* env[]) {
 				std::cout << "   Set noDelay to: " << (noDelay ? "on" : "off") << std::endl;
 			}
 		}
+		else if (*it == "compression")
+		{
+			++it;
+			if (it == cmdParts.end())
+				std::cout << "   Missing arguments!" << std::endl;
+			else
+			{
+				bool enable = *it == "on";
+				if (queue.setCompression(enable ? EHSN::net::compression::fastestCodec() : EHSN::net::compression::CODEC_NONE) && enable)
+					std::cout << "   Set compression to: on" << std::endl;
+				else
+					std::cout << "   Set compression to: off" << std::endl;
+			}
+		}
 		else if (*it == "connect")
 		{
 			std::cout << "   Connecting to: " << host << ":" << port << "..." << std::endl;
@@ -262,13 +335,20 @@ int main(int argc, const char* argv[], const char* env[]) {
 
 				uint64_t begin = CURR_TIME_NS();
 
-				EHSN::net::PacketID lastPacketID;
 				for (uint64_t i = 0; i < nPackets; ++i)
 					queue.push(CPT_RAW_DATA, EHSN::net::FLAG_PH_NONE, buffers[i]);
-				{
+
+				uint64_t pingTime;
+				{ // Control ping, overtakes the data
 					auto pingBuffer = std::make_shared<EHSN::net::PacketBuffer>(sizeof(uint64_t));
 					uint64_t start = CURR_TIME_NS();
 					pingBuffer->write(start);
+					queue.push(EHSN::net::SPT_PING, EHSN::net::FLAG_PH_SEND_IMMEDIATE, pingBuffer);
+					queue.pull(EHSN::net::SPT_PING_REPLY);
+					pingTime = CURR_TIME_NS() - start;
+				}
+				{ // Ping with the same priority as the data, gets replied after all data has been received
+					auto pingBuffer = std::make_shared<EHSN::net::PacketBuffer>(sizeof(uint64_t));
 					queue.push(EHSN::net::SPT_PING, EHSN::net::FLAG_PH_NONE, pingBuffer);
 					queue.pull(EHSN::net::SPT_PING_REPLY);
 				}
@@ -288,6 +368,7 @@ int main(int argc, const char* argv[], const char* env[]) {
 				std::cout << "   Time:            " << timeInSec << " sec" << std::endl;
 				std::cout << "   Time per packet: " << secPerPacket << " sec" << std::endl;
 				std::cout << "   Data/Time:       " << dataPerSec << " Mbps" << std::endl;
+				std::cout << "   Ping during transfer: " << (pingTime / 1000) << " us" << std::endl;
 			}
 			else if (*it == "ping")
 			{
@@ -329,8 +410,7 @@ int main(int argc, const char* argv[], const char* env[]) {
 					auto buffer  = std::make_shared<EHSN::net::PacketBuffer>(sizeof(uint64_t));
 					uint64_t start = CURR_TIME_NS();
 					buffer->write(start);
-					queue.push(EHSN::net::SPT_PING, EHSN::net::FLAG_PH_NONE, buffer);
-					EHSN::net::PacketHeader header;
+					queue.push(EHSN::net::SPT_PING, EHSN::net::FLAG_PH_NONE, buffer, EHSN::net::PRIO_CONTROL);
 
 					std::unique_lock<std::mutex> lock(st.mtx);
 					st.conVar.wait(lock, [&st] { return st.gotPing; });
@@ -357,8 +437,87 @@ int main(int argc, const char* argv[], const char* env[]) {
 		else if (*it == "metrics")
 		{
 			auto& metrics = queue.getSock()->getDataMetrics();
+			++it;
+			if (it != cmdParts.end() && *it == "prometheus")
+			{
+				std::cout << metrics.toPrometheus();
+				continue;
+			}
+			if (it != cmdParts.end() && *it == "json")
+			{
+				std::cout << metrics.toJSON() << std::endl;
+				continue;
+			}
+
 			std::cout << "   Read:    " << metrics.nRead() << " bytes" << std::endl;
 			std::cout << "   Written: " << metrics.nWritten() << " bytes" << std::endl;
+
+			auto writeLatency = metrics.writeLatency().summary();
+			std::cout << "   Write latency: p50 " << writeLatency.p50 / 1000 << " us, p99 " << writeLatency.p99 / 1000 << " us, p999 " << writeLatency.p999 / 1000 << " us, max " << writeLatency.max / 1000 << " us" << std::endl;
+
+			auto compression = queue.getCompressionMetrics();
+			std::cout << "   Compressed packets: " << compression.nPacketsCompressed << " (ratio " << compression.ratio() << ")" << std::endl;
+
+			auto link = queue.getLinkStats();
+			std::cout << "   RTT:     " << link.srtt << " us (min " << link.minRTT << ", var " << link.rttVar << ", " << link.nSamples << " samples)" << std::endl;
+			std::cout << "   Speed:   " << link.readSpeed << " B/s read, " << link.writeSpeed << " B/s written" << std::endl;
+		}
+		else if (*it == "trace")
+		{
+			++it;
+			if (it == cmdParts.end())
+			{
+				std::cout << "   Missing filename!" << std::endl;
+				continue;
+			}
+
+			if (!EHSN::net::trace::isEnabled())
+				std::cout << "   EHSN was built without EHSN_ENABLE_TRACING, the trace will be empty." << std::endl;
+
+			std::ofstream file(*it);
+			file << EHSN::net::trace::toChromeJSON(0, 1);
+			std::cout << "   Trace written to " << *it << std::endl;
+		}
+		else if (*it == "typestats")
+		{
+			for (auto& [pType, stats] : queue.getTypeStats())
+			{
+				std::cout << "   Type " << pType << ":" << std::endl;
+				std::cout << "     Sent:     " << stats.nPacketsSent << " packets, " << stats.nBytesSent << " bytes, queued " << stats.avgSendQueueTime() / 1000 << " us avg, encrypt " << stats.encryptTime / 1000 << " us total" << std::endl;
+				std::cout << "     Received: " << stats.nPacketsReceived << " packets, " << stats.nBytesReceived << " bytes, delivered after " << stats.avgDeliverTime() / 1000 << " us avg" << std::endl;
+			}
+		}
+		else if (*it == "message")
+		{
+			++it;
+			std::string text;
+			for (; it != cmdParts.end(); ++it)
+				text += (text.empty() ? "" : " ") + *it;
+
+			std::vector<uint32_t> codes(text.begin(), text.end());
+
+			EHSN::net::PacketWriter writer;
+			writer.writeSignedVarint(CURR_TIME_NS());
+			writer.writeString(text);
+			writer.writeSpan(codes.data(), codes.size());
+			std::cout << "   Sending " << writer.size() << " bytes as a single packet." << std::endl;
+			writer.flush(queue, CPT_MESSAGE);
+		}
+		else if (*it == "quote")
+		{
+			if (cmdParts.size() < 4)
+			{
+				std::cout << "   Usage: quote <symbol> <price> <quantity>" << std::endl;
+				continue;
+			}
+
+			const std::string& symbol = cmdParts[1];
+			auto quote = QuoteView::create(symbol.size());
+			quote.set<QUOTE_PRICE>(std::strtod(cmdParts[2].c_str(), nullptr));
+			quote.set<QUOTE_QTY>((uint32_t)std::strtoul(cmdParts[3].c_str(), nullptr, 10));
+			memcpy(quote.tail(), symbol.data(), symbol.size());
+			quote.set<QUOTE_TIME>(CURR_TIME_NS());
+			queue.push(CPT_QUOTE, EHSN::net::FLAG_PH_NONE, quote.buffer());
 		}
 		else if (*it == "resetMetrics")
 		{
@@ -0,0 +1,156 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType TEST_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE;
+constexpr uint32_t N_SOCKETS = 3;
+
+/*
+* Connected ManagedSockets, the senders broadcast to their receivers.
+*/
+struct Sessions
+{
+	std::vector<SocketPair> pairs;
+	std::vector<std::unique_ptr<ManagedSocket>> senders;
+	std::vector<std::unique_ptr<ManagedSocket>> receivers;
+public:
+	Sessions(uint32_t nThreads)
+	{
+		for (uint32_t i = 0; i < N_SOCKETS; ++i)
+		{
+			pairs.push_back(makeSocketPair());
+			if (!pairs.back().server)
+				return;
+			senders.push_back(std::make_unique<ManagedSocket>(pairs.back().server, nThreads));
+			receivers.push_back(std::make_unique<ManagedSocket>(pairs.back().client, nThreads));
+		}
+	}
+	~Sessions()
+	{
+		for (auto& pair : pairs)
+		{
+			if (pair.client)
+				pair.client->disconnect();
+		}
+	}
+	bool isValid() const { return senders.size() == N_SOCKETS; }
+	std::vector<ManagedSocket*> senderPtrs() const
+	{
+		std::vector<ManagedSocket*> ptrs;
+		for (auto& sender : senders)
+			ptrs.push_back(sender.get());
+		return ptrs;
+	}
+};
+
+/*
+* Every socket receives the payload, encrypted with its own key, and the source buffer stays unchanged.
+*/
+static void testDelivery(uint32_t nThreads)
+{
+	Sessions sessions(nThreads);
+	CHECK(sessions.isValid());
+	if (!sessions.isValid())
+		return;
+
+	for (uint64_t size : { (uint64_t)0, (uint64_t)45, 2 * FRAGMENT_SIZE + 3 })
+	{
+		auto data = makeTestData(size, (uint32_t)size, false);
+		PacketBufferRef buffer;
+		if (size > 0)
+		{
+			buffer = std::make_shared<PacketBuffer>(size);
+			buffer->write(data.data(), size);
+		}
+
+		for (PacketFlags flags : { FLAG_PH_NONE, FLAG_PH_SEND_IMMEDIATE })
+		{
+			auto handles = ManagedSocket::broadcast(sessions.senderPtrs(), TEST_PACKET_TYPE, flags, buffer);
+			CHECK(handles.size() == N_SOCKETS);
+			if (buffer)
+				CHECK(memcmp(buffer->data(), data.data(), size) == 0);
+
+			for (uint32_t i = 0; i < N_SOCKETS; ++i)
+			{
+				CHECK(handles[i]);
+				CHECK(handles[i].waitFor(5000));
+				CHECK(handles[i].status() == SEND_COMPLETE);
+
+				auto pack = sessions.receivers[i]->pull(TEST_PACKET_TYPE);
+				CHECK(pack.header.packetSize == size);
+				if (size > 0)
+					CHECK(pack.buffer && memcmp(pack.buffer->data(), data.data(), size) == 0);
+			}
+		}
+	}
+}
+
+/*
+* Fails to allocate the encrypted copies of broadcast payloads.
+*/
+struct FailingAlloc
+{
+	static constexpr uint64_t MIN_FAILING_SIZE = 3 * 1024 * 1024;
+public:
+	static void* alloc(uint64_t size, uint64_t alignment, void*)
+	{
+		if (size >= MIN_FAILING_SIZE)
+			throw std::bad_alloc();
+		return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+	}
+	static void free(void* ptr, uint64_t, uint64_t, void*)
+	{
+		std::free(ptr);
+	}
+};
+
+/*
+* An exception thrown for one socket is passed to the caller after every job has finished, instead of blocking it forever.
+*/
+static void testException(uint32_t nThreads)
+{
+	Sessions sessions(nThreads);
+	CHECK(sessions.isValid());
+	if (!sessions.isValid())
+		return;
+
+	auto buffer = std::make_shared<PacketBuffer>(FailingAlloc::MIN_FAILING_SIZE);
+
+	PacketBuffer::setAllocator(FailingAlloc::alloc, FailingAlloc::free);
+	bool caught = false;
+	try
+	{
+		ManagedSocket::broadcast(sessions.senderPtrs(), TEST_PACKET_TYPE, FLAG_PH_NONE, buffer);
+	}
+	catch (const std::bad_alloc&)
+	{
+		caught = true;
+	}
+	PacketBuffer::setAllocator(nullptr, nullptr);
+	CHECK(caught);
+
+	// The broadcast threads are still usable.
+	auto handles = ManagedSocket::broadcast(sessions.senderPtrs(), TEST_PACKET_TYPE, FLAG_PH_NONE, nullptr);
+	CHECK(SendHandle::waitAll(handles, 5000));
+	for (auto& handle : handles)
+		CHECK(handle.status() == SEND_COMPLETE);
+}
+
+int main()
+{
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		testDelivery(nThreads);
+		testException(nThreads);
+	}
+
+	return testResult();
+}
@@ -0,0 +1,160 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+using namespace EHSN;
+
+/*
+* Record written by the producers, read as a whole by the consumer.
+*/
+struct Record
+{
+	uint32_t writer;
+	uint32_t seq;
+	uint64_t check; // Detects records torn apart by concurrent writers.
+public:
+	static Record make(uint32_t writer, uint32_t seq) { return { writer, seq, ((uint64_t)writer << 32 | seq) ^ 0x5A5A5A5A5A5A5A5A }; }
+	bool isValid() const { return check == (((uint64_t)writer << 32 | seq) ^ 0x5A5A5A5A5A5A5A5A); }
+};
+
+/*
+* Sizes, non-blocking calls and wrapping around the end of the buffer.
+*/
+static void testSingleThreaded()
+{
+	CircularBuffer buffer(100);
+	CHECK(buffer.capacity() == 128);
+	CHECK(buffer.nReadable() == 0);
+	CHECK(buffer.nWritable() == 128);
+
+	char data[128];
+	for (int i = 0; i < 128; ++i)
+		data[i] = (char)i;
+
+	char out[128] = {};
+	CHECK(!buffer.tryRead(out, 1));
+	CHECK(buffer.tryWrite(data, 100));
+	CHECK(!buffer.tryWrite(data, 29));
+	CHECK(buffer.nReadable() == 100);
+	CHECK(buffer.tryRead(out, 90));
+	CHECK(memcmp(out, data, 90) == 0);
+
+	// 10 bytes left at offset 90, the next 60 bytes wrap around.
+	CHECK(buffer.tryWrite(data, 60));
+	auto regions = buffer.peekRead();
+	CHECK(regions.size() == 70);
+	CHECK(regions.first.size == 38);
+	CHECK(regions.second.size == 32);
+	CHECK(memcmp(regions.first.data, data + 90, 10) == 0);
+	buffer.moveReadOffset(10);
+
+	CHECK(buffer.tryRead(out, 60));
+	CHECK(memcmp(out, data, 60) == 0);
+	CHECK(buffer.nReadable() == 0);
+
+	// Zero-copy writing.
+	auto writable = buffer.peekWrite();
+	CHECK(writable.size() == 128);
+	memcpy(writable.first.data, data, std::min<size_t>(writable.first.size, 16));
+	buffer.moveWriteOffset(16);
+	CHECK(buffer.tryRead(out, 16));
+	CHECK(memcmp(out, data, 16) == 0);
+}
+
+/*
+* Records of many writers arrive intact, complete and in the order of every single writer.
+*/
+static void testMultiProducer()
+{
+	constexpr uint32_t nWriters = 4;
+	constexpr uint32_t nRecords = 5000;
+
+	// Small enough for the writers to block on a full buffer all the time.
+	CircularBuffer buffer(64 * sizeof(Record));
+
+	std::vector<std::thread> writers;
+	for (uint32_t w = 0; w < nWriters; ++w)
+	{
+		writers.emplace_back(
+			[&buffer, w]()
+			{
+				for (uint32_t i = 0; i < nRecords; ++i)
+				{
+					auto record = Record::make(w, i);
+					if (i % 2)
+						buffer.write(&record, sizeof(Record));
+					else
+					{
+						while (!buffer.tryWrite(&record, sizeof(Record)))
+							std::this_thread::yield();
+					}
+				}
+			}
+		);
+	}
+
+	std::vector<uint32_t> nextSeq(nWriters, 0);
+	uint64_t nInvalid = 0;
+	uint64_t nOutOfOrder = 0;
+	for (uint64_t i = 0; i < (uint64_t)nWriters * nRecords; ++i)
+	{
+		Record record;
+		buffer.read(&record, sizeof(Record));
+		if (!record.isValid() || record.writer >= nWriters)
+		{
+			++nInvalid;
+			continue;
+		}
+		if (record.seq != nextSeq[record.writer])
+			++nOutOfOrder;
+		nextSeq[record.writer] = record.seq + 1;
+	}
+
+	for (auto& t : writers)
+		t.join();
+
+	CHECK(nInvalid == 0);
+	CHECK(nOutOfOrder == 0);
+	for (uint32_t w = 0; w < nWriters; ++w)
+		CHECK(nextSeq[w] == nRecords);
+	CHECK(buffer.nReadable() == 0);
+}
+
+/*
+* A blocked read returns once another thread wrote the data.
+*/
+static void testBlockingRead()
+{
+	CircularBuffer buffer(64);
+
+	std::atomic_bool hasRead = false;
+	char out[8] = {};
+	std::thread reader(
+		[&]()
+		{
+			buffer.read(out, sizeof(out));
+			hasRead = true;
+		}
+	);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	CHECK(!hasRead);
+
+	buffer.write("abcdefgh", 8);
+	reader.join();
+	CHECK(hasRead);
+	CHECK(memcmp(out, "abcdefgh", 8) == 0);
+}
+
+int main()
+{
+	testSingleThreaded();
+	testMultiProducer();
+	testBlockingRead();
+
+	return testResult();
+}
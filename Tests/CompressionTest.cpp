@@ -0,0 +1,198 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+/*
+* Compress and decompress data and compare the result with the original.
+*/
+static void testRoundTrip(compression::Codec codec, uint64_t size, ThreadPoolRef threadPool)
+{
+	auto data = makeTestData(size, (uint32_t)size, true);
+
+	auto compressed = compression::compress(codec, data.data(), data.size(), threadPool);
+	CHECK(compressed);
+	if (!compressed)
+		return;
+	CHECK(compressed->size() < size);
+
+	auto raw = compression::decompress(compressed->data(), compressed->size(), size, threadPool);
+	CHECK(raw);
+	if (!raw)
+		return;
+	CHECK(raw->size() == size);
+	CHECK(memcmp(raw->data(), data.data(), size) == 0);
+}
+
+/*
+* Check that invalid input gets rejected instead of producing data.
+*/
+static void testInvalid(compression::Codec codec)
+{
+	constexpr uint64_t size = 3 * compression::BLOCK_SIZE;
+	auto data = makeTestData(size, 1, true);
+
+	auto compressed = compression::compress(codec, data.data(), data.size(), nullptr);
+	CHECK(compressed);
+	if (!compressed)
+		return;
+
+	// Bigger than allowed.
+	CHECK(!compression::decompress(compressed->data(), compressed->size(), size - 1, nullptr));
+
+	// Truncated.
+	CHECK(!compression::decompress(compressed->data(), compressed->size() - 1, size, nullptr));
+	CHECK(!compression::decompress(compressed->data(), 4, size, nullptr));
+
+	// Corrupted block data (the block table starts right after the 16 byte stream header).
+	std::vector<uint8_t> corrupted((uint8_t*)compressed->data(), (uint8_t*)compressed->data() + compressed->size());
+	for (uint64_t i = corrupted.size() / 2; i < corrupted.size(); i += 7)
+		corrupted[i] ^= 0x5A;
+	auto raw = compression::decompress(corrupted.data(), corrupted.size(), size, nullptr);
+	CHECK(!raw || memcmp(raw->data(), data.data(), size) != 0);
+
+	// Corrupted block size.
+	corrupted.assign((uint8_t*)compressed->data(), (uint8_t*)compressed->data() + compressed->size());
+	corrupted[16] ^= 0x01;
+	CHECK(!compression::decompress(corrupted.data(), corrupted.size(), size, nullptr));
+}
+
+/*
+* Tracks the biggest buffer allocated by PacketBuffer.
+*/
+struct AllocCounter
+{
+	static inline std::atomic<uint64_t> maxSize = 0;
+public:
+	static void* alloc(uint64_t size, uint64_t alignment, void*)
+	{
+		uint64_t prev = maxSize;
+		while (prev < size && !maxSize.compare_exchange_weak(prev, size));
+		return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+	}
+	static void free(void* ptr, uint64_t, uint64_t, void*)
+	{
+		std::free(ptr);
+	}
+};
+
+/*
+* Build a stream claiming rawSize bytes, with every block taking blockSize bytes of garbage.
+*/
+static std::vector<uint8_t> makeStream(compression::Codec codec, uint64_t rawSize, uint32_t blockSize)
+{
+	uint32_t nBlocks = (uint32_t)((rawSize + compression::BLOCK_SIZE - 1) / compression::BLOCK_SIZE);
+
+	std::vector<uint8_t> stream(16 + nBlocks * (sizeof(uint32_t) + blockSize), 0xA5);
+	stream[0] = codec;
+	stream[1] = stream[2] = stream[3] = 0;
+	memcpy(stream.data() + 4, &nBlocks, sizeof(uint32_t));
+	memcpy(stream.data() + 8, &rawSize, sizeof(uint64_t));
+	for (uint32_t i = 0; i < nBlocks; ++i)
+		memcpy(stream.data() + 16 + i * sizeof(uint32_t), &blockSize, sizeof(uint32_t));
+	return stream;
+}
+
+/*
+* Streams claiming a huge raw size are rejected without allocating the raw size.
+*/
+static void testBomb(compression::Codec codec)
+{
+	PacketBuffer::setAllocator(AllocCounter::alloc, AllocCounter::free);
+	AllocCounter::maxSize = 0;
+
+	// Above MAX_RATIO.
+	auto stream = makeStream(codec, 16 * compression::BLOCK_SIZE, 1);
+	CHECK(!compression::decompress(stream.data(), stream.size(), UINT64_MAX, nullptr));
+
+	// Above MAX_RAW_SIZE, but within MAX_RATIO.
+	uint64_t rawSize = compression::MAX_RAW_SIZE + 1;
+	stream = makeStream(codec, rawSize, (uint32_t)(rawSize / compression::MAX_RATIO / (rawSize / compression::BLOCK_SIZE)));
+	CHECK(rawSize / compression::MAX_RATIO <= stream.size());
+	CHECK(!compression::decompress(stream.data(), stream.size(), UINT64_MAX, nullptr));
+
+	CHECK(AllocCounter::maxSize < compression::BLOCK_SIZE);
+
+	PacketBuffer::setAllocator(nullptr, nullptr);
+}
+
+/*
+* Packets compressed by the crypt/send job of a ManagedSocket arrive unchanged and in order, mixed with uncompressed packets.
+*/
+static void testManagedSocket(compression::Codec codec, uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket sender(pair.client, nThreads);
+	ManagedSocket receiver(pair.server, nThreads);
+	CHECK(sender.setCompression(codec));
+
+	constexpr PacketType packetType = SPT_FIRST_FREE_PACKET_TYPE;
+	std::vector<std::vector<uint8_t>> sent;
+	for (uint64_t size : { (uint64_t)100, (uint64_t)5000, 3 * FRAGMENT_SIZE + 17, (uint64_t)7000 })
+	{
+		sent.push_back(makeTestData(size, (uint32_t)sent.size(), true));
+		auto buffer = std::make_shared<PacketBuffer>(size);
+		buffer->write(sent.back().data(), size);
+		sender.push(packetType, FLAG_PH_NONE, buffer);
+	}
+
+	std::vector<std::vector<uint8_t>> received;
+	for (uint64_t i = 0; i < sent.size(); ++i)
+	{
+		auto pack = receiver.pull(packetType);
+		CHECK(pack.buffer);
+		if (!pack.buffer)
+			break;
+		received.emplace_back((uint8_t*)pack.buffer->data(), (uint8_t*)pack.buffer->data() + pack.buffer->size());
+	}
+
+	CHECK(received == sent);
+	CHECK(sender.getCompressionMetrics().nPacketsCompressed == 3);
+
+	pair.client->disconnect();
+}
+
+int main()
+{
+	CHECK(!compression::isAvailable(compression::CODEC_NONE));
+	CHECK(!compression::compress(compression::CODEC_NONE, "abc", 3, nullptr));
+
+	auto threadPool = std::make_shared<ThreadPool>(4);
+
+	for (auto codec : { compression::CODEC_ZLIB, compression::CODEC_LZ4 })
+	{
+		if (!compression::isAvailable(codec))
+		{
+			std::cout << "Codec " << (int)codec << " not available, skipped" << std::endl;
+			continue;
+		}
+
+		for (uint64_t size : { (uint64_t)1000, compression::BLOCK_SIZE, compression::BLOCK_SIZE + 1, 5 * compression::BLOCK_SIZE + 123 })
+		{
+			testRoundTrip(codec, size, nullptr);
+			testRoundTrip(codec, size, threadPool);
+		}
+
+		// Data that does not get smaller is not compressed.
+		auto noise = makeTestData(compression::BLOCK_SIZE, 7, false);
+		CHECK(!compression::compress(codec, noise.data(), noise.size(), threadPool));
+		CHECK(!compression::compress(codec, noise.data(), 0, nullptr));
+
+		testInvalid(codec);
+		testBomb(codec);
+		testManagedSocket(codec, 0);
+		testManagedSocket(codec, 2);
+	}
+
+	return testResult();
+}
@@ -0,0 +1,165 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <map>
+#include <cstring>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType BULK_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE;
+constexpr PacketType STATE_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE + 1;
+constexpr uint64_t BIG_PACKET_SIZE = 32 * 1024 * 1024; // More than the socket buffers of the loopback connection hold.
+
+/*
+* Make a packet whose single payload byte identifies it.
+*/
+static Packet makeTagged(PacketType packetType, PacketFlags flags, uint8_t tag)
+{
+	Packet pack;
+	pack.header.packetType = packetType;
+	pack.header.flags = flags;
+	pack.buffer = std::make_shared<PacketBuffer>(1);
+	pack.buffer->write(&tag, 1);
+	return pack;
+}
+
+static uint8_t tagOf(const Packet& pack)
+{
+	return pack.buffer && pack.buffer->size() == 1 ? *(uint8_t*)pack.buffer->data() : 0;
+}
+
+/*
+* Sent handler, records the reported sizes by packet ID.
+*/
+struct SentLog
+{
+	std::mutex mtx;
+	std::map<PacketID, uint64_t> nBytesSent;
+public:
+	bool waitFor(PacketID pID, uint64_t& nBytes)
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (std::chrono::steady_clock::now() < deadline)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				auto it = nBytesSent.find(pID);
+				if (it != nBytesSent.end())
+				{
+					nBytes = it->second;
+					return true;
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return false;
+	}
+};
+
+/*
+* Packets replaced by a FLAG_PH_REMOVE_PREVIOUS packet before they were encrypted are dropped on sender side.
+* A big packet of another type keeps the older packets queued until the peer starts reading.
+*/
+static void testSenderDrop(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	SentLog log;
+	ManagedSocket sender(pair.client, nThreads);
+	sender.setSentHandler(
+		STATE_PACKET_TYPE,
+		[&log](PacketID pID, uint64_t nBytesSent)
+		{
+			std::unique_lock<std::mutex> lock(log.mtx);
+			log.nBytesSent[pID] = nBytesSent;
+		}
+	);
+
+	auto big = std::make_shared<PacketBuffer>(BIG_PACKET_SIZE);
+	memset(big->data(), 0x33, BIG_PACKET_SIZE);
+	sender.push(BULK_PACKET_TYPE, FLAG_PH_NONE, big);
+
+	std::vector<SendHandle> handles;
+	handles.push_back(sender.pushTracked(makeTagged(STATE_PACKET_TYPE, FLAG_PH_NONE, 1)));
+	handles.push_back(sender.pushTracked(makeTagged(STATE_PACKET_TYPE, FLAG_PH_NONE, 2)));
+	handles.push_back(sender.pushTracked(makeTagged(STATE_PACKET_TYPE, FLAG_PH_REMOVE_PREVIOUS, 3)));
+
+	// Without crypt threads nothing gets encrypted ahead of sending, so the older packets are dropped for sure.
+	if (nThreads == 0)
+	{
+		CHECK(handles[0].status() == SEND_DROPPED);
+		CHECK(handles[1].status() == SEND_DROPPED);
+		CHECK(sender.nSendPacketsQueued() == 2);
+	}
+
+	ManagedSocket receiver(pair.server, nThreads);
+	CHECK(receiver.pull(BULK_PACKET_TYPE).header.packetSize == BIG_PACKET_SIZE);
+	CHECK(tagOf(receiver.pull(STATE_PACKET_TYPE)) == 3);
+
+	CHECK(SendHandle::waitAll(handles, 5000));
+	CHECK(handles[2].status() == SEND_COMPLETE);
+	for (auto& handle : handles)
+	{
+		uint64_t nBytes = UINT64_MAX;
+		CHECK(log.waitFor(handle.packetID(), nBytes));
+		CHECK(handle.status() == SEND_COMPLETE || handle.status() == SEND_DROPPED);
+		CHECK(nBytes == (handle.status() == SEND_DROPPED ? 0 : 1));
+		CHECK(handle.nBytesSent() == nBytes);
+	}
+	CHECK(sender.nSendPacketsQueued() == 0);
+	CHECK(sender.nSendBytesQueued() == 0);
+
+	pair.client->disconnect();
+}
+
+/*
+* Packets already received but not pulled yet are replaced as well.
+*/
+static void testReceiverDrop(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket sender(pair.client, nThreads);
+	ManagedSocket receiver(pair.server, nThreads);
+
+	sender.push(makeTagged(STATE_PACKET_TYPE, FLAG_PH_NONE, 1));
+	sender.push(makeTagged(STATE_PACKET_TYPE, FLAG_PH_NONE, 2));
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (receiver.nPullable(STATE_PACKET_TYPE) < 2 && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK(receiver.nPullable(STATE_PACKET_TYPE) == 2);
+
+	// Packets arrive in order, so the replacement is queued once the packet behind it has arrived.
+	sender.push(makeTagged(STATE_PACKET_TYPE, FLAG_PH_REMOVE_PREVIOUS, 3));
+	sender.push(makeTagged(BULK_PACKET_TYPE, FLAG_PH_NONE, 4));
+	CHECK(tagOf(receiver.pull(BULK_PACKET_TYPE)) == 4);
+
+	CHECK(receiver.nPullable(STATE_PACKET_TYPE) == 1);
+	CHECK(tagOf(receiver.pull(STATE_PACKET_TYPE)) == 3);
+	CHECK(receiver.nPullable(STATE_PACKET_TYPE) == 0);
+	CHECK(receiver.nRecvBytesQueued() == 0);
+
+	pair.client->disconnect();
+}
+
+int main()
+{
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		testSenderDrop(nThreads);
+		testReceiverDrop(nThreads);
+	}
+
+	return testResult();
+}
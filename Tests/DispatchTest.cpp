@@ -0,0 +1,214 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType TYPE_A = SPT_FIRST_FREE_PACKET_TYPE;
+constexpr PacketType TYPE_B = SPT_FIRST_FREE_PACKET_TYPE + 1;
+constexpr uint32_t N_DISPATCH_THREADS = 4; // Enough to run handlers concurrently on a single core, the first socket determines the shared pools.
+constexpr auto OVERLAP_TIMEOUT = std::chrono::seconds(2);
+
+/*
+* Push a packet whose payload is the key and the sequence number of the packet.
+*/
+static void pushKeyed(ManagedSocket& sender, PacketType packetType, uint8_t key, uint8_t seq)
+{
+	uint8_t data[2] = { key, seq };
+	auto buffer = std::make_shared<PacketBuffer>(sizeof(data));
+	buffer->write(data);
+	sender.push(packetType, FLAG_PH_NONE, buffer);
+}
+
+static uint8_t keyOf(const Packet& pack) { return ((uint8_t*)pack.buffer->data())[0]; }
+static uint8_t seqOf(const Packet& pack) { return ((uint8_t*)pack.buffer->data())[1]; }
+
+/*
+* Records the handlers running concurrently and the order of the packets, per key.
+*/
+struct Tracker
+{
+	std::mutex mtx;
+	std::condition_variable cond;
+	uint32_t nActive[2] = {};
+	uint32_t maxActive[2] = {};
+	uint32_t maxActiveTotal = 0;
+	std::vector<uint8_t> order[2];
+	uint32_t nHandled = 0;
+public:
+	void enter(uint8_t key, uint8_t seq)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		++nActive[key];
+		maxActive[key] = std::max(maxActive[key], nActive[key]);
+		maxActiveTotal = std::max(maxActiveTotal, nActive[0] + nActive[1]);
+		order[key].push_back(seq);
+		cond.notify_all();
+	}
+	void leave(uint8_t key)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		--nActive[key];
+		++nHandled;
+		cond.notify_all();
+	}
+	/*
+	* Wait until another handler runs at the same time.
+	*
+	* @returns True if another handler started within the timeout. Otherwise false.
+	*/
+	bool waitOverlap()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		return cond.wait_for(lock, OVERLAP_TIMEOUT, [this]() { return maxActiveTotal >= 2; });
+	}
+	bool waitHandled(uint32_t n)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		return cond.wait_for(lock, std::chrono::seconds(5), [this, n]() { return nHandled >= n; });
+	}
+	static bool isSequence(const std::vector<uint8_t>& order, uint32_t n)
+	{
+		if (order.size() != n)
+			return false;
+		for (uint32_t i = 0; i < n; ++i)
+		{
+			if (order[i] != i)
+				return false;
+		}
+		return true;
+	}
+};
+
+/*
+* Serialized handlers of all types run one at a time, in the order the packets arrived.
+*/
+static void testSerialized(ManagedSocket& sender, ManagedSocket& receiver)
+{
+	Tracker tracker;
+	auto handler =
+		[&tracker](Packet pack, uint64_t)
+		{
+			tracker.enter(0, seqOf(pack));
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			tracker.leave(0);
+		};
+	receiver.setRecvHandler(TYPE_A, handler);
+	receiver.setRecvHandler(TYPE_B, handler);
+
+	constexpr uint32_t N = 20;
+	for (uint8_t i = 0; i < N; ++i)
+		pushKeyed(sender, i % 2 ? TYPE_B : TYPE_A, 0, i);
+
+	CHECK(tracker.waitHandled(N));
+	CHECK(tracker.maxActiveTotal == 1);
+	CHECK(Tracker::isSequence(tracker.order[0], N));
+
+	receiver.setRecvHandler(TYPE_A, nullptr);
+	receiver.setRecvHandler(TYPE_B, nullptr);
+}
+
+/*
+* Parallel handlers of the same type run concurrently.
+*/
+static void testParallel(ManagedSocket& sender, ManagedSocket& receiver)
+{
+	Tracker tracker;
+	bool overlapped = false;
+	receiver.setDispatchPolicy(TYPE_A, DISPATCH_PARALLEL);
+	receiver.setRecvHandler(
+		TYPE_A,
+		[&tracker, &overlapped](Packet pack, uint64_t)
+		{
+			tracker.enter(0, seqOf(pack));
+			if (tracker.waitOverlap())
+				overlapped = true;
+			tracker.leave(0);
+		}
+	);
+
+	pushKeyed(sender, TYPE_A, 0, 0);
+	pushKeyed(sender, TYPE_A, 0, 1);
+
+	CHECK(tracker.waitHandled(2));
+	CHECK(overlapped);
+	CHECK(tracker.maxActive[0] == 2);
+
+	receiver.setRecvHandler(TYPE_A, nullptr);
+	receiver.setDispatchPolicy(TYPE_A, DISPATCH_SERIALIZED);
+}
+
+/*
+* Handlers of packets with the same key run one at a time and in order, packets with other keys are handled meanwhile.
+*/
+static void testPerKey(ManagedSocket& sender, ManagedSocket& receiver)
+{
+	Tracker tracker;
+	bool overlapped = false;
+	receiver.setDispatchPolicy(TYPE_A, DISPATCH_PER_KEY, [](const Packet& pack) { return (uint64_t)keyOf(pack); });
+	receiver.setRecvHandler(
+		TYPE_A,
+		[&tracker, &overlapped](Packet pack, uint64_t)
+		{
+			tracker.enter(keyOf(pack), seqOf(pack));
+			if (keyOf(pack) == 0 && seqOf(pack) == 0)
+			{
+				// Blocks key 0 until a packet of key 1 has been handled at the same time.
+				if (tracker.waitOverlap())
+					overlapped = true;
+			}
+			else
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			tracker.leave(keyOf(pack));
+		}
+	);
+
+	constexpr uint32_t N = 10;
+	for (uint8_t i = 0; i < N; ++i)
+	{
+		pushKeyed(sender, TYPE_A, 0, i);
+		pushKeyed(sender, TYPE_A, 1, i);
+	}
+
+	CHECK(tracker.waitHandled(2 * N));
+	CHECK(overlapped);
+	for (uint8_t key : { 0, 1 })
+	{
+		CHECK(tracker.maxActive[key] == 1);
+		CHECK(Tracker::isSequence(tracker.order[key], N));
+	}
+
+	receiver.setRecvHandler(TYPE_A, nullptr);
+	receiver.setDispatchPolicy(TYPE_A, DISPATCH_SERIALIZED);
+}
+
+int main()
+{
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		auto pair = makeSocketPair();
+		CHECK(pair.server);
+		if (!pair.server)
+			continue;
+
+		ManagedSocket sender(pair.client, nThreads, N_DISPATCH_THREADS);
+		ManagedSocket receiver(pair.server, nThreads, N_DISPATCH_THREADS);
+
+		testSerialized(sender, receiver);
+		testParallel(sender, receiver);
+		testPerKey(sender, receiver);
+
+		pair.client->disconnect();
+	}
+
+	return testResult();
+}
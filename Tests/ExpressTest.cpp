@@ -0,0 +1,112 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <cstring>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType BULK_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE;
+constexpr PacketType EXPRESS_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE + 1;
+
+static PacketBufferRef makeBuffer(const std::vector<uint8_t>& data)
+{
+	auto buffer = std::make_shared<PacketBuffer>(data.size());
+	buffer->write(data.data(), data.size());
+	return buffer;
+}
+
+static bool equals(const Packet& pack, const std::vector<uint8_t>& data)
+{
+	return pack.buffer && pack.buffer->size() == data.size() && memcmp(pack.buffer->data(), data.data(), data.size()) == 0;
+}
+
+/*
+* Express packets of any size arrive intact and in order, interleaved with regular packets, and no packet gets stuck.
+*/
+static void testMixed(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket sender(pair.client, nThreads);
+	ManagedSocket receiver(pair.server, nThreads);
+
+	std::vector<std::vector<uint8_t>> bulk;
+	std::vector<std::vector<uint8_t>> express;
+	for (uint64_t size : { (uint64_t)0, (uint64_t)33, FRAGMENT_SIZE, 2 * FRAGMENT_SIZE + 5, (uint64_t)1000 })
+	{
+		bulk.push_back(makeTestData(size, (uint32_t)(2 * bulk.size()), false));
+		sender.push(BULK_PACKET_TYPE, FLAG_PH_NONE, bulk.back().empty() ? nullptr : makeBuffer(bulk.back()));
+
+		express.push_back(makeTestData(size, (uint32_t)(2 * express.size() + 1), false));
+		sender.push(EXPRESS_PACKET_TYPE, FLAG_PH_SEND_IMMEDIATE, express.back().empty() ? nullptr : makeBuffer(express.back()));
+	}
+
+	for (auto& data : bulk)
+	{
+		auto pack = receiver.pull(BULK_PACKET_TYPE);
+		CHECK(data.empty() ? pack.header.packetSize == 0 : equals(pack, data));
+	}
+	for (auto& data : express)
+	{
+		auto pack = receiver.pull(EXPRESS_PACKET_TYPE);
+		CHECK(data.empty() ? pack.header.packetSize == 0 : equals(pack, data));
+	}
+	CHECK(receiver.isConnected());
+
+	pair.client->disconnect();
+}
+
+/*
+* An express packet overtakes the bulk data queued before it.
+*/
+static void testOvertake(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket sender(pair.client, nThreads);
+	ManagedSocket receiver(pair.server, nThreads);
+
+	constexpr uint32_t nBulk = 32;
+	auto bulk = makeTestData(1024 * 1024, 1, false);
+	for (uint32_t i = 0; i < nBulk; ++i)
+		sender.push(BULK_PACKET_TYPE, FLAG_PH_NONE, makeBuffer(bulk), PRIO_BULK);
+
+	auto express = makeTestData(64, 2, false);
+	sender.push(EXPRESS_PACKET_TYPE, FLAG_PH_SEND_IMMEDIATE, makeBuffer(express), PRIO_BULK);
+
+	// Packets of any type are pulled in the order of arrival.
+	uint32_t nBulkBefore = 0;
+	for (uint32_t i = 0; i <= nBulk; ++i)
+	{
+		auto pack = receiver.pull(SPT_UNDEFINED);
+		if (pack.header.packetType == EXPRESS_PACKET_TYPE)
+		{
+			CHECK(equals(pack, express));
+			break;
+		}
+		CHECK(equals(pack, bulk));
+		++nBulkBefore;
+	}
+	CHECK(nBulkBefore < nBulk);
+
+	pair.client->disconnect();
+}
+
+int main()
+{
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		testMixed(nThreads);
+		testOvertake(nThreads);
+	}
+
+	return testResult();
+}
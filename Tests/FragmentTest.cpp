@@ -0,0 +1,273 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <chrono>
+#include <cstring>
+#include <atomic>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType TEST_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE;
+
+/*
+* Write a single frame the way ManagedSocket::sendFrame does, with a header chosen by the test.
+*
+* @param sock Socket to write the frame to.
+* @param header Header of the frame.
+* @param payload Payload of the frame. May be null.
+* @param size Size of the payload.
+*/
+static void writeFrame(SecSocketRef sock, PacketHeader header, const void* payload, uint64_t size)
+{
+	sock->writeSecure(&header, sizeof(PacketHeader));
+	if (size > 0)
+	{
+		std::vector<uint8_t> data(crypto::aes::paddedSize(size));
+		memcpy(data.data(), payload, size);
+		sock->writeSecure(data.data(), size);
+	}
+}
+
+static PacketHeader fragmentHeader(PacketID packetID, uint64_t packetSize, uint64_t offset, uint32_t size)
+{
+	PacketHeader header;
+	header.packetType = TEST_PACKET_TYPE;
+	header.frameFlags = FRAME_FLAG_FRAGMENT;
+	header.packetID = packetID;
+	header.packetSize = packetSize;
+	header.fragmentOffset = offset;
+	header.fragmentSize = size;
+	return header;
+}
+
+/*
+* Collects the chunks passed to a PacketChunkCallback.
+*/
+struct StreamResult
+{
+	std::mutex mtx;
+	std::condition_variable cond;
+	std::vector<uint8_t> data;
+	std::atomic<uint64_t> nChunks = 0;
+	bool gotLast = false;
+public:
+	static void chunkCallback(const PacketHeader& header, PacketBufferRef chunk, uint64_t offset, bool isLast, void* pParam)
+	{
+		auto& result = *(StreamResult*)pParam;
+		std::unique_lock<std::mutex> lock(result.mtx);
+		result.data.resize(header.packetSize);
+		if (chunk && offset + chunk->size() <= result.data.size())
+			memcpy(result.data.data() + offset, chunk->data(), chunk->size());
+		++result.nChunks;
+		result.gotLast |= isLast;
+		result.cond.notify_one();
+	}
+};
+
+/*
+* Wait until the ManagedSocket has closed the connection.
+*
+* @returns True if the connection got closed within a few seconds. Otherwise false.
+*/
+static bool waitDisconnected(ManagedSocket& sock)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (sock.isConnected() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return !sock.isConnected();
+}
+
+/*
+* Fragments get assembled to the original packet.
+*
+* Like the fragments of ManagedSocket, they arrive in order and all but the last fragment are a multiple of AES_BLOCK_SIZE.
+*/
+static void testValidFragments(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket receiver(pair.server, nThreads);
+
+	auto data = makeTestData(100, 1, false);
+	writeFrame(pair.client, fragmentHeader(1, 100, 0, 64), data.data(), 64);
+	writeFrame(pair.client, fragmentHeader(1, 100, 64, 36), data.data() + 64, 36);
+
+	auto pack = receiver.pull(TEST_PACKET_TYPE);
+	CHECK(pack.buffer);
+	CHECK(pack.header.packetSize == 100);
+	CHECK(pack.header.frameFlags == FRAME_FLAG_NONE);
+	if (pack.buffer)
+		CHECK(memcmp(pack.buffer->data(), data.data(), 100) == 0);
+	CHECK(receiver.isConnected());
+
+	pair.client->disconnect();
+}
+
+/*
+* Fragments of a streamed packet type are passed to the chunk callback at their offsets.
+*/
+static void testValidStream(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	StreamResult result;
+	ManagedSocket receiver(pair.server, nThreads);
+	receiver.setStreamCallback(TEST_PACKET_TYPE, StreamResult::chunkCallback, &result);
+
+	auto data = makeTestData(100, 3, false);
+	writeFrame(pair.client, fragmentHeader(1, 100, 64, 36), data.data() + 64, 36);
+	writeFrame(pair.client, fragmentHeader(1, 100, 0, 64), data.data(), 64);
+
+	{
+		std::unique_lock<std::mutex> lock(result.mtx);
+		CHECK(result.cond.wait_for(lock, std::chrono::seconds(5), [&]() { return result.nChunks == 2; }));
+		CHECK(result.gotLast);
+		CHECK(result.data == data);
+	}
+	CHECK(receiver.isConnected());
+
+	pair.client->disconnect();
+}
+
+/*
+* A malformed fragment closes the connection and never reaches the receive queue or the chunk callback.
+*
+* @param streamed If set to true, the packet type is received in streaming mode.
+* @param first Optional valid fragment sent before the malformed one.
+* @param malformed The malformed fragment.
+*/
+static void testMalformedFragment(uint32_t nThreads, bool streamed, const PacketHeader* first, PacketHeader malformed)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	StreamResult result;
+	ManagedSocket receiver(pair.server, nThreads);
+	if (streamed)
+		receiver.setStreamCallback(TEST_PACKET_TYPE, StreamResult::chunkCallback, &result);
+
+	auto data = makeTestData(256, 2, false);
+	if (first)
+		writeFrame(pair.client, *first, data.data(), first->fragmentSize);
+	writeFrame(pair.client, malformed, nullptr, 0);
+
+	CHECK(waitDisconnected(receiver));
+	CHECK(receiver.nPullable(TEST_PACKET_TYPE) == 0);
+	CHECK(result.nChunks == (first && streamed ? 1 : 0));
+
+	pair.client->disconnect();
+}
+
+/*
+* Clearing the socket while some fragments of a packet wait for decryption never delivers the packet partly decrypted.
+*/
+static void testClearFragments(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket receiver(pair.server, nThreads);
+
+	constexpr uint64_t fragmentSize = 64 * 1024;
+	constexpr uint64_t packetSize = 3 * fragmentSize;
+	auto data = makeTestData(packetSize, 4, false);
+	auto marker = makeTestData(16, 5, false);
+
+	auto filler = makeTestData(256 * 1024, 6, false);
+
+	for (PacketID packetID = 1; packetID <= 20; ++packetID)
+	{
+		// Keep the decryption busy with higher prioritized packets, so the fragments are still queued when clearing.
+		PacketHeader fillerHeader;
+		fillerHeader.packetType = TEST_PACKET_TYPE + 2;
+		fillerHeader.packetSize = filler.size();
+		fillerHeader.priority = PRIO_HIGH;
+		for (int i = 0; i < 8; ++i)
+		{
+			fillerHeader.packetID = 2000 + packetID * 8 + i;
+			writeFrame(pair.client, fillerHeader, filler.data(), filler.size());
+		}
+
+		for (uint64_t offset = 0; offset < packetSize; offset += fragmentSize)
+		{
+			auto header = fragmentHeader(packetID, packetSize, offset, fragmentSize);
+			header.priority = PRIO_BULK;
+			writeFrame(pair.client, header, data.data() + offset, fragmentSize);
+			if (offset == fragmentSize)
+				receiver.clear();
+		}
+
+		// The marker is received after the last fragment.
+		PacketHeader header;
+		header.packetType = TEST_PACKET_TYPE + 1;
+		header.packetID = 1000 + packetID;
+		header.packetSize = marker.size();
+		writeFrame(pair.client, header, marker.data(), marker.size());
+		CHECK(receiver.pull(TEST_PACKET_TYPE + 1).buffer);
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+		while (receiver.nPullable(TEST_PACKET_TYPE) > 0)
+		{
+			auto pack = receiver.pull(TEST_PACKET_TYPE);
+			CHECK(pack.buffer && pack.buffer->size() == packetSize);
+			if (pack.buffer && pack.buffer->size() == packetSize)
+				CHECK(memcmp(pack.buffer->data(), data.data(), packetSize) == 0);
+		}
+	}
+	CHECK(receiver.isConnected());
+
+	pair.client->disconnect();
+}
+
+int main()
+{
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		testValidFragments(nThreads);
+		testValidStream(nThreads);
+		testClearFragments(nThreads);
+
+		for (bool streamed : { false, true })
+		{
+			// Offset behind the end of the packet.
+			testMalformedFragment(nThreads, streamed, nullptr, fragmentHeader(1, 64, 65, 0));
+			// Fragment reaching over the end of the packet.
+			testMalformedFragment(nThreads, streamed, nullptr, fragmentHeader(1, 64, 32, 33));
+			// offset + size wraps around to a value inside the packet.
+			testMalformedFragment(nThreads, streamed, nullptr, fragmentHeader(1, 64, UINT64_MAX - 15, 32));
+		}
+
+		// Packet size differs from the first fragment of the packet.
+		auto first = fragmentHeader(1, 64, 0, 32);
+		testMalformedFragment(nThreads, false, &first, fragmentHeader(1, 128, 32, 32));
+
+		// Offset inside the last block, the padded read would end behind the buffer.
+		testMalformedFragment(nThreads, false, nullptr, fragmentHeader(1, 2048, 2047, 1));
+		auto firstBig = fragmentHeader(1, 2048, 0, 32);
+		testMalformedFragment(nThreads, false, &firstBig, fragmentHeader(1, 2048, 40, 16));
+		// Fragment other than the last one ending inside a block.
+		testMalformedFragment(nThreads, false, nullptr, fragmentHeader(1, 64, 0, 33));
+
+		// Duplicate fragment, which would count the same bytes twice.
+		testMalformedFragment(nThreads, false, &first, fragmentHeader(1, 64, 0, 32));
+		// Gap between two fragments.
+		auto firstOf96 = fragmentHeader(1, 96, 0, 32);
+		testMalformedFragment(nThreads, false, &firstOf96, fragmentHeader(1, 96, 64, 32));
+		// Packet not starting at offset 0.
+		testMalformedFragment(nThreads, false, nullptr, fragmentHeader(1, 64, 32, 32));
+	}
+
+	return testResult();
+}
@@ -0,0 +1,91 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+/*
+* Wait until a flag gets set.
+*
+* @returns True if the flag got set within a few seconds. Otherwise false.
+*/
+static bool waitFlag(const std::atomic_bool& flag)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (!flag && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return flag;
+}
+
+/*
+* Handlers run on the pool threads and acquire/release track the load of every io_context.
+*/
+static void testRun()
+{
+	IOContextPool pool(3, false, IO_ASSIGN_LEAST_LOADED);
+	CHECK(pool.size() == 3);
+
+	std::atomic_uint32_t nRun = 0;
+	for (uint32_t i = 0; i < pool.size(); ++i)
+		asio::post(pool.get(i), [&nRun]() { ++nRun; });
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (nRun < pool.size() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK(nRun == pool.size());
+
+	// Least loaded assignment spreads the contexts evenly.
+	std::vector<asio::io_context*> acquired;
+	for (uint32_t i = 0; i < 2 * pool.size(); ++i)
+		acquired.push_back(&pool.acquire());
+	for (uint32_t i = 0; i < pool.size(); ++i)
+		CHECK(pool.load(i) == 2);
+
+	for (auto ioContext : acquired)
+		pool.release(*ioContext);
+	for (uint32_t i = 0; i < pool.size(); ++i)
+		CHECK(pool.load(i) == 0);
+}
+
+/*
+* Dropping the last reference to the pool from a handler on one of its threads neither deadlocks nor terminates.
+*/
+static void testDestroyFromHandler()
+{
+	auto pool = std::make_shared<IOContextPool>(2);
+
+	std::promise<void> released;
+	std::shared_future<void> isReleased = released.get_future().share();
+	std::atomic_bool done = false;
+
+	asio::post(
+		pool->get(0),
+		[p = pool, isReleased, &done]() mutable
+		{
+			isReleased.wait();
+			p.reset();
+			done = true;
+		}
+	);
+
+	pool.reset();
+	released.set_value();
+
+	CHECK(waitFlag(done));
+}
+
+int main()
+{
+	testRun();
+	testDestroyFromHandler();
+
+	// Give the detached thread the chance to exit before the process does.
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	return testResult();
+}
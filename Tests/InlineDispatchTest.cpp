@@ -0,0 +1,154 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType SERIALIZED_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE;
+constexpr PacketType INLINE_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE + 1;
+constexpr PacketType PLAIN_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE + 2; // Has no handler, so it gets pushed onto the receive queue.
+constexpr PacketType REPLY_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE + 3;
+
+/*
+* Blocks a handler until the test releases it.
+*/
+struct Gate
+{
+	std::mutex mtx;
+	std::condition_variable cond;
+	bool entered = false;
+	bool released = false;
+	bool done = false;
+public:
+	void pass()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		entered = true;
+		cond.notify_all();
+		cond.wait_for(lock, std::chrono::seconds(10), [this]() { return released; }); // Outlasts waitEntered, so a handler stuck behind this one is noticed.
+		done = true;
+		cond.notify_all();
+	}
+	bool waitEntered()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		return cond.wait_for(lock, std::chrono::seconds(5), [this]() { return entered; });
+	}
+	bool waitDone()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		return cond.wait_for(lock, std::chrono::seconds(5), [this]() { return done; });
+	}
+	void release()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		released = true;
+		cond.notify_all();
+	}
+};
+
+static void pushEmpty(ManagedSocket& sender, PacketType packetType)
+{
+	sender.push(packetType, FLAG_PH_NONE, nullptr);
+}
+
+/*
+* Inline handlers run while the callback thread is busy with a serialized handler.
+*/
+static void testBypassesCallbackThread(ManagedSocket& sender, ManagedSocket& receiver)
+{
+	Gate serialized;
+	Gate inlined;
+	receiver.setRecvHandler(SERIALIZED_PACKET_TYPE, [&serialized](Packet, uint64_t) { serialized.pass(); });
+	receiver.setDispatchPolicy(INLINE_PACKET_TYPE, DISPATCH_INLINE);
+	receiver.setRecvHandler(INLINE_PACKET_TYPE, [&inlined](Packet, uint64_t) { inlined.pass(); });
+	inlined.release();
+
+	pushEmpty(sender, SERIALIZED_PACKET_TYPE);
+	CHECK(serialized.waitEntered());
+
+	pushEmpty(sender, INLINE_PACKET_TYPE);
+	CHECK(inlined.waitEntered());
+	serialized.release();
+	CHECK(serialized.waitDone());
+
+	receiver.setRecvHandler(SERIALIZED_PACKET_TYPE, nullptr);
+	receiver.setRecvHandler(INLINE_PACKET_TYPE, nullptr);
+}
+
+/*
+* Packets received after a packet with an inline handler are only queued once the handler has returned.
+*/
+static void testBlocksReceiving(ManagedSocket& sender, ManagedSocket& receiver)
+{
+	Gate inlined;
+	receiver.setDispatchPolicy(INLINE_PACKET_TYPE, DISPATCH_INLINE);
+	receiver.setRecvHandler(INLINE_PACKET_TYPE, [&inlined](Packet, uint64_t) { inlined.pass(); });
+
+	pushEmpty(sender, INLINE_PACKET_TYPE);
+	pushEmpty(sender, PLAIN_PACKET_TYPE);
+	CHECK(inlined.waitEntered());
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	CHECK(receiver.nPullable(PLAIN_PACKET_TYPE) == 0);
+
+	inlined.release();
+	CHECK(inlined.waitDone());
+	CHECK(receiver.pull(PLAIN_PACKET_TYPE).header.packetType == PLAIN_PACKET_TYPE);
+
+	receiver.setRecvHandler(INLINE_PACKET_TYPE, nullptr);
+}
+
+/*
+* Inline handlers can reply with packets that never block.
+*/
+static void testReply(ManagedSocket& sender, ManagedSocket& receiver)
+{
+	receiver.setDispatchPolicy(INLINE_PACKET_TYPE, DISPATCH_INLINE);
+	receiver.setRecvHandler(
+		INLINE_PACKET_TYPE,
+		[&receiver](Packet pack, uint64_t)
+		{
+			receiver.tryPush(REPLY_PACKET_TYPE, FLAG_PH_NONE, pack.buffer);
+		}
+	);
+
+	auto data = makeTestData(100, 7, false);
+	auto buffer = std::make_shared<PacketBuffer>(data.size());
+	buffer->write(data.data(), data.size());
+	sender.push(INLINE_PACKET_TYPE, FLAG_PH_NONE, buffer);
+
+	auto reply = sender.pull(REPLY_PACKET_TYPE);
+	CHECK(reply.buffer && reply.buffer->size() == data.size() && memcmp(reply.buffer->data(), data.data(), data.size()) == 0);
+
+	receiver.setRecvHandler(INLINE_PACKET_TYPE, nullptr);
+}
+
+int main()
+{
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		auto pair = makeSocketPair();
+		CHECK(pair.server);
+		if (!pair.server)
+			continue;
+
+		ManagedSocket sender(pair.client, nThreads);
+		ManagedSocket receiver(pair.server, nThreads);
+
+		testBypassesCallbackThread(sender, receiver);
+		testBlocksReceiving(sender, receiver);
+		testReply(sender, receiver);
+
+		pair.client->disconnect();
+	}
+
+	return testResult();
+}
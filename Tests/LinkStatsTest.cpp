@@ -0,0 +1,110 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType TEST_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE;
+
+/*
+* Wait until a condition holds.
+*
+* @returns True if the condition held within a few seconds. Otherwise false.
+*/
+template <typename Pred>
+static bool waitUntil(Pred pred)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (!pred() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return pred();
+}
+
+/*
+* Every probe reply adds an RTT sample, the estimates are consistent with each other.
+*/
+static void testProbe(ManagedSocket& sender)
+{
+	CHECK(sender.getLinkStats().nSamples == 0);
+
+	for (uint64_t i = 1; i <= 3; ++i)
+	{
+		sender.probe();
+		CHECK(waitUntil([&]() { return sender.getLinkStats().nSamples >= i; }));
+	}
+
+	auto ls = sender.getLinkStats();
+	CHECK(ls.nSamples == 3);
+	CHECK(ls.minRTT > 0.0f);
+	CHECK(ls.lastRTT >= ls.minRTT);
+	CHECK(ls.srtt > 0.0f);
+	CHECK(ls.rto >= ls.srtt);
+
+	// Both sides share the same clock, so the estimated offset is within half the RTT.
+	CHECK((float)std::llabs(ls.clockOffset) <= ls.minRTT * 1000.0f / 2.0f + 1000.0f);
+
+	// Throughput is only estimated while probing.
+	CHECK(ls.readSpeed == 0.0f);
+	CHECK(ls.writeSpeed == 0.0f);
+}
+
+/*
+* While probing, both sides estimate their throughput and the sender learns how fast the receiver reads.
+*/
+static void testThroughput(ManagedSocket& sender, ManagedSocket& receiver)
+{
+	sender.startProbing(10);
+	receiver.startProbing(10);
+
+	auto data = makeTestData(1024 * 1024, 1, false);
+	auto buffer = std::make_shared<PacketBuffer>(data.size());
+	buffer->write(data.data(), data.size());
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+	while (std::chrono::steady_clock::now() < deadline)
+	{
+		sender.push(TEST_PACKET_TYPE, FLAG_PH_NONE, buffer);
+		CHECK(receiver.pull(TEST_PACKET_TYPE).header.packetSize == data.size());
+	}
+
+	CHECK(waitUntil([&]() { return sender.getLinkStats().writeSpeed > 0.0f; }));
+	CHECK(waitUntil([&]() { return receiver.getLinkStats().readSpeed > 0.0f; }));
+	CHECK(waitUntil([&]() { return sender.getLinkStats().remoteReadSpeed > 0.0f; }));
+	CHECK(receiver.getLinkStats().nSamples > 0);
+
+	sender.stopProbing();
+	receiver.stopProbing();
+
+	// Apart from replies to probes still in flight, nothing updates the stats anymore.
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	auto ls = sender.getLinkStats();
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	CHECK(sender.getLinkStats().nSamples == ls.nSamples);
+	CHECK(sender.getLinkStats().writeSpeed == ls.writeSpeed);
+}
+
+int main()
+{
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		auto pair = makeSocketPair();
+		CHECK(pair.server);
+		if (!pair.server)
+			continue;
+
+		ManagedSocket sender(pair.client, nThreads);
+		ManagedSocket receiver(pair.server, nThreads);
+
+		testProbe(sender);
+		testThroughput(sender, receiver);
+
+		pair.client->disconnect();
+	}
+
+	return testResult();
+}
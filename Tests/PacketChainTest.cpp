@@ -0,0 +1,114 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <cstring>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+/*
+* Builds a chain and the plain bytes it is expected to hold.
+*/
+struct ChainBuilder
+{
+	PacketChain chain;
+	std::vector<uint8_t> expected;
+	uint32_t seed = 1;
+public:
+	void append(uint64_t size)
+	{
+		auto data = makeTestData(size, seed++, false);
+		chain.append(data.data(), size);
+		expected.insert(expected.end(), data.begin(), data.end());
+	}
+	void appendBuffer(uint64_t size)
+	{
+		auto data = makeTestData(size, seed++, false);
+		auto buffer = std::make_shared<PacketBuffer>(size);
+		buffer->write(data.data(), size);
+		chain.append(buffer);
+		expected.insert(expected.end(), data.begin(), data.end());
+	}
+	void prepend(uint64_t size)
+	{
+		auto data = makeTestData(size, seed++, false);
+		chain.prepend(data.data(), size);
+		expected.insert(expected.begin(), data.begin(), data.end());
+	}
+};
+
+/*
+* Write a chain with writeSecure and compare what the peer decrypts with the plain data.
+*/
+static void checkTransfer(SocketPair& pair, ChainBuilder& builder)
+{
+	CHECK(builder.chain.size() == builder.expected.size());
+
+	std::vector<uint8_t> copy(builder.chain.size());
+	builder.chain.copyTo(copy.data());
+	CHECK(copy == builder.expected);
+
+	CHECK(pair.client->writeSecure(builder.chain) == builder.expected.size());
+
+	std::vector<uint8_t> received(crypto::aes::paddedSize(builder.expected.size()));
+	CHECK(pair.server->readSecure(received.data(), builder.expected.size()) == builder.expected.size());
+	CHECK(memcmp(received.data(), builder.expected.data(), builder.expected.size()) == 0);
+}
+
+static void testChains(SocketPair& pair)
+{
+	{ // Single segment, not a multiple of the block size.
+		ChainBuilder builder;
+		builder.append(37);
+		checkTransfer(pair, builder);
+	}
+	{ // Blocks spanning several small pieces, some of them shorter than a block.
+		ChainBuilder builder;
+		for (uint64_t size : { 5, 3, 17, 1, 30, 16, 2 })
+			builder.append(size);
+		checkTransfer(pair, builder);
+	}
+	{ // Copied data crossing SEGMENT_SIZE boundaries, mixed with linked buffers.
+		ChainBuilder builder;
+		builder.append(SEGMENT_SIZE - 5);
+		builder.appendBuffer(11);
+		builder.append(2 * SEGMENT_SIZE + 7);
+		builder.appendBuffer(3 * SEGMENT_SIZE + 1);
+		builder.append(9);
+		checkTransfer(pair, builder);
+	}
+	{ // Headers prepended in front of a payload.
+		ChainBuilder builder;
+		builder.appendBuffer(1000);
+		builder.prepend(13);
+		builder.prepend(sizeof(PacketHeader));
+		builder.append(3);
+		checkTransfer(pair, builder);
+	}
+	{ // Block aligned pieces.
+		ChainBuilder builder;
+		builder.append(AES_BLOCK_SIZE);
+		builder.appendBuffer(4 * AES_BLOCK_SIZE);
+		builder.append(SEGMENT_SIZE);
+		checkTransfer(pair, builder);
+	}
+}
+
+int main()
+{
+	for (uint32_t nCryptThreads : { 0, 4 })
+	{
+		auto pair = makeSocketPair(nCryptThreads);
+		CHECK(pair.server);
+		if (!pair.server)
+			continue;
+
+		testChains(pair);
+
+		pair.client->disconnect();
+		pair.server->disconnect();
+	}
+
+	return testResult();
+}
@@ -0,0 +1,141 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <chrono>
+#include <thread>
+#include <cstring>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType TYPE_A = SPT_FIRST_FREE_PACKET_TYPE;
+constexpr PacketType TYPE_B = SPT_FIRST_FREE_PACKET_TYPE + 1;
+
+static void pushSized(ManagedSocket& sender, PacketType packetType, uint64_t size)
+{
+	auto buffer = std::make_shared<PacketBuffer>(size);
+	memset(buffer->data(), 0x22, size);
+	sender.push(packetType, FLAG_PH_NONE, buffer);
+}
+
+/*
+* Wait until a number of packets is pullable.
+*
+* @returns True if the packets arrived within a few seconds. Otherwise false.
+*/
+static bool waitPullable(ManagedSocket& receiver, PacketType packetType, uint64_t n)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (receiver.nPullable(packetType) < n && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return receiver.nPullable(packetType) >= n;
+}
+
+/*
+* Give packets that should be held back the time to arrive anyway.
+*/
+static void settle()
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+}
+
+/*
+* Reading stops at the packet limit of a type and resumes once a packet has been pulled.
+*/
+static void testPacketsPerType(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket sender(pair.client, nThreads);
+	ManagedSocket receiver(pair.server, nThreads);
+	receiver.setRecvLimits(0, 0, 2);
+
+	for (int i = 0; i < 5; ++i)
+		pushSized(sender, TYPE_A, 100);
+
+	CHECK(waitPullable(receiver, TYPE_A, 2));
+	settle();
+	CHECK(receiver.nPullable(TYPE_A) == 2);
+
+	for (int i = 0; i < 5; ++i)
+	{
+		auto pack = receiver.pull(TYPE_A);
+		CHECK(pack.header.packetSize == 100);
+	}
+	CHECK(receiver.nRecvBytesQueued() == 0);
+
+	pair.client->disconnect();
+}
+
+/*
+* Reading stops at the byte limit, but a single packet exceeding it is accepted when nothing else is queued.
+*/
+static void testBytesQueued(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket sender(pair.client, nThreads);
+	ManagedSocket receiver(pair.server, nThreads);
+	receiver.setRecvLimits(0, 1000, 0);
+
+	pushSized(sender, TYPE_A, 600);
+	pushSized(sender, TYPE_B, 600);
+	pushSized(sender, TYPE_A, 5000);
+
+	CHECK(waitPullable(receiver, TYPE_A, 1));
+	settle();
+	CHECK(receiver.nPullable(SPT_UNDEFINED) == 1);
+	CHECK(receiver.nRecvBytesQueued() == 600);
+
+	CHECK(receiver.pull(TYPE_A).header.packetSize == 600);
+	CHECK(receiver.pull(TYPE_B).header.packetSize == 600);
+	CHECK(receiver.pull(TYPE_A).header.packetSize == 5000);
+	CHECK(receiver.nRecvBytesQueued() == 0);
+
+	pair.client->disconnect();
+}
+
+/*
+* A packet exceeding the maximum packet size closes the connection instead of being received.
+*/
+static void testPacketSize(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket sender(pair.client, nThreads);
+	ManagedSocket receiver(pair.server, nThreads);
+	receiver.setRecvLimits(1000, 0, 0);
+
+	pushSized(sender, TYPE_A, 1000);
+	CHECK(receiver.pull(TYPE_A).header.packetSize == 1000);
+
+	pushSized(sender, TYPE_A, 1001);
+	auto pack = receiver.pull(TYPE_A);
+	CHECK(!pack.buffer);
+	CHECK(!receiver.isConnected());
+	CHECK(receiver.nRecvBytesQueued() == 0);
+}
+
+int main()
+{
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		testPacketsPerType(nThreads);
+		testBytesQueued(nThreads);
+		testPacketSize(nThreads);
+	}
+
+	CHECK(ManagedSocket::nGlobalRecvBytesQueued() == 0);
+
+	return testResult();
+}
@@ -0,0 +1,184 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType TYPE_A = SPT_FIRST_FREE_PACKET_TYPE;
+constexpr PacketType TYPE_B = SPT_FIRST_FREE_PACKET_TYPE + 1;
+constexpr PacketType TYPE_C = SPT_FIRST_FREE_PACKET_TYPE + 1000; // Lives on another page of the PacketTypeTable.
+
+/*
+* Push a packet whose single payload byte identifies it.
+*/
+static void pushTagged(ManagedSocket& sender, PacketType packetType, uint8_t tag)
+{
+	auto buffer = std::make_shared<PacketBuffer>(1);
+	buffer->write(&tag, 1);
+	sender.push(packetType, FLAG_PH_NONE, buffer);
+}
+
+static uint8_t tagOf(const Packet& pack)
+{
+	return pack.buffer && pack.buffer->size() == 1 ? *(uint8_t*)pack.buffer->data() : 0;
+}
+
+/*
+* Wait until a number of packets is pullable.
+*
+* @returns True if the packets arrived within a few seconds. Otherwise false.
+*/
+static bool waitPullable(ManagedSocket& receiver, PacketType packetType, uint64_t n)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (receiver.nPullable(packetType) < n && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return receiver.nPullable(packetType) >= n;
+}
+
+/*
+* A pull running on its own thread.
+*/
+struct PendingPull
+{
+	std::atomic_bool done = false;
+	Packet pack;
+	std::thread thread;
+public:
+	PendingPull(ManagedSocket& receiver, PacketType packetType)
+	{
+		thread = std::thread(
+			[this, &receiver, packetType]()
+			{
+				pack = receiver.pull(packetType);
+				done = true;
+			}
+		);
+	}
+	~PendingPull()
+	{
+		thread.join();
+	}
+	bool waitDone()
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (!done && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		return done;
+	}
+};
+
+/*
+* Give pending pulls the time to start waiting (or to return a packet they should not have gotten).
+*/
+static void settle()
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+}
+
+/*
+* Pulls of a type skip other types, pulls of any type return the oldest packet.
+*/
+static void testIndexing(ManagedSocket& sender, ManagedSocket& receiver)
+{
+	pushTagged(sender, TYPE_A, 1);
+	pushTagged(sender, TYPE_B, 2);
+	pushTagged(sender, TYPE_A, 3);
+	pushTagged(sender, TYPE_C, 4);
+	CHECK(waitPullable(receiver, SPT_UNDEFINED, 4));
+
+	CHECK(receiver.nPullable(TYPE_A) == 2);
+	CHECK(receiver.nPullable(TYPE_B) == 1);
+	CHECK(receiver.nPullable(TYPE_C) == 1);
+	CHECK(receiver.nPullable(TYPE_C + 1) == 0);
+
+	auto types = receiver.typesPullable();
+	std::sort(types.begin(), types.end());
+	CHECK(types == std::vector<PacketType>({ TYPE_A, TYPE_B, TYPE_C }));
+
+	CHECK(tagOf(receiver.pull(TYPE_B)) == 2);
+	CHECK(tagOf(receiver.pull(SPT_UNDEFINED)) == 1);
+	CHECK(tagOf(receiver.pull(TYPE_C)) == 4);
+	CHECK(receiver.nPullable(SPT_UNDEFINED) == 1);
+	CHECK(tagOf(receiver.pull(TYPE_A)) == 3);
+	CHECK(receiver.typesPullable().empty());
+}
+
+/*
+* A packet only wakes a pull waiting for its type, waiters for the type take precedence over waiters for any type.
+*/
+static void testWakeups(ManagedSocket& sender, ManagedSocket& receiver)
+{
+	{
+		PendingPull pullA(receiver, TYPE_A);
+		PendingPull pullB(receiver, TYPE_B);
+		settle();
+
+		pushTagged(sender, TYPE_B, 5);
+		CHECK(pullB.waitDone());
+		CHECK(tagOf(pullB.pack) == 5);
+		settle();
+		CHECK(!pullA.done);
+
+		pushTagged(sender, TYPE_A, 6);
+		CHECK(pullA.waitDone());
+		CHECK(tagOf(pullA.pack) == 6);
+	}
+
+	{
+		PendingPull pullAny(receiver, SPT_UNDEFINED);
+		PendingPull pullA(receiver, TYPE_A);
+		settle();
+
+		pushTagged(sender, TYPE_A, 7);
+		CHECK(pullA.waitDone());
+		CHECK(tagOf(pullA.pack) == 7);
+		settle();
+		CHECK(!pullAny.done);
+
+		pushTagged(sender, TYPE_C, 8);
+		CHECK(pullAny.waitDone());
+		CHECK(tagOf(pullAny.pack) == 8);
+	}
+
+	CHECK(receiver.nPullable(SPT_UNDEFINED) == 0);
+}
+
+/*
+* Waiting pulls return an empty packet when the connection is lost.
+*/
+static void testDisconnect(ManagedSocket& receiver)
+{
+	PendingPull pull(receiver, TYPE_A);
+	settle();
+
+	receiver.disconnect();
+	CHECK(pull.waitDone());
+	CHECK(!pull.pack.buffer);
+}
+
+int main()
+{
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		auto pair = makeSocketPair();
+		CHECK(pair.server);
+		if (!pair.server)
+			continue;
+
+		ManagedSocket sender(pair.client, nThreads);
+		ManagedSocket receiver(pair.server, nThreads);
+
+		testIndexing(sender, receiver);
+		testWakeups(sender, receiver);
+		testDisconnect(receiver);
+	}
+
+	return testResult();
+}
@@ -0,0 +1,170 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstring>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType TEST_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE;
+constexpr uint64_t BIG_PACKET_SIZE = 32 * 1024 * 1024; // More than the socket buffers of the loopback connection hold.
+
+static Packet makePacket(uint64_t size)
+{
+	Packet pack;
+	pack.header.packetType = TEST_PACKET_TYPE;
+	if (size > 0)
+	{
+		pack.buffer = std::make_shared<PacketBuffer>(size);
+		memset(pack.buffer->data(), 0x44, size);
+	}
+	return pack;
+}
+
+/*
+* A waitAny call running on its own thread.
+*/
+struct PendingWaitAny
+{
+	std::atomic_bool done = false;
+	int64_t index = -1;
+	std::thread thread;
+public:
+	PendingWaitAny(const std::vector<SendHandle>& handles)
+	{
+		thread = std::thread(
+			[this, handles]()
+			{
+				index = SendHandle::waitAny(handles, 20000); // Outlasts waitDone, so a missing wake-up fails instead of hanging.
+				done = true;
+			}
+		);
+	}
+	~PendingWaitAny()
+	{
+		thread.join();
+	}
+	bool waitDone()
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (!done && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		return done;
+	}
+};
+
+/*
+* Empty handles count as done, so waiting on them never blocks.
+*/
+static void testEmptyHandle()
+{
+	SendHandle handle;
+	CHECK(!handle);
+	CHECK(handle.packetID() == 0);
+	CHECK(handle.status() == SEND_DROPPED);
+	CHECK(handle.isDone());
+	CHECK(handle.waitFor(0));
+	CHECK(SendHandle::waitAll({ handle, handle }, 0));
+	CHECK(SendHandle::waitAny({ handle }, 0) == 0);
+	CHECK(SendHandle::waitAny({}, 0) == -1);
+}
+
+/*
+* Handles stay pending while the peer does not read, timeouts expire and waitAny wakes up once a packet is done.
+*/
+static void testCompletion(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket sender(pair.client, nThreads);
+
+	std::vector<SendHandle> handles;
+	handles.push_back(sender.pushTracked(makePacket(BIG_PACKET_SIZE)));
+	handles.push_back(sender.pushTracked(makePacket(100)));
+	CHECK(handles[0] && handles[1]);
+	CHECK(handles[0].packetID() != handles[1].packetID());
+
+	CHECK(!handles[1].waitFor(50));
+	CHECK(!SendHandle::waitAll(handles, 50));
+	CHECK(SendHandle::waitAny(handles, 50) == -1);
+	for (auto& handle : handles)
+	{
+		CHECK(handle.status() == SEND_PENDING);
+		CHECK(!handle.isDone());
+	}
+
+	{
+		PendingWaitAny waitAny(handles);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		CHECK(!waitAny.done);
+
+		ManagedSocket receiver(pair.server, nThreads);
+		CHECK(waitAny.waitDone());
+		CHECK(waitAny.index >= 0 && handles[waitAny.index].isDone());
+
+		CHECK(SendHandle::waitAll(handles, 10000));
+		CHECK(receiver.pull(TEST_PACKET_TYPE).header.packetSize == BIG_PACKET_SIZE);
+		CHECK(receiver.pull(TEST_PACKET_TYPE).header.packetSize == 100);
+	}
+
+	CHECK(handles[0].status() == SEND_COMPLETE);
+	CHECK(handles[0].nBytesSent() == BIG_PACKET_SIZE);
+	CHECK(handles[1].status() == SEND_COMPLETE);
+	CHECK(handles[1].nBytesSent() == 100);
+
+	pair.client->disconnect();
+}
+
+/*
+* Packets that can't be sent anymore fail and wake up their waiters.
+*/
+static void testFailure(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket sender(pair.client, nThreads);
+
+	std::vector<SendHandle> handles;
+	handles.push_back(sender.pushTracked(makePacket(BIG_PACKET_SIZE)));
+	handles.push_back(sender.pushTracked(makePacket(100)));
+
+	{
+		PendingWaitAny waitAny(handles);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		CHECK(!waitAny.done);
+
+		pair.server->disconnect();
+		CHECK(waitAny.waitDone());
+		CHECK(waitAny.index >= 0);
+	}
+
+	CHECK(SendHandle::waitAll(handles, 10000));
+	CHECK(handles[0].status() == SEND_FAILED);
+	CHECK(handles[0].nBytesSent() < BIG_PACKET_SIZE);
+	CHECK(handles[1].status() == SEND_FAILED || handles[1].status() == SEND_DROPPED);
+
+	pair.client->disconnect();
+}
+
+int main()
+{
+	testEmptyHandle();
+
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		testCompletion(nThreads);
+		testFailure(nThreads);
+	}
+
+	return testResult();
+}
@@ -0,0 +1,143 @@
+#include "EHSN.h"
+#include "TestUtil.h"
+#include "SocketPair.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstring>
+
+using namespace EHSN;
+using namespace EHSN::net;
+
+constexpr PacketType TEST_PACKET_TYPE = SPT_FIRST_FREE_PACKET_TYPE;
+constexpr uint64_t BIG_PACKET_SIZE = 32 * 1024 * 1024; // More than the socket buffers of the loopback connection hold.
+
+static PacketBufferRef makeBuffer(uint64_t size)
+{
+	auto buffer = std::make_shared<PacketBuffer>(size);
+	memset(buffer->data(), 0x11, size);
+	return buffer;
+}
+
+/*
+* Wait until a condition holds.
+*
+* @returns True if the condition held within a few seconds. Otherwise false.
+*/
+template <typename Pred>
+static bool waitUntil(Pred pred)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (!pred() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return pred();
+}
+
+/*
+* The packet limit rejects tryPush and blocks push until the queue drains, control packets are never held back.
+* The peer does not read until the end, so the first big packet stays queued.
+*/
+static void testPacketLimit(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	ManagedSocket sender(pair.client, nThreads);
+	sender.setSendLimits(0, 2);
+
+	CHECK(sender.push(TEST_PACKET_TYPE, FLAG_PH_NONE, makeBuffer(BIG_PACKET_SIZE)));
+	CHECK(sender.tryPush(TEST_PACKET_TYPE, FLAG_PH_NONE, makeBuffer(100)));
+	CHECK(sender.nSendPacketsQueued() == 2);
+
+	// Full.
+	Packet rejected;
+	rejected.header.packetType = TEST_PACKET_TYPE;
+	rejected.buffer = makeBuffer(100);
+	CHECK(sender.tryPush(rejected) == 0);
+	CHECK(!sender.tryPushTracked(rejected));
+	CHECK(sender.nSendPacketsQueued() == 2);
+
+	// Control packets are accepted anyway.
+	CHECK(sender.tryPush(TEST_PACKET_TYPE, FLAG_PH_NONE, makeBuffer(10), PRIO_CONTROL));
+	CHECK(sender.nSendPacketsQueued() == 3);
+
+	std::atomic_bool pushed = false;
+	std::thread pusher(
+		[&]()
+		{
+			sender.push(TEST_PACKET_TYPE, FLAG_PH_NONE, makeBuffer(200));
+			pushed = true;
+		}
+	);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	CHECK(!pushed);
+
+	// Reading releases the blocked push.
+	ManagedSocket receiver(pair.server, nThreads);
+	CHECK(waitUntil([&]() { return pushed.load(); }));
+	pusher.join();
+
+	CHECK(waitUntil([&]() { return receiver.nPullable(TEST_PACKET_TYPE) == 4; }));
+	CHECK(waitUntil([&]() { return sender.nSendPacketsQueued() == 0 && sender.nSendBytesQueued() == 0; }));
+
+	pair.client->disconnect();
+}
+
+/*
+* Drain callback, counts the calls.
+*/
+struct Drained
+{
+	std::atomic_uint32_t nCalls = 0;
+	std::atomic<uint64_t> nBytesQueued = UINT64_MAX;
+public:
+	static void callback(uint64_t nBytesQueued, void* pParam)
+	{
+		auto& drained = *(Drained*)pParam;
+		drained.nBytesQueued = nBytesQueued;
+		++drained.nCalls;
+	}
+};
+
+/*
+* The byte limit accepts a single oversized packet, rejects further packets and reports draining below the low-water mark.
+*/
+static void testByteLimit(uint32_t nThreads)
+{
+	auto pair = makeSocketPair();
+	CHECK(pair.server);
+	if (!pair.server)
+		return;
+
+	Drained drained;
+	ManagedSocket sender(pair.client, nThreads);
+	sender.setSendLimits(1024 * 1024, 0, 1024);
+	sender.setSendDrainCallback(Drained::callback, &drained);
+
+	CHECK(sender.tryPush(TEST_PACKET_TYPE, FLAG_PH_NONE, makeBuffer(BIG_PACKET_SIZE)));
+	CHECK(sender.nSendBytesQueued() == BIG_PACKET_SIZE);
+	CHECK(sender.tryPush(TEST_PACKET_TYPE, FLAG_PH_NONE, makeBuffer(1)) == 0);
+	CHECK(drained.nCalls == 0);
+
+	ManagedSocket receiver(pair.server, nThreads);
+	CHECK(waitUntil([&]() { return drained.nCalls > 0; }));
+	CHECK(drained.nBytesQueued <= 1024);
+	CHECK(sender.tryPush(TEST_PACKET_TYPE, FLAG_PH_NONE, makeBuffer(1)));
+	CHECK(waitUntil([&]() { return receiver.nPullable(TEST_PACKET_TYPE) == 2; }));
+
+	pair.client->disconnect();
+}
+
+int main()
+{
+	for (uint32_t nThreads : { 0, 2 })
+	{
+		testPacketLimit(nThreads);
+		testByteLimit(nThreads);
+	}
+
+	return testResult();
+}
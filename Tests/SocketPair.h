@@ -0,0 +1,62 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <string>
+#include <condition_variable>
+
+#include "EHSN.h"
+
+/*
+* Two connected and secured sockets on the loopback interface.
+*/
+struct SocketPair
+{
+	EHSN::net::SecSocketRef server;
+	EHSN::net::SecSocketRef client;
+};
+
+/*
+* Connect a client to a temporary SecAcceptor and wait until the keys are exchanged.
+*
+* @param nCryptThreads Number of threads used for en-/decryption per socket.
+* @returns The connected sockets. server is null if connecting failed.
+*/
+inline SocketPair makeSocketPair(uint32_t nCryptThreads = 0)
+{
+	struct Accepted
+	{
+		std::mutex mtx;
+		std::condition_variable cond;
+		EHSN::net::SecSocketRef sock;
+	} accepted;
+
+	EHSN::net::SecAcceptor acceptor(
+		"0",
+		[](EHSN::net::SecSocketRef sock, void* pParam)
+		{
+			auto& accepted = *(Accepted*)pParam;
+			std::unique_lock<std::mutex> lock(accepted.mtx);
+			accepted.sock = sock;
+			accepted.cond.notify_one();
+		},
+		&accepted,
+		nullptr,
+		EHSN::crypto::defaultRDG,
+		2048
+	);
+
+	SocketPair pair;
+	pair.client = std::make_shared<EHSN::net::SecSocket>(EHSN::crypto::defaultRDG, nCryptThreads);
+
+	std::thread connector([&]() { pair.client->connect("127.0.0.1", std::to_string(acceptor.getPort()), true); });
+	acceptor.newSession(true, nCryptThreads);
+	connector.join();
+	if (!pair.client->isConnected())
+		return pair;
+
+	std::unique_lock<std::mutex> lock(accepted.mtx);
+	accepted.cond.wait(lock, [&]() { return accepted.sock != nullptr; });
+	pair.server = accepted.sock;
+	return pair;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cstdint>
+
+/*
+* Check a condition and report it if it does not hold.
+*
+* The test keeps running after a failed check. Return testResult() from main.
+*/
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond << std::endl; \
+			++g_nFailedChecks; \
+		} \
+	} while (0)
+
+inline uint64_t g_nFailedChecks = 0;
+
+/*
+* Get the exit code of a test.
+*
+* @returns 0 if all checks passed. Otherwise 1.
+*/
+inline int testResult()
+{
+	if (g_nFailedChecks > 0)
+		std::cerr << g_nFailedChecks << " check(s) failed" << std::endl;
+	return g_nFailedChecks > 0 ? 1 : 0;
+}
+
+/*
+* Create test data.
+*
+* @param size Number of bytes to create.
+* @param seed Seed of the pseudo-random generator.
+* @param compressible If set to true the data consists of repeating runs, otherwise of pseudo-random bytes.
+* @returns The data.
+*/
+inline std::vector<uint8_t> makeTestData(uint64_t size, uint32_t seed, bool compressible)
+{
+	std::vector<uint8_t> data(size);
+	uint32_t state = seed * 2654435761u + 1;
+	for (uint64_t i = 0; i < size; ++i)
+	{
+		if (compressible)
+		{
+			data[i] = (uint8_t)((i / 64 + seed) % 7);
+		}
+		else
+		{
+			state = state * 1664525u + 1013904223u;
+			data[i] = (uint8_t)(state >> 24);
+		}
+	}
+	return data;
+}